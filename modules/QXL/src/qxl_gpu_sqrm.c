@@ -17,7 +17,7 @@
 #define COM1_PORT 0x3F8
 
 const sqrm_module_desc_t sqrm_module_desc = {
-    .abi_version = 1,
+    .abi_version = SQRM_ABI_VERSION,
     .type = SQRM_TYPE_GPU,
     .name = "qxl_gpu",
 };
@@ -174,7 +174,7 @@ static int map_find_regions(const sqrm_kernel_api_t *api, pci_device_t *dev,
 }
 
 int sqrm_module_init(const sqrm_kernel_api_t *api) {
-    if (!api || api->abi_version != 1) return -1;
+    if (!api || api->abi_version != SQRM_ABI_VERSION) return -1;
     g_api = api;
 
     if (!api->pci_find_device || !api->gfx_register_framebuffer || !api->outl || !api->ioremap) {
@@ -181,14 +181,14 @@ static int set_mode_1024_768_32(void) {
 }
 
 static sqrm_module_desc_t sqrm_module_desc = {
-    .abi_version = 1,
+    .abi_version = SQRM_ABI_VERSION,
     .type = SQRM_TYPE_GPU,
     .name = "vmsvga",
 };
 
 int sqrm_module_init(const sqrm_kernel_api_t *api) {
     g_api = api;
-    if (!api || api->abi_version != 1) return -1;
+    if (!api || api->abi_version != SQRM_ABI_VERSION) return -1;
 
     if (!api->pci_find_device || !api->outl || !api->inl) {
         com("[VMSVGA] Missing PCI or IO port capabilities in SQRM API\n");
@@ -11,7 +11,7 @@
 static const uint16_t COM1_PORT = 0x3F8;
 
 const sqrm_module_desc_t sqrm_module_desc = {
-    .abi_version = 1,
+    .abi_version = SQRM_ABI_VERSION,
     .type = SQRM_TYPE_AUDIO,
     .name = "ac97",
 };
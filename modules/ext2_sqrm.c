@@ -27,14 +27,6 @@ static size_t m_strlen(const char *s) {
     return n;
 }
 
-static int m_strcmp(const char *a, const char *b) {
-    if (a == b) return 0;
-    if (!a) return -1;
-    if (!b) return 1;
-    while (*a && (*a == *b)) { a++; b++; }
-    return (unsigned char)*a - (unsigned char)*b;
-}
-
 static char *m_strncpy(char *dst, const char *src, size_t n) {
     if (!dst || n == 0) return dst;
     size_t i = 0;
@@ -57,12 +49,22 @@ static char *m_strncat(char *dst, const char *src, size_t n) {
     return dst;
 }
 
+static void set_bit(uint8_t *bmp, uint32_t bit) {
+    bmp[bit / 8] |= (uint8_t)(1u << (bit % 8));
+}
+static void clear_bit(uint8_t *bmp, uint32_t bit) {
+    bmp[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+}
+static int test_bit(const uint8_t *bmp, uint32_t bit) {
+    return (bmp[bit / 8] & (uint8_t)(1u << (bit % 8))) != 0;
+}
+
 // Declared here because ext2_probe() uses it for debug logging; definition is
 // later in the file.
 static void i32_to_dec(char *out, size_t out_sz, int32_t v);
 
 static const sqrm_module_desc_t sqrm_module_desc = {
-    .abi_version = 1,
+    .abi_version = SQRM_ABI_VERSION,
     .type = SQRM_TYPE_FS,
     .name = "ext2",
 };
@@ -71,6 +73,65 @@ static const sqrm_kernel_api_t *g_api;
 
 #define EXT2_SUPERBLOCK_OFF 1024
 #define EXT2_MAGIC 0xEF53
+#define EXT2_ROOT_INO 2
+#define EXT2_INDEX_FL 0x00001000u // directory has an htree index
+
+#define EXT2_COMPAT_DIR_INDEX 0x0020u
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002u // s_flags: htree hashes use unsigned chars
+#define EXT2_DX_HASH_LEGACY 0
+#define EXT2_DX_HASH_HALF_MD4 1
+#define EXT2_DX_HASH_TEA 2
+#define EXT2_DX_HASH_UNSIGNED 3 // added to the above for the unsigned variants
+
+// Features the write paths understand; anything else makes the volume
+// read-only to this driver.
+#define EXT2_INCOMPAT_FILETYPE 0x0002u
+#define EXT2_RO_COMPAT_SPARSE_SUPER 0x0001u
+#define EXT2_RO_COMPAT_LARGE_FILE 0x0002u
+#define EXT2_INCOMPAT_SUPPORTED (EXT2_INCOMPAT_FILETYPE)
+#define EXT2_RO_COMPAT_SUPPORTED (EXT2_RO_COMPAT_SPARSE_SUPER | EXT2_RO_COMPAT_LARGE_FILE)
+#define EXT2_FT_DIR 2 // dirent file_type of a directory (FILETYPE feature)
+
+// ext4 features that can be read (but not written): extent-mapped inodes and
+// 64-byte group descriptors.
+#define EXT4_INCOMPAT_EXTENTS 0x0040u
+#define EXT4_INCOMPAT_64BIT 0x0080u
+#define EXT4_EXTENTS_FL 0x00080000u // i_flags: i_block holds an extent tree
+#define EXT4_EXT_MAGIC 0xF30Au
+#define EXT4_EXT_INIT_MAX 32768u // longer ee_len values mark unwritten extents
+
+// ext3 journal. JBD structures are big-endian.
+#define EXT3_COMPAT_HAS_JOURNAL 0x0004u
+#define EXT3_INCOMPAT_RECOVER 0x0004u     // journal may hold transactions to replay
+#define EXT3_INCOMPAT_JOURNAL_DEV 0x0008u // volume is an external journal
+#define EXT3_JOURNAL_INO 8
+#define EXT3_JNL_BACKUP_BLOCKS 1          // s_jnl_blocks holds i_block and i_size
+#define JBD_MAGIC 0xC03B3998u
+#define JBD_DESCRIPTOR_BLOCK 1u
+#define JBD_COMMIT_BLOCK 2u
+#define JBD_SUPERBLOCK_V1 3u
+#define JBD_SUPERBLOCK_V2 4u
+#define JBD_REVOKE_BLOCK 5u
+#define JBD_FLAG_ESCAPE 1u    // block began with JBD_MAGIC, stored zeroed
+#define JBD_FLAG_SAME_UUID 2u // no UUID follows the tag
+#define JBD_FLAG_LAST_TAG 8u
+#define JBD_INCOMPAT_REVOKE 0x01u
+#define JBD_INCOMPAT_64BIT 0x02u
+#define JBD_INCOMPAT_CSUM_V2 0x08u
+#define JBD_INCOMPAT_CSUM_V3 0x10u
+// Logs using only these can be replayed (checksums are not verified)...
+#define JBD_INCOMPAT_REPLAY (JBD_INCOMPAT_REVOKE | JBD_INCOMPAT_64BIT | JBD_INCOMPAT_CSUM_V2 | JBD_INCOMPAT_CSUM_V3)
+// ...and these appended to.
+#define JBD_INCOMPAT_WRITE JBD_INCOMPAT_REVOKE
+// Journal superblock fields (byte offsets)
+#define JBD_SB_BLOCKSIZE 12
+#define JBD_SB_MAXLEN 16
+#define JBD_SB_FIRST 20
+#define JBD_SB_SEQUENCE 24
+#define JBD_SB_START 28
+#define JBD_SB_INCOMPAT 40
+#define JBD_SB_UUID 48
+#define JBD_SB_NR_USERS 64
 
 typedef struct __attribute__((packed)) {
     uint32_t s_inodes_count;
@@ -109,6 +170,30 @@ typedef struct __attribute__((packed)) {
     char     s_volume_name[16];
     char     s_last_mounted[64];
     uint32_t s_algorithm_usage_bitmap;
+    uint8_t  s_prealloc_blocks;
+    uint8_t  s_prealloc_dir_blocks;
+    uint16_t s_reserved_gdt_blocks;
+    // ext3 journaling
+    uint8_t  s_journal_uuid[16];
+    uint32_t s_journal_inum;
+    uint32_t s_journal_dev;
+    uint32_t s_last_orphan;
+    // directory indexing
+    uint32_t s_hash_seed[4];
+    uint8_t  s_def_hash_version;
+    uint8_t  s_jnl_backup_type;
+    uint16_t s_desc_size;
+    uint32_t s_default_mount_opts;
+    uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    // ext4
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
 } ext2_superblock_t;
 
 typedef struct __attribute__((packed)) {
@@ -143,6 +228,28 @@ typedef struct __attribute__((packed)) {
     uint8_t  i_osd2[12];
 } ext2_inode_t;
 
+typedef struct __attribute__((packed)) {
+    uint16_t eh_magic;
+    uint16_t eh_entries;
+    uint16_t eh_max;
+    uint16_t eh_depth; // 0 = entries are extents, else index entries
+    uint32_t eh_generation;
+} ext4_extent_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t ee_block;
+    uint16_t ee_len;
+    uint16_t ee_start_hi;
+    uint32_t ee_start_lo;
+} ext4_extent_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t ei_block;
+    uint32_t ei_leaf_lo;
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+} ext4_extent_idx_t;
+
 typedef struct __attribute__((packed)) {
     uint32_t inode;
     uint16_t rec_len;
@@ -151,6 +258,268 @@ typedef struct __attribute__((packed)) {
     char name[0];
 } ext2_dirent_t;
 
+// Per-mount block cache. Fixed pool of block-sized buffers, hashed by block
+// number and recycled in LRU order. Writes only mark the buffer dirty; dirty
+// buffers go to disk on eviction or ext2_bcache_flush().
+#ifndef EXT2_BCACHE_BYTES
+#define EXT2_BCACHE_BYTES (1024u * 1024u)
+#endif
+#define EXT2_BCACHE_MIN_ENTS 16u
+#define EXT2_BCACHE_MAX_ENTS 1024u
+#define EXT2_BCACHE_FLUSH_RUN 16u // max blocks per coalesced write-back request
+#define EXT2_PAGE_SIZE 4096u       // pool alignment for buffers lent out by get_pages()
+// Share of the cache get_pages() may keep lent out at once.
+#ifndef EXT2_BCACHE_PIN_DIV
+#define EXT2_BCACHE_PIN_DIV 4u
+#endif
+
+// Upper bound for a single multi-block data request.
+#ifndef EXT2_MAX_IO_BYTES
+#define EXT2_MAX_IO_BYTES (1024u * 1024u)
+#endif
+
+// Most free runs a file may be split across when defrag relocates it.
+#ifndef EXT2_DEFRAG_MAX_RUNS
+#define EXT2_DEFRAG_MAX_RUNS 16u
+#endif
+
+// Operations grouped into one journal commit; sync() commits at once.
+#ifndef EXT2_JOURNAL_BATCH
+#define EXT2_JOURNAL_BATCH 64u
+#endif
+
+// mkfs gives volumes of 2048 blocks or more an ext3 journal.
+#ifndef EXT2_MKFS_JOURNAL
+#define EXT2_MKFS_JOURNAL 1
+#endif
+
+// mkfs provisions one inode per this many bytes of volume.
+#ifndef EXT2_MKFS_INODE_RATIO
+#define EXT2_MKFS_INODE_RATIO (16u * 1024u)
+#endif
+
+typedef struct {
+    uint32_t blk;
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t ordered;  // dirty file data: written in place, never journalled
+    uint8_t logged;   // dirty contents already committed to the journal
+    uint16_t pins;    // pages lent out by get_pages(); never recycled while set
+    int32_t hnext;    // next entry in hash chain (-1 = end)
+    int32_t lru_prev; // towards most recently used
+    int32_t lru_next; // towards least recently used
+    uint8_t *data;
+} ext2_bcache_ent_t;
+
+typedef struct {
+    uint32_t nents;
+    uint32_t hmask;   // bucket count - 1 (power of two)
+    ext2_bcache_ent_t *ents;
+    int32_t *buckets;
+    int32_t lru_head;
+    int32_t lru_tail;
+    uint8_t *pool;     // page aligned so buffers can be lent out as pages
+    uint8_t *pool_raw; // allocation backing pool
+    uint32_t npinned;  // entries with pins != 0
+    uint32_t ndirty;
+    uint32_t nunlogged; // dirty metadata not yet in the journal
+} ext2_bcache_t;
+
+// Decoded indirect tables for one inode, reused across lookups. Each table is
+// tagged with the physical block it was read from, so a changed pointer in the
+// inode simply misses and reloads. Paths that free or rewrite an inode's
+// indirect blocks must update the map (ext2_set_block_ptr) or reset it.
+// Extent-mapped inodes use the leaf slot and the last extent found instead.
+typedef struct {
+    uint32_t ind_blk;   // single-indirect block held in ind (0 = none)
+    uint32_t dind_blk;  // double-indirect level-1 block held in dind
+    uint32_t dind2_blk; // last used double-indirect level-2 block held in dind2
+    uint32_t tind_blk;  // triple-indirect level-1 block held in tind
+    uint32_t tind2_blk; // last used triple-indirect level-2 block held in tind2
+    uint32_t tind3_blk; // last used triple-indirect level-3 block held in tind3
+    uint32_t *ind;
+    uint32_t *dind;
+    uint32_t *dind2;
+    uint32_t *tind;
+    uint32_t *tind2;
+    uint32_t *tind3;
+    uint32_t leaf_blk;  // extent tree leaf held in leaf
+    uint32_t *leaf;
+    uint32_t ext_lbn;   // last extent found: logical start,
+    uint32_t ext_len;   // length (0 = none)
+    uint32_t ext_pblk;  // and physical start (0 = unwritten)
+} ext2_bmap_t;
+
+// Inode cache. Holds the 128-byte common inode header of recently used inodes,
+// keyed by inode number. Entries pinned with ext2_iget() are never recycled;
+// dirty entries are written back by ext2_icache_flush().
+#ifndef EXT2_ICACHE_ENTS
+#define EXT2_ICACHE_ENTS 512u // must be a power of two
+#endif
+
+// Dentry cache: (parent inode, name) -> child inode for path resolution,
+// including negative entries (ino == 0) for names known to be absent.
+// Directory updates keep it in step through ext2_dcache_set(); rmdir drops
+// every entry under the removed directory.
+#ifndef EXT2_DCACHE_ENTS
+#define EXT2_DCACHE_ENTS 1024u // must be a power of two
+#endif
+#define EXT2_DCACHE_NAME_MAX 43u // longer names bypass the cache
+
+typedef struct {
+    uint32_t parent; // 0 = free slot
+    uint32_t ino;    // 0 = negative entry
+    uint32_t hash;
+    int32_t hnext;
+    int32_t lru_prev;
+    int32_t lru_next;
+    uint8_t name_len;
+    char name[EXT2_DCACHE_NAME_MAX];
+} ext2_dcache_ent_t;
+
+typedef struct {
+    uint32_t nents;
+    uint32_t hmask;
+    ext2_dcache_ent_t *ents;
+    int32_t *buckets;
+    int32_t lru_head;
+    int32_t lru_tail;
+} ext2_dcache_t;
+
+// Small file writes are kept in memory and only allocated and written when
+// the volume is synced, another operation commits, or the buffered total
+// exceeds EXT2_DA_MAX_BYTES. Writes larger than EXT2_DA_FILE_MAX go
+// straight to disk.
+#ifndef EXT2_DA_MAX_BYTES
+#define EXT2_DA_MAX_BYTES (8u * 1024u * 1024u)
+#endif
+#ifndef EXT2_DA_FILE_MAX
+#define EXT2_DA_FILE_MAX (1024u * 1024u)
+#endif
+// Buffered files pin their cache entries; keep most of the cache free.
+#ifndef EXT2_DA_MAX_FILES
+#define EXT2_DA_MAX_FILES (EXT2_ICACHE_ENTS / 4u)
+#endif
+
+// Sequential reads through a file handle prefetch a window of blocks ahead
+// of the reader into the block cache. The window starts at
+// EXT2_RA_MIN_BYTES and doubles on every sequential read up to
+// EXT2_RA_MAX_BYTES (and a quarter of the block cache).
+#ifndef EXT2_RA_MIN_BYTES
+#define EXT2_RA_MIN_BYTES (16u * 1024u)
+#endif
+#ifndef EXT2_RA_MAX_BYTES
+#define EXT2_RA_MAX_BYTES (256u * 1024u)
+#endif
+
+// In-memory name index for large directories that have no htree. Each slot
+// maps a name hash to the directory block holding the name, so a hit costs
+// one (usually cached) block read and a miss costs none. Built on the first
+// lookup in a directory of at least EXT2_DIRHASH_MIN_BLOCKS blocks and kept
+// current by the directory update paths.
+#ifndef EXT2_DIRHASH_MIN_BLOCKS
+#define EXT2_DIRHASH_MIN_BLOCKS 4u
+#endif
+
+typedef struct {
+    uint32_t hash;
+    uint32_t lbn1; // directory block + 1 (0 = empty slot)
+} ext2_dirhash_slot_t;
+
+typedef struct {
+    uint32_t mask; // slot count - 1 (power of two)
+    uint32_t count;
+    ext2_dirhash_slot_t *slots;
+} ext2_dirhash_t;
+
+// Free space map of a linear directory: the bytes a new record could use in
+// each block, including slack that only compaction can join. Built on the
+// first insert into the directory, so later inserts go straight to a block
+// with room instead of scanning the whole directory.
+typedef struct {
+    uint32_t nblocks;
+    uint32_t cap;
+    uint16_t *free;
+} ext2_dirfree_t;
+
+typedef struct {
+    uint32_t ino;     // 0 = free slot
+    uint32_t refs;
+    uint8_t dirty;
+    int32_t hnext;
+    int32_t lru_prev;
+    int32_t lru_next;
+    ext2_inode_t inode;
+    ext2_bmap_t map;
+    ext2_dirhash_t *dh; // directories only, NULL until built
+    ext2_dirfree_t *df; // directories only, NULL until built
+
+    // Delayed allocation: file contents written but not yet given blocks.
+    // While da_buf is set the entry holds a reference and i_block is empty.
+    uint8_t *da_buf;
+    size_t da_len;
+    size_t da_cap;
+    uint32_t da_res;  // blocks reserved for the eventual allocation
+    uint32_t da_goal; // allocation goal chosen at write time
+
+    // Readahead state for handle reads (ext2_readahead()).
+    uint32_t ra_next; // logical block just past the previous read
+    uint32_t ra_end;  // blocks before this one have been read ahead
+    uint32_t ra_win;  // current window in blocks, 0 = not sequential
+} ext2_icache_ent_t;
+
+typedef struct {
+    uint32_t nents;
+    uint32_t hmask;
+    ext2_icache_ent_t *ents;
+    int32_t *buckets;
+    int32_t lru_head;
+    int32_t lru_tail;
+    uint32_t ndirty;
+} ext2_icache_t;
+
+typedef struct {
+    uint8_t *block_bmp; // NULL until first use
+    uint8_t *inode_bmp;
+    uint8_t *pfree;     // blocks freed since the last journal commit
+    uint8_t block_dirty;
+    uint8_t inode_dirty;
+} ext2_group_bmp_t;
+
+typedef struct {
+    uint32_t lblk;
+    uint32_t pblk;
+    uint32_t len;
+} ext2_jrun_t;
+
+// Ordered-mode ext3 journal (JBD format, Linux compatible). Dirty metadata
+// in the block cache forms the running transaction. A commit writes all of
+// it to the log with one sequential request plus the commit block, after
+// file data has gone to its home location. Logged blocks are written home
+// lazily (cache eviction or checkpoint). Blocks freed by the running
+// transaction stay allocated until it commits, so new data never lands in
+// blocks that committed metadata still points at.
+typedef struct {
+    int active;         // transactions are being written
+    ext2_jrun_t *runs;  // log block -> device block, resolved at mount
+    uint32_t nruns;
+    uint8_t *jsb;       // journal superblock (one block)
+    uint32_t first;     // log area is [first, maxlen)
+    uint32_t maxlen;
+    uint32_t start;     // log block of the oldest live transaction, 0 = empty
+    uint32_t head;      // next log block to write
+    uint32_t seq;       // sequence number of the running transaction
+    uint32_t max_txn;   // log blocks one transaction may use
+    uint32_t nops;      // operations in the running transaction
+    uint32_t nfreed;    // blocks held back in the gbmp[].pfree bitmaps
+    uint32_t *live;     // open-addressed set of blocks in the live log (blk + 1)
+    uint32_t live_mask;
+    uint32_t *revoke;   // blocks to revoke in the running transaction
+    uint32_t nrevoke;
+    uint32_t revoke_cap;
+    int must_checkpoint; // a revoke could not be recorded
+} ext2_journal_t;
+
 typedef struct {
     blockdev_handle_t bdev;
     uint64_t part_lba; // partition base LBA
@@ -159,13 +528,45 @@ typedef struct {
     uint32_t groups;
     uint32_t bgdt_block;
     uint32_t inode_size;
+    uint32_t sector_size; // 0 until mount; probe contexts query the device
+    ext2_bcache_t bcache; // ents == NULL => uncached (probe)
+    uint8_t *zero_blk;    // page-aligned zero block get_pages() lends for holes
+    uint8_t *zero_raw;    // allocation backing zero_blk (NULL until first hole)
+
+    ext2_icache_t icache; // ents == NULL => uncached (probe)
+    ext2_dcache_t dcache; // ents == NULL => uncached (probe)
+
+    // In-memory block group descriptor table, loaded at mount. The array is
+    // sized in whole blocks so dirty descriptor blocks can be written straight
+    // from it. NULL => read descriptors from disk (probe).
+    ext2_bgdt_t *bgdt;
+    uint32_t bgdt_blocks;
+    uint8_t *bgdt_dirty; // one flag per descriptor block
+    int sb_dirty;        // free counts in sb changed since last flush
+
+    // Per-group block/inode bitmaps, loaded on first use and written back
+    // lazily by ext2_flush_bitmaps().
+    ext2_group_bmp_t *gbmp;
+    uint32_t orlov_rotor; // spreads top-level directories across groups
+
+    size_t da_bytes;      // file data buffered for delayed allocation
+    uint32_t da_files;    // inodes holding buffered data
+    uint32_t da_reserved; // blocks promised to buffered files
+
+    ext2_journal_t journal;
 } ext2_mount_ctx_t;
 
+static uint32_t bdev_sector_size(ext2_mount_ctx_t *m) {
+    if (m->sector_size) return m->sector_size;
+    blockdev_info_t bi;
+    if (!g_api->block_get_info || g_api->block_get_info(m->bdev, &bi) != 0 || !bi.sector_size) return 0;
+    return bi.sector_size;
+}
+
 static int bdev_read_bytes(ext2_mount_ctx_t *m, uint64_t off, void *buf, size_t sz) {
     blockdev_handle_t bdev = m->bdev;
-    blockdev_info_t bi;
-    if (g_api->block_get_info(bdev, &bi) != 0) return -1;
-    uint32_t ss = bi.sector_size;
+    uint32_t ss = bdev_sector_size(m);
+    if (!ss) return -1;
     uint64_t first = (m->part_lba * (uint64_t)ss + off) / ss;
     uint64_t last = (m->part_lba * (uint64_t)ss + off + sz + ss - 1) / ss;
     uint32_t cnt = (uint32_t)(last - first);
@@ -181,17 +582,416 @@ static int bdev_read_bytes(ext2_mount_ctx_t *m, uint64_t off, void *buf, size_t
     return 0;
 }
 
+static int bdev_write_bytes(ext2_mount_ctx_t *m, uint64_t off, const void *buf, size_t sz) {
+    if (!g_api || !g_api->block_write) return -1;
+    if (sz == 0) return 0;
+
+    uint32_t sector_sz = bdev_sector_size(m);
+    if (!sector_sz) sector_sz = 512;
+
+    uint64_t lba0 = (uint64_t)m->part_lba + (off / sector_sz);
+    uint32_t count = (uint32_t)((sz + sector_sz - 1) / sector_sz);
+
+    // Require sector alignment for now.
+    if ((off % sector_sz) != 0) return -2;
+
+    return g_api->block_write(m->bdev, lba0, count, buf, sz);
+}
+
+// Read whole filesystem blocks straight into buf with one device request.
+static int bdev_read_blocks(ext2_mount_ctx_t *m, uint32_t blk, uint32_t count, void *buf) {
+    uint32_t ss = bdev_sector_size(m);
+    if (!ss || (m->block_size % ss) != 0) return -1;
+    uint32_t spb = m->block_size / ss;
+    uint64_t lba = m->part_lba + (uint64_t)blk * spb;
+    return g_api->block_read(m->bdev, lba, count * spb, buf, (size_t)count * m->block_size);
+}
+
+// --- block cache ---
+
+static uint32_t ext2_bcache_hash(const ext2_bcache_t *c, uint32_t blk) {
+    return (blk * 2654435761u) & c->hmask;
+}
+
+static void ext2_bcache_lru_unlink(ext2_bcache_t *c, int32_t i) {
+    ext2_bcache_ent_t *e = &c->ents[i];
+    if (e->lru_prev >= 0) c->ents[e->lru_prev].lru_next = e->lru_next;
+    else c->lru_head = e->lru_next;
+    if (e->lru_next >= 0) c->ents[e->lru_next].lru_prev = e->lru_prev;
+    else c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = -1;
+}
+
+static void ext2_bcache_lru_push_head(ext2_bcache_t *c, int32_t i) {
+    ext2_bcache_ent_t *e = &c->ents[i];
+    e->lru_prev = -1;
+    e->lru_next = c->lru_head;
+    if (c->lru_head >= 0) c->ents[c->lru_head].lru_prev = i;
+    c->lru_head = i;
+    if (c->lru_tail < 0) c->lru_tail = i;
+}
+
+static void ext2_bcache_hash_remove(ext2_bcache_t *c, int32_t i) {
+    ext2_bcache_ent_t *e = &c->ents[i];
+    int32_t *pp = &c->buckets[ext2_bcache_hash(c, e->blk)];
+    while (*pp >= 0) {
+        if (*pp == i) { *pp = e->hnext; break; }
+        pp = &c->ents[*pp].hnext;
+    }
+    e->hnext = -1;
+}
+
+static int32_t ext2_bcache_find(ext2_bcache_t *c, uint32_t blk) {
+    int32_t i = c->buckets[ext2_bcache_hash(c, blk)];
+    while (i >= 0) {
+        if (c->ents[i].blk == blk) return i;
+        i = c->ents[i].hnext;
+    }
+    return -1;
+}
+
+static int ext2_bcache_init(ext2_mount_ctx_t *m) {
+    ext2_bcache_t *c = &m->bcache;
+    m_memset(c, 0, sizeof(*c));
+
+    uint32_t n = EXT2_BCACHE_BYTES / m->block_size;
+    if (n < EXT2_BCACHE_MIN_ENTS) n = EXT2_BCACHE_MIN_ENTS;
+    if (n > EXT2_BCACHE_MAX_ENTS) n = EXT2_BCACHE_MAX_ENTS;
+
+    uint32_t nb = 1;
+    while (nb < n) nb <<= 1;
+
+    c->ents = (ext2_bcache_ent_t*)g_api->kmalloc(sizeof(ext2_bcache_ent_t) * n);
+    c->buckets = (int32_t*)g_api->kmalloc(sizeof(int32_t) * nb);
+    c->pool_raw = (uint8_t*)g_api->kmalloc((size_t)n * m->block_size + EXT2_PAGE_SIZE - 1);
+    if (!c->ents || !c->buckets || !c->pool_raw) {
+        if (c->ents) g_api->kfree(c->ents);
+        if (c->buckets) g_api->kfree(c->buckets);
+        if (c->pool_raw) g_api->kfree(c->pool_raw);
+        m_memset(c, 0, sizeof(*c));
+        return -1;
+    }
+    c->pool = (uint8_t*)(((uintptr_t)c->pool_raw + EXT2_PAGE_SIZE - 1) & ~(uintptr_t)(EXT2_PAGE_SIZE - 1));
+
+    c->nents = n;
+    c->hmask = nb - 1;
+    c->lru_head = c->lru_tail = -1;
+    for (uint32_t b = 0; b < nb; b++) c->buckets[b] = -1;
+    for (uint32_t i = 0; i < n; i++) {
+        ext2_bcache_ent_t *e = &c->ents[i];
+        e->blk = 0;
+        e->valid = 0;
+        e->dirty = 0;
+        e->pins = 0;
+        e->hnext = -1;
+        e->lru_prev = e->lru_next = -1;
+        e->data = c->pool + (size_t)i * m->block_size;
+        ext2_bcache_lru_push_head(c, (int32_t)i);
+    }
+    return 0;
+}
+
+static int ext2_journal_commit(ext2_mount_ctx_t *m);
+static int ext2_journal_full(ext2_mount_ctx_t *m);
+static int ext2_journal_flush(ext2_mount_ctx_t *m);
+static void ext2_journal_revoke(ext2_mount_ctx_t *m, uint32_t blk, uint32_t count);
+
+static void ext2_bcache_clean(ext2_bcache_t *c, ext2_bcache_ent_t *e) {
+    if (!e->ordered && !e->logged) c->nunlogged--;
+    e->dirty = 0;
+    e->ordered = 0;
+    e->logged = 0;
+    c->ndirty--;
+}
+
+// With a journal, dirty metadata reaches its home location only after the
+// transaction holding it has committed.
+static int ext2_bcache_writeout(ext2_mount_ctx_t *m, int32_t i) {
+    ext2_bcache_t *c = &m->bcache;
+    ext2_bcache_ent_t *e = &c->ents[i];
+    if (!e->valid || !e->dirty) return 0;
+    if (m->journal.active && !e->ordered && !e->logged) {
+        if (ext2_journal_commit(m) != 0) return -1;
+        if (!e->dirty) return 0; // the commit checkpointed it
+    }
+    int rc = bdev_write_bytes(m, (uint64_t)e->blk * m->block_size, e->data, m->block_size);
+    if (rc != 0) return rc;
+    ext2_bcache_clean(c, e);
+    return 0;
+}
+
+// Return the cached buffer for blk, loading it from disk if fill is set.
+// With fill == 0 the caller promises to overwrite the whole block.
+static uint8_t *ext2_bcache_get(ext2_mount_ctx_t *m, uint32_t blk, int fill) {
+    ext2_bcache_t *c = &m->bcache;
+    // Keep the running transaction within what one commit can log.
+    if (m->journal.active && ext2_journal_full(m) && ext2_journal_commit(m) != 0) return NULL;
+    int32_t i = ext2_bcache_find(c, blk);
+    if (i >= 0) {
+        if (c->lru_head != i) {
+            ext2_bcache_lru_unlink(c, i);
+            ext2_bcache_lru_push_head(c, i);
+        }
+        return c->ents[i].data;
+    }
+
+    // Recycle the least recently used buffer that is not lent out.
+    i = c->lru_tail;
+    while (i >= 0 && c->ents[i].pins) i = c->ents[i].lru_prev;
+    if (i < 0) return NULL;
+    ext2_bcache_ent_t *e = &c->ents[i];
+    if (e->valid) {
+        if (ext2_bcache_writeout(m, i) != 0) return NULL;
+        ext2_bcache_hash_remove(c, i);
+        e->valid = 0;
+    }
+
+    if (fill) {
+        if (bdev_read_bytes(m, (uint64_t)blk * m->block_size, e->data, m->block_size) != 0) return NULL;
+    }
+
+    e->blk = blk;
+    e->valid = 1;
+    e->dirty = 0;
+    e->ordered = 0;
+    e->logged = 0;
+    uint32_t h = ext2_bcache_hash(c, blk);
+    e->hnext = c->buckets[h];
+    c->buckets[h] = i;
+    ext2_bcache_lru_unlink(c, i);
+    ext2_bcache_lru_push_head(c, i);
+    return e->data;
+}
+
+// Pull the uncached blocks of [blk, blk + count) into the cache with one
+// device request per missing run. Best effort: on failure the blocks are
+// simply read again (and the error reported) by the normal path.
+static void ext2_bcache_prefetch(ext2_mount_ctx_t *m, uint32_t blk, uint32_t count) {
+    ext2_bcache_t *c = &m->bcache;
+    if (!c->ents || count == 0) return;
+    // A hint must not wipe out the rest of the cache.
+    if (count > c->nents / 4) count = c->nents / 4;
+
+    uint32_t bs = m->block_size;
+    uint8_t *buf = NULL;
+    uint32_t k = 0;
+    while (k < count) {
+        if (ext2_bcache_find(c, blk + k) >= 0) { k++; continue; }
+        uint32_t len = 1;
+        while (k + len < count && ext2_bcache_find(c, blk + k + len) < 0) len++;
+        if (!buf) {
+            buf = (uint8_t*)g_api->kmalloc((size_t)count * bs);
+            if (!buf) return;
+        }
+        if (bdev_read_blocks(m, blk + k, len, buf) != 0) break;
+        for (uint32_t j = 0; j < len; j++) {
+            uint8_t *data = ext2_bcache_get(m, blk + k + j, 0);
+            if (!data) break;
+            m_memcpy(data, buf + (size_t)j * bs, bs);
+        }
+        k += len;
+    }
+    if (buf) g_api->kfree(buf);
+}
+
+// Metadata joins the running transaction.
+static void ext2_bcache_mark_dirty(ext2_mount_ctx_t *m, uint32_t blk) {
+    ext2_bcache_t *c = &m->bcache;
+    int32_t i = ext2_bcache_find(c, blk);
+    if (i < 0) return;
+    ext2_bcache_ent_t *e = &c->ents[i];
+    if (e->dirty && !e->ordered && !e->logged) return;
+    if (!e->dirty) {
+        e->dirty = 1;
+        c->ndirty++;
+    }
+    e->ordered = 0;
+    e->logged = 0;
+    c->nunlogged++;
+}
+
+// File data is never journalled; it is written in place before the next
+// commit instead.
+static void ext2_bcache_mark_data(ext2_mount_ctx_t *m, uint32_t blk) {
+    ext2_bcache_t *c = &m->bcache;
+    int32_t i = ext2_bcache_find(c, blk);
+    if (i < 0) return;
+    ext2_bcache_ent_t *e = &c->ents[i];
+    if (e->dirty && !e->ordered && !e->logged) c->nunlogged--;
+    if (!e->dirty) {
+        e->dirty = 1;
+        c->ndirty++;
+    }
+    e->ordered = 1;
+    e->logged = 0;
+}
+
+// Drop cached copies of blocks [blk, blk + count) that are about to be
+// overwritten directly on the device. A buffer lent out by get_pages() keeps
+// its old contents for the borrower and is recycled once returned.
+static void ext2_bcache_invalidate_range(ext2_mount_ctx_t *m, uint32_t blk, uint32_t count) {
+    ext2_bcache_t *c = &m->bcache;
+    if (!c->ents) return;
+    for (uint32_t k = 0; k < count; k++) {
+        int32_t i = ext2_bcache_find(c, blk + k);
+        if (i < 0) continue;
+        ext2_bcache_ent_t *e = &c->ents[i];
+        if (e->dirty) ext2_bcache_clean(c, e);
+        ext2_bcache_hash_remove(c, i);
+        e->valid = 0;
+        // Reuse invalidated buffers first.
+        ext2_bcache_lru_unlink(c, i);
+        e->lru_prev = c->lru_tail;
+        e->lru_next = -1;
+        if (c->lru_tail >= 0) c->ents[c->lru_tail].lru_next = i;
+        c->lru_tail = i;
+        if (c->lru_head < 0) c->lru_head = i;
+    }
+}
+
+// Write back every dirty buffer in ascending block order, merging physically
+// adjacent blocks into one multi-sector request.
+static int ext2_bcache_flush(ext2_mount_ctx_t *m) {
+    ext2_bcache_t *c = &m->bcache;
+    if (!c->ents || c->ndirty == 0) return 0;
+    if (m->journal.active && c->nunlogged) {
+        if (ext2_journal_commit(m) != 0) return -1;
+        if (c->ndirty == 0) return 0;
+    }
+
+    int32_t *order = (int32_t*)g_api->kmalloc(sizeof(int32_t) * c->ndirty);
+    uint8_t *run = (uint8_t*)g_api->kmalloc((size_t)EXT2_BCACHE_FLUSH_RUN * m->block_size);
+    if (!order || !run) {
+        if (order) g_api->kfree(order);
+        if (run) g_api->kfree(run);
+        // Fall back to one write per buffer.
+        for (uint32_t i = 0; i < c->nents; i++) {
+            if (ext2_bcache_writeout(m, (int32_t)i) != 0) return -1;
+        }
+        return 0;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < c->nents; i++) {
+        if (c->ents[i].valid && c->ents[i].dirty) {
+            // insertion sort by block number; dirty sets are small
+            uint32_t j = n++;
+            while (j > 0 && c->ents[order[j - 1]].blk > c->ents[i].blk) { order[j] = order[j - 1]; j--; }
+            order[j] = (int32_t)i;
+        }
+    }
+
+    int rc = 0;
+    uint32_t k = 0;
+    while (k < n) {
+        uint32_t len = 1;
+        while (k + len < n && len < EXT2_BCACHE_FLUSH_RUN &&
+               c->ents[order[k + len]].blk == c->ents[order[k]].blk + len) len++;
+
+        if (len == 1) {
+            if (ext2_bcache_writeout(m, order[k]) != 0) rc = -2;
+        } else {
+            for (uint32_t j = 0; j < len; j++) {
+                m_memcpy(run + (size_t)j * m->block_size, c->ents[order[k + j]].data, m->block_size);
+            }
+            if (bdev_write_bytes(m, (uint64_t)c->ents[order[k]].blk * m->block_size, run, (size_t)len * m->block_size) != 0) {
+                rc = -2;
+            } else {
+                for (uint32_t j = 0; j < len; j++) ext2_bcache_clean(c, &c->ents[order[k + j]]);
+            }
+        }
+        k += len;
+    }
+
+    g_api->kfree(run);
+    g_api->kfree(order);
+    return rc;
+}
+
+static void ext2_bcache_destroy(ext2_mount_ctx_t *m) {
+    ext2_bcache_t *c = &m->bcache;
+    if (!c->ents) return;
+    (void)ext2_bcache_flush(m);
+    g_api->kfree(c->pool_raw);
+    g_api->kfree(c->buckets);
+    g_api->kfree(c->ents);
+    m_memset(c, 0, sizeof(*c));
+}
+
+static int ext2_read_block(ext2_mount_ctx_t *m, uint32_t blk, void *buf) {
+    if (!m->bcache.ents) {
+        uint64_t off = (uint64_t)blk * m->block_size;
+        return bdev_read_bytes(m, off, buf, m->block_size);
+    }
+    uint8_t *data = ext2_bcache_get(m, blk, 1);
+    if (!data) return -1;
+    m_memcpy(buf, data, m->block_size);
+    return 0;
+}
+
+static int ext2_write_block(ext2_mount_ctx_t *m, uint32_t blk, const void *buf) {
+    if (!m->bcache.ents) {
+        uint64_t off = (uint64_t)blk * m->block_size;
+        return bdev_write_bytes(m, off, buf, m->block_size);
+    }
+    uint8_t *data = ext2_bcache_get(m, blk, 0);
+    if (!data) return -1;
+    m_memcpy(data, buf, m->block_size);
+    ext2_bcache_mark_dirty(m, blk);
+    return 0;
+}
+
+// Read a small metadata structure that lies inside a single block (inode,
+// group descriptor) through the block cache.
+static int ext2_read_meta(ext2_mount_ctx_t *m, uint64_t off, void *buf, size_t sz) {
+    uint32_t blk = (uint32_t)(off / m->block_size);
+    uint32_t in_blk = (uint32_t)(off % m->block_size);
+    if (!m->bcache.ents || in_blk + sz > m->block_size) return bdev_read_bytes(m, off, buf, sz);
+    uint8_t *data = ext2_bcache_get(m, blk, 1);
+    if (!data) return -1;
+    m_memcpy(buf, data + in_blk, sz);
+    return 0;
+}
+
+// Read-modify-write counterpart of ext2_read_meta().
+static int ext2_write_meta(ext2_mount_ctx_t *m, uint64_t off, const void *buf, size_t sz) {
+    uint32_t blk = (uint32_t)(off / m->block_size);
+    uint32_t in_blk = (uint32_t)(off % m->block_size);
+    if (in_blk + sz > m->block_size) return -1;
+
+    if (m->bcache.ents) {
+        uint8_t *data = ext2_bcache_get(m, blk, 1);
+        if (!data) return -2;
+        m_memcpy(data + in_blk, buf, sz);
+        ext2_bcache_mark_dirty(m, blk);
+        return 0;
+    }
+
+    uint8_t *tmp = (uint8_t*)g_api->kmalloc(m->block_size);
+    if (!tmp) return -3;
+    int rc = ext2_read_block(m, blk, tmp);
+    if (rc == 0) {
+        m_memcpy(tmp + in_blk, buf, sz);
+        rc = ext2_write_block(m, blk, tmp);
+    }
+    g_api->kfree(tmp);
+    return rc;
+}
+
 static int ext2_read_super(ext2_mount_ctx_t *m, ext2_superblock_t *out) {
     return bdev_read_bytes(m, EXT2_SUPERBLOCK_OFF, out, sizeof(*out));
 }
 
+static int ext2_write_super(ext2_mount_ctx_t *m) {
+    return ext2_write_meta(m, EXT2_SUPERBLOCK_OFF, &m->sb, sizeof(m->sb));
+}
+
 // Forward declarations for functions used by probe/mount helpers
 static int ext2_read_inode(ext2_mount_ctx_t *m, uint32_t ino, ext2_inode_t *out);
-static int ext2_read_block(ext2_mount_ctx_t *m, uint32_t blk, void *buf);
-static int ext2_write_block(ext2_mount_ctx_t *m, uint32_t blk, const void *buf);
-static int ext2_alloc_block0(ext2_mount_ctx_t *m, uint32_t *out_block);
-static int ext2_alloc_inode0(ext2_mount_ctx_t *m, uint32_t *out_ino);
-static int ext2_set_block_ptr(ext2_mount_ctx_t *m, ext2_inode_t *in, uint32_t lbn, uint32_t pblk);
+static int ext2_alloc_block(ext2_mount_ctx_t *m, uint32_t goal, uint32_t *out_block);
+static int ext2_alloc_run(ext2_mount_ctx_t *m, uint32_t goal, uint32_t want, uint32_t *out_start, uint32_t *out_count);
+static int ext2_set_block_ptr(ext2_mount_ctx_t *m, ext2_inode_t *in, ext2_bmap_t *map, uint32_t lbn, uint32_t pblk);
+static int ext2_truncate_blocks(ext2_mount_ctx_t *m, ext2_inode_t *in, uint32_t keep);
 
 static void u16_to_hex4(char out[5], uint16_t v) {
     static const char h[] = "0123456789ABCDEF";
@@ -297,488 +1097,3185 @@ static int ext2_probe(int vdrive_id, uint32_t partition_lba) {
     return 1;
 }
 
-static int ext2_read_bgdt(ext2_mount_ctx_t *m, uint32_t group, ext2_bgdt_t *out) {
-    uint64_t off = (uint64_t)m->bgdt_block * m->block_size + (uint64_t)group * sizeof(ext2_bgdt_t);
-    return bdev_read_bytes(m, off, out, sizeof(*out));
+// On-disk size of a group descriptor. The 64bit feature widens them; only
+// the low 32 bytes, which match ext2_bgdt_t, are used.
+static uint32_t ext2_desc_size(const ext2_superblock_t *sb) {
+    uint32_t d = sb->s_desc_size;
+    if (sb->s_rev_level < 1 || !(sb->s_feature_incompat & EXT4_INCOMPAT_64BIT)) return sizeof(ext2_bgdt_t);
+    if (d <= sizeof(ext2_bgdt_t) || (d & (d - 1)) != 0) return sizeof(ext2_bgdt_t);
+    return d;
 }
 
-static int ext2_read_inode(ext2_mount_ctx_t *m, uint32_t ino, ext2_inode_t *out) {
-    if (ino == 0) return -1;
-    uint32_t idx = ino - 1;
-    uint32_t group = idx / m->sb.s_inodes_per_group;
-    uint32_t in_group = idx % m->sb.s_inodes_per_group;
-
-    ext2_bgdt_t bg;
-    if (ext2_read_bgdt(m, group, &bg) != 0) return -2;
-
-    uint64_t off = (uint64_t)bg.bg_inode_table * m->block_size + (uint64_t)in_group * m->inode_size;
-    m_memset(out, 0, sizeof(*out));
-    // read only the common header portion
-    size_t rd = sizeof(ext2_inode_t);
-    if (m->inode_size < rd) rd = m->inode_size;
-    return bdev_read_bytes(m, off, out, rd);
+static int ext2_read_bgdt(ext2_mount_ctx_t *m, uint32_t group, ext2_bgdt_t *out) {
+    if (m->bgdt) {
+        if (group >= m->groups) return -1;
+        *out = m->bgdt[group];
+        return 0;
+    }
+    uint64_t off = (uint64_t)m->bgdt_block * m->block_size + (uint64_t)group * ext2_desc_size(&m->sb);
+    return ext2_read_meta(m, off, out, sizeof(*out));
 }
 
-static int ext2_write_inode(ext2_mount_ctx_t *m, uint32_t ino, const ext2_inode_t *in) {
-    if (ino == 0) return -1;
-    if (m->block_size != 4096 || m->groups != 1) return -2; // minimal support for ModuOS-formatted ext2
-
-    uint32_t idx = ino - 1;
-    uint32_t group = idx / m->sb.s_inodes_per_group;
-    uint32_t in_group = idx % m->sb.s_inodes_per_group;
-
-    ext2_bgdt_t bg;
-    if (ext2_read_bgdt(m, group, &bg) != 0) return -3;
-
-    uint64_t inode_off = (uint64_t)bg.bg_inode_table * m->block_size + (uint64_t)in_group * m->inode_size;
-    uint32_t blk = (uint32_t)(inode_off / m->block_size);
-    uint32_t off_in_blk = (uint32_t)(inode_off % m->block_size);
-
-    uint8_t *buf = (uint8_t*)g_api->kmalloc(m->block_size);
-    if (!buf) return -4;
-    if (ext2_read_block(m, blk, buf) != 0) { g_api->kfree(buf); return -5; }
+// Read the whole descriptor table with one device request.
+static int ext2_load_bgdt(ext2_mount_ctx_t *m) {
+    uint32_t dsz = ext2_desc_size(&m->sb);
+    uint32_t per_blk = m->block_size / dsz;
+    m->bgdt_blocks = (m->groups + per_blk - 1) / per_blk;
+    size_t bytes = (size_t)m->bgdt_blocks * m->block_size;
+
+    m->bgdt = (ext2_bgdt_t*)g_api->kmalloc(bytes);
+    m->bgdt_dirty = (uint8_t*)g_api->kmalloc(m->bgdt_blocks);
+    if (!m->bgdt || !m->bgdt_dirty) goto fail;
+    m_memset(m->bgdt_dirty, 0, m->bgdt_blocks);
+
+    if (bdev_read_bytes(m, (uint64_t)m->bgdt_block * m->block_size, m->bgdt, bytes) != 0) goto fail;
+
+    // Wide descriptors are packed down to their low halves in place. Such
+    // volumes are read-only here, so the table is never written back.
+    if (dsz != sizeof(ext2_bgdt_t)) {
+        for (uint32_t g = 1; g < m->groups; g++) {
+            m_memcpy(&m->bgdt[g], (uint8_t*)m->bgdt + (size_t)g * dsz, sizeof(ext2_bgdt_t));
+        }
+    }
+    return 0;
 
-    m_memcpy(buf + off_in_blk, in, sizeof(*in));
-    int rc = ext2_write_block(m, blk, buf);
-    g_api->kfree(buf);
-    return rc;
+fail:
+    if (m->bgdt) g_api->kfree(m->bgdt);
+    if (m->bgdt_dirty) g_api->kfree(m->bgdt_dirty);
+    m->bgdt = NULL;
+    m->bgdt_dirty = NULL;
+    return -1;
 }
 
-static int ext2_read_block(ext2_mount_ctx_t *m, uint32_t blk, void *buf) {
-    uint64_t off = (uint64_t)blk * m->block_size;
-    return bdev_read_bytes(m, off, buf, m->block_size);
+static void ext2_bgdt_mark_dirty(ext2_mount_ctx_t *m, uint32_t group) {
+    if (!m->bgdt_dirty) return;
+    m->bgdt_dirty[group / (m->block_size / sizeof(ext2_bgdt_t))] = 1;
 }
 
-static int bdev_write_bytes(ext2_mount_ctx_t *m, uint64_t off, const void *buf, size_t sz) {
-    if (!g_api || !g_api->block_write) return -1;
-    if (sz == 0) return 0;
+// Adjust the free/used counters of one group and the superblock totals.
+// The changes stay in memory until ext2_flush_meta().
+static void ext2_group_account(ext2_mount_ctx_t *m, uint32_t group, int dblocks, int dinodes, int ddirs) {
+    if (!m->bgdt || group >= m->groups) return;
+    ext2_bgdt_t *bg = &m->bgdt[group];
+    bg->bg_free_blocks_count = (uint16_t)(bg->bg_free_blocks_count + dblocks);
+    bg->bg_free_inodes_count = (uint16_t)(bg->bg_free_inodes_count + dinodes);
+    bg->bg_used_dirs_count = (uint16_t)(bg->bg_used_dirs_count + ddirs);
+    m->sb.s_free_blocks_count = (uint32_t)((int64_t)m->sb.s_free_blocks_count + dblocks);
+    m->sb.s_free_inodes_count = (uint32_t)((int64_t)m->sb.s_free_inodes_count + dinodes);
+    ext2_bgdt_mark_dirty(m, group);
+    if (dblocks || dinodes) m->sb_dirty = 1;
+}
 
-    uint32_t sector_sz = 512;
-    if (g_api->block_get_info) {
-        blockdev_info_t info;
-        if (g_api->block_get_info(m->bdev, &info) == 0 && info.sector_size) sector_sz = info.sector_size;
+// Write back dirty descriptor blocks and the superblock counters.
+static int ext2_flush_meta(ext2_mount_ctx_t *m) {
+    int rc = 0;
+    if (m->bgdt) {
+        for (uint32_t i = 0; i < m->bgdt_blocks; i++) {
+            if (!m->bgdt_dirty[i]) continue;
+            if (ext2_write_block(m, m->bgdt_block + i, (uint8_t*)m->bgdt + (size_t)i * m->block_size) != 0) { rc = -1; continue; }
+            m->bgdt_dirty[i] = 0;
+        }
+    }
+    if (m->sb_dirty) {
+        if (ext2_write_super(m) != 0) rc = -2;
+        else m->sb_dirty = 0;
     }
+    return rc;
+}
 
-    uint64_t lba0 = (uint64_t)m->part_lba + (off / sector_sz);
-    uint32_t count = (uint32_t)((sz + sector_sz - 1) / sector_sz);
+// --- free-space bitmaps ---
 
-    // Require sector alignment for now.
-    if ((off % sector_sz) != 0) return -2;
+static uint32_t ext2_group_first_block(ext2_mount_ctx_t *m, uint32_t group) {
+    return m->sb.s_first_data_block + group * m->sb.s_blocks_per_group;
+}
 
-    return g_api->block_write(m->bdev, lba0, count, buf, sz);
+static uint32_t ext2_group_nblocks(ext2_mount_ctx_t *m, uint32_t group) {
+    uint32_t first = ext2_group_first_block(m, group);
+    if (first >= m->sb.s_blocks_count) return 0;
+    uint32_t n = m->sb.s_blocks_count - first;
+    return (n < m->sb.s_blocks_per_group) ? n : m->sb.s_blocks_per_group;
 }
 
-static int ext2_write_block(ext2_mount_ctx_t *m, uint32_t blk, const void *buf) {
-    uint64_t off = (uint64_t)blk * m->block_size;
-    return bdev_write_bytes(m, off, buf, m->block_size);
+static uint8_t *ext2_load_bitmap(ext2_mount_ctx_t *m, uint8_t **slot, uint32_t blk) {
+    if (*slot) return *slot;
+    uint8_t *bmp = (uint8_t*)g_api->kmalloc(m->block_size);
+    if (!bmp) return NULL;
+    if (ext2_read_block(m, blk, bmp) != 0) { g_api->kfree(bmp); return NULL; }
+    *slot = bmp;
+    return bmp;
 }
 
-static uint32_t ext2_get_block_ptr(ext2_mount_ctx_t *m, const ext2_inode_t *in, uint32_t lbn) {
-    uint32_t ppb = m->block_size / 4;
-    if (lbn < 12) return in->i_block[lbn];
+static uint8_t *ext2_block_bitmap(ext2_mount_ctx_t *m, uint32_t group) {
+    if (!m->gbmp || !m->bgdt || group >= m->groups) return NULL;
+    return ext2_load_bitmap(m, &m->gbmp[group].block_bmp, m->bgdt[group].bg_block_bitmap);
+}
 
-    lbn -= 12;
-    if (lbn < ppb) {
-        uint32_t ind = in->i_block[12];
-        if (!ind) return 0;
-        uint32_t *tmp = (uint32_t*)g_api->kmalloc(m->block_size);
-        if (!tmp) return 0;
-        if (ext2_read_block(m, ind, tmp) != 0) { g_api->kfree(tmp); return 0; }
-        uint32_t v = tmp[lbn];
-        g_api->kfree(tmp);
-        return v;
-    }
-
-    lbn -= ppb;
-    // double indirect
-    uint32_t dind = in->i_block[13];
-    if (!dind) return 0;
-    uint32_t *lvl1 = (uint32_t*)g_api->kmalloc(m->block_size);
-    uint32_t *lvl2 = (uint32_t*)g_api->kmalloc(m->block_size);
-    if (!lvl1 || !lvl2) { if(lvl1) g_api->kfree(lvl1); if(lvl2) g_api->kfree(lvl2); return 0; }
-    if (ext2_read_block(m, dind, lvl1) != 0) { g_api->kfree(lvl1); g_api->kfree(lvl2); return 0; }
-
-    uint32_t idx1 = lbn / ppb;
-    uint32_t idx2 = lbn % ppb;
-    if (idx1 >= ppb) { g_api->kfree(lvl1); g_api->kfree(lvl2); return 0; }
-    uint32_t blk1 = lvl1[idx1];
-    if (!blk1) { g_api->kfree(lvl1); g_api->kfree(lvl2); return 0; }
-    if (ext2_read_block(m, blk1, lvl2) != 0) { g_api->kfree(lvl1); g_api->kfree(lvl2); return 0; }
-    uint32_t v = lvl2[idx2];
-    g_api->kfree(lvl1);
-    g_api->kfree(lvl2);
-    return v;
+static uint8_t *ext2_inode_bitmap(ext2_mount_ctx_t *m, uint32_t group) {
+    if (!m->gbmp || !m->bgdt || group >= m->groups) return NULL;
+    return ext2_load_bitmap(m, &m->gbmp[group].inode_bmp, m->bgdt[group].bg_inode_bitmap);
 }
 
-static int ext2_read_inode_data(ext2_mount_ctx_t *m, const ext2_inode_t *in, uint64_t off, void *buf, size_t sz) {
-    uint8_t *out = (uint8_t*)buf;
-    uint64_t file_size = in->i_size;
-    if (off >= file_size) return 0;
-    if (off + sz > file_size) sz = (size_t)(file_size - off);
+// First bit in [start, limit) equal to val, or limit if there is none. Whole
+// 64-bit words are skipped at once; ext2 bitmaps are little-endian, which
+// matches the word layout on x86_64.
+static uint32_t ext2_bitmap_find(const uint8_t *bmp, uint32_t start, uint32_t limit, int val) {
+    uint32_t b = start;
+    while (b < limit && (b & 63u)) {
+        if (test_bit(bmp, b) == val) return b;
+        b++;
+    }
+    const uint64_t *w = (const uint64_t*)bmp;
+    const uint64_t skip = val ? 0ull : ~0ull;
+    while (b + 64u <= limit) {
+        uint64_t x = w[b / 64u];
+        if (x != skip) {
+            uint64_t y = val ? x : ~x;
+            return b + (uint32_t)__builtin_ctzll(y);
+        }
+        b += 64u;
+    }
+    while (b < limit) {
+        if (test_bit(bmp, b) == val) return b;
+        b++;
+    }
+    return limit;
+}
 
-    uint32_t bs = m->block_size;
-    uint32_t start_lbn = (uint32_t)(off / bs);
-    uint32_t end_lbn = (uint32_t)((off + sz + bs - 1) / bs);
+static void ext2_bitmap_set_range(uint8_t *bmp, uint32_t start, uint32_t count) {
+    uint32_t b = start, end = start + count;
+    while (b < end && (b & 7u)) set_bit(bmp, b++);
+    while (b + 8u <= end) { bmp[b / 8u] = 0xFF; b += 8u; }
+    while (b < end) set_bit(bmp, b++);
+}
 
-    uint8_t *blkbuf = (uint8_t*)g_api->kmalloc(bs);
-    if (!blkbuf) return -1;
+// Clear bits [start, start + count) and return how many of them were set.
+static uint32_t ext2_bitmap_clear_range(uint8_t *bmp, uint32_t start, uint32_t count) {
+    uint32_t b = start, end = start + count, n = 0;
+    while (b < end && (b & 7u)) { n += (uint32_t)test_bit(bmp, b); clear_bit(bmp, b++); }
+    while (b + 8u <= end) {
+        for (uint8_t v = bmp[b / 8u]; v; v &= (uint8_t)(v - 1u)) n++;
+        bmp[b / 8u] = 0;
+        b += 8u;
+    }
+    while (b < end) { n += (uint32_t)test_bit(bmp, b); clear_bit(bmp, b++); }
+    return n;
+}
 
-    size_t outpos = 0;
-    for (uint32_t lbn = start_lbn; lbn < end_lbn; lbn++) {
-        uint32_t pblk = ext2_get_block_ptr(m, in, lbn);
-        m_memset(blkbuf, 0, bs);
-        if (pblk != 0) {
-            (void)ext2_read_block(m, pblk, blkbuf);
+// Look for a free run of want bits in [0, nbits): the first one at or after
+// from (wrapping around), otherwise the longest run seen. Returns the run
+// length (0 => no free bit) and its first bit in *out_bit.
+static uint32_t ext2_bitmap_best_run(const uint8_t *bmp, uint32_t nbits, uint32_t from, uint32_t want, uint32_t *out_bit) {
+    uint32_t best_len = 0, best_bit = 0;
+    if (from >= nbits) from = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t b = pass ? 0 : from;
+        uint32_t lim = pass ? from : nbits;
+        while (b < lim) {
+            uint32_t z = ext2_bitmap_find(bmp, b, lim, 0);
+            if (z >= lim) break;
+            uint32_t cap = (nbits - z > want) ? z + want : nbits;
+            uint32_t e = ext2_bitmap_find(bmp, z, cap, 1);
+            uint32_t len = e - z;
+            if (len >= want) {
+                *out_bit = z;
+                return len;
+            }
+            if (len > best_len) { best_len = len; best_bit = z; }
+            b = e;
         }
+    }
+    *out_bit = best_bit;
+    return best_len;
+}
 
-        uint64_t lbn_off = (uint64_t)lbn * bs;
-        uint64_t copy_start = (off > lbn_off) ? (off - lbn_off) : 0;
-        uint64_t copy_end = bs;
-        if (lbn_off + copy_end > off + sz) copy_end = (off + sz) - lbn_off;
-        if (copy_end > bs) copy_end = bs;
-
-        size_t csz = (size_t)(copy_end - copy_start);
-        m_memcpy(out + outpos, blkbuf + copy_start, csz);
-        outpos += csz;
+// Write dirty bitmaps back through the block cache.
+static int ext2_flush_bitmaps(ext2_mount_ctx_t *m) {
+    if (!m->gbmp) return 0;
+    int rc = 0;
+    for (uint32_t g = 0; g < m->groups; g++) {
+        ext2_group_bmp_t *gb = &m->gbmp[g];
+        if (gb->block_dirty) {
+            if (ext2_write_block(m, m->bgdt[g].bg_block_bitmap, gb->block_bmp) != 0) rc = -1;
+            else gb->block_dirty = 0;
+        }
+        if (gb->inode_dirty) {
+            if (ext2_write_block(m, m->bgdt[g].bg_inode_bitmap, gb->inode_bmp) != 0) rc = -1;
+            else gb->inode_dirty = 0;
+        }
     }
+    return rc;
+}
 
-    g_api->kfree(blkbuf);
-    return (int)outpos;
+static void ext2_free_bitmaps(ext2_mount_ctx_t *m) {
+    if (!m->gbmp) return;
+    for (uint32_t g = 0; g < m->groups; g++) {
+        if (m->gbmp[g].block_bmp) g_api->kfree(m->gbmp[g].block_bmp);
+        if (m->gbmp[g].inode_bmp) g_api->kfree(m->gbmp[g].inode_bmp);
+        if (m->gbmp[g].pfree) g_api->kfree(m->gbmp[g].pfree);
+    }
+    g_api->kfree(m->gbmp);
+    m->gbmp = NULL;
 }
 
-static int ext2_readlink(ext2_mount_ctx_t *m, const ext2_inode_t *in, char *out, size_t out_sz) {
-    if (out_sz == 0) return -1;
-    size_t len = in->i_size;
-    if (len >= out_sz) len = out_sz - 1;
-
-    // Fast symlink: stored in i_block bytes if small
-    if (in->i_size <= sizeof(in->i_block)) {
-        m_memcpy(out, in->i_block, len);
-        out[len] = 0;
-        return 0;
+// Mutating paths need every on-disk feature that changes layout or
+// allocation to be one this driver understands. A volume that needs
+// recovery is writable only while this driver owns its journal.
+static int ext2_writable(ext2_mount_ctx_t *m) {
+    if (m->block_size < 1024 || m->block_size > 32768) return 0;
+    if (m->sb.s_rev_level >= 1) {
+        uint32_t incompat = m->sb.s_feature_incompat;
+        if (m->journal.active) incompat &= ~EXT3_INCOMPAT_RECOVER;
+        if (incompat & ~EXT2_INCOMPAT_SUPPORTED) return 0;
+        if (m->sb.s_feature_ro_compat & ~EXT2_RO_COMPAT_SUPPORTED) return 0;
     }
-
-    int r = ext2_read_inode_data(m, in, 0, out, len);
-    if (r < 0) return r;
-    out[r] = 0;
-    return 0;
+    return 1;
 }
 
-static int ext2_lookup_in_dir(ext2_mount_ctx_t *m, const ext2_inode_t *dir, const char *name, uint32_t *out_ino) {
-    uint32_t bs = m->block_size;
-    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
-    if (!blk) return -1;
+static uint32_t ext2_block_group(ext2_mount_ctx_t *m, uint32_t blk) {
+    if (blk < m->sb.s_first_data_block) return 0;
+    uint32_t g = (blk - m->sb.s_first_data_block) / m->sb.s_blocks_per_group;
+    return (g < m->groups) ? g : m->groups - 1;
+}
 
-    uint32_t entries = (dir->i_size + bs - 1) / bs;
-    for (uint32_t lbn = 0; lbn < entries; lbn++) {
-        uint32_t pblk = ext2_get_block_ptr(m, dir, lbn);
-        if (!pblk) continue;
-        if (ext2_read_block(m, pblk, blk) != 0) continue;
+// Allocation goal for blocks owned by ino: the start of its inode's group,
+// so data lands next to the inode table that describes it.
+static uint32_t ext2_inode_goal(ext2_mount_ctx_t *m, uint32_t ino) {
+    if (ino == 0) return m->sb.s_first_data_block;
+    uint32_t g = (ino - 1) / m->sb.s_inodes_per_group;
+    if (g >= m->groups) g = 0;
+    return ext2_group_first_block(m, g);
+}
 
-        uint32_t off = 0;
-        while (off + sizeof(ext2_dirent_t) <= bs) {
-            ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
-            if (de->rec_len == 0) break;
-            if (de->inode != 0 && de->name_len > 0) {
-                char nm[256];
-                size_t nlen = de->name_len;
-                if (nlen >= sizeof(nm)) nlen = sizeof(nm) - 1;
-                m_memcpy(nm, de->name, nlen);
-                nm[nlen] = 0;
-                if (m_strcmp(nm, name) == 0) {
-                    *out_ino = de->inode;
-                    g_api->kfree(blk);
-                    return 0;
-                }
-            }
-            off += de->rec_len;
+// Reserve up to want consecutive free blocks near goal. The goal's group is
+// searched from goal onwards first; if it has no run long enough, the other
+// groups are tried in order and the longest run seen is the fallback.
+// Groups whose free count cannot beat the best run so far are skipped
+// without touching their bitmap.
+static int ext2_alloc_run(ext2_mount_ctx_t *m, uint32_t goal, uint32_t want, uint32_t *out_start, uint32_t *out_count) {
+    if (!g_api || !out_start || !out_count || want == 0) return -1;
+    if (!m->bgdt) return -2;
+
+    // Blocks held back by the running transaction are freed by committing it.
+    if (m->journal.nfreed && m->sb.s_free_blocks_count < m->da_reserved + want) (void)ext2_journal_flush(m);
+
+    // Blocks reserved for buffered writes are not available to anyone else.
+    if (m->sb.s_free_blocks_count <= m->da_reserved) return -7;
+    if (want > m->sb.s_free_blocks_count - m->da_reserved) want = m->sb.s_free_blocks_count - m->da_reserved;
+
+    if (goal < m->sb.s_first_data_block || goal >= m->sb.s_blocks_count) goal = m->sb.s_first_data_block;
+    uint32_t g0 = ext2_block_group(m, goal);
+
+    uint32_t best_len = 0, best_bit = 0, best_group = 0;
+    for (uint32_t k = 0; k < m->groups; k++) {
+        uint32_t g = (g0 + k) % m->groups;
+        uint32_t nfree = m->bgdt[g].bg_free_blocks_count;
+        if (nfree == 0 || nfree <= best_len) continue;
+
+        uint8_t *bmp = ext2_block_bitmap(m, g);
+        if (!bmp) return -3;
+
+        uint32_t first = ext2_group_first_block(m, g);
+        uint32_t from = (k == 0 && goal > first) ? goal - first : 0;
+        uint32_t bit = 0;
+        uint32_t len = ext2_bitmap_best_run(bmp, ext2_group_nblocks(m, g), from, want, &bit);
+        if (len > best_len) {
+            best_len = len;
+            best_bit = bit;
+            best_group = g;
         }
+        if (best_len >= want) break;
     }
+    if (best_len == 0) return -7;
 
-    g_api->kfree(blk);
-    return -2;
+    ext2_bitmap_set_range(m->gbmp[best_group].block_bmp, best_bit, best_len);
+    m->gbmp[best_group].block_dirty = 1;
+    ext2_group_account(m, best_group, -(int)best_len, 0, 0);
+    *out_start = ext2_group_first_block(m, best_group) + best_bit;
+    *out_count = best_len;
+    return 0;
 }
 
-static int ext2_resolve_path(ext2_mount_ctx_t *m, const char *path, uint32_t *out_ino, int hop) {
-    if (!path || !out_ino) return -1;
-    if (hop > 8) return -9;
-
-    // Root
-    uint32_t cur_ino = 2;
-    ext2_inode_t cur;
-    if (ext2_read_inode(m, cur_ino, &cur) != 0) return -2;
+static int ext2_alloc_block(ext2_mount_ctx_t *m, uint32_t goal, uint32_t *out_block) {
+    uint32_t got = 0;
+    return ext2_alloc_run(m, goal, 1, out_block, &got);
+}
 
-    // skip leading '/'
-    while (*path == '/') path++;
-    if (!*path) { *out_ino = cur_ino; return 0; }
+static int ext2_group_has_room(ext2_mount_ctx_t *m, uint32_t g) {
+    return m->bgdt[g].bg_free_inodes_count != 0 && m->bgdt[g].bg_free_blocks_count != 0;
+}
 
-    char seg[256];
-    const char *p = path;
-    while (*p) {
-        size_t i = 0;
-        while (p[i] && p[i] != '/') {
-            if (i + 1 < sizeof(seg)) seg[i] = p[i];
-            i++;
-        }
-        seg[(i < sizeof(seg)) ? i : (sizeof(seg) - 1)] = 0;
+// Group for a new non-directory inode: the parent's group, then a quadratic
+// probe, then any group with a free inode (the scheme Linux ext2 uses).
+static int ext2_find_group_other(ext2_mount_ctx_t *m, uint32_t parent_group) {
+    uint32_t n = m->groups;
+    if (ext2_group_has_room(m, parent_group)) return (int)parent_group;
 
-        while (p[i] == '/') i++;
-        const char *next = p + i;
+    uint32_t g = parent_group;
+    for (uint32_t i = 1; i < n; i <<= 1) {
+        g = (g + i) % n;
+        if (ext2_group_has_room(m, g)) return (int)g;
+    }
+    for (uint32_t i = 1; i <= n; i++) {
+        g = (parent_group + i) % n;
+        if (m->bgdt[g].bg_free_inodes_count) return (int)g;
+    }
+    return -1;
+}
 
-        uint32_t next_ino = 0;
-        if (ext2_lookup_in_dir(m, &cur, seg, &next_ino) != 0) return -3;
+// Orlov placement for a new directory. Top-level directories are spread out:
+// pick the group with the fewest directories among those with at least
+// average free inodes and blocks. Deeper directories stay near their parent
+// unless its neighbourhood is crowded with directories or short on space.
+static int ext2_find_group_dir(ext2_mount_ctx_t *m, uint32_t parent_ino) {
+    uint32_t n = m->groups;
+    uint32_t parent_group = (parent_ino - 1) / m->sb.s_inodes_per_group;
+    if (parent_group >= n) parent_group = 0;
+
+    uint32_t avg_inodes = m->sb.s_free_inodes_count / n;
+    uint32_t avg_blocks = m->sb.s_free_blocks_count / n;
+    uint32_t ndirs = 0;
+    for (uint32_t g = 0; g < n; g++) ndirs += m->bgdt[g].bg_used_dirs_count;
+
+    if (parent_ino == EXT2_ROOT_INO) {
+        int best = -1;
+        uint32_t best_dirs = 0xFFFFFFFFu;
+        uint32_t start = m->orlov_rotor++ % n;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t g = (start + i) % n;
+            const ext2_bgdt_t *bg = &m->bgdt[g];
+            if (bg->bg_free_inodes_count == 0) continue;
+            if (bg->bg_free_inodes_count < avg_inodes) continue;
+            if (bg->bg_free_blocks_count < avg_blocks) continue;
+            if (bg->bg_used_dirs_count < best_dirs) {
+                best = (int)g;
+                best_dirs = bg->bg_used_dirs_count;
+            }
+        }
+        if (best >= 0) return best;
+    } else {
+        uint32_t ipg = m->sb.s_inodes_per_group;
+        uint32_t bpg = m->sb.s_blocks_per_group;
+        uint32_t max_dirs = ndirs / n + ipg / 16;
+        uint32_t min_inodes = (avg_inodes > ipg / 4) ? avg_inodes - ipg / 4 : 1;
+        uint32_t min_blocks = (avg_blocks > bpg / 4) ? avg_blocks - bpg / 4 : 1;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t g = (parent_group + i) % n;
+            const ext2_bgdt_t *bg = &m->bgdt[g];
+            if (bg->bg_used_dirs_count >= max_dirs) continue;
+            if (bg->bg_free_inodes_count < min_inodes) continue;
+            if (bg->bg_free_blocks_count < min_blocks) continue;
+            return (int)g;
+        }
+    }
 
-        ext2_inode_t nin;
-        if (ext2_read_inode(m, next_ino, &nin) != 0) return -4;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t g = (parent_group + i) % n;
+        if (m->bgdt[g].bg_free_inodes_count && m->bgdt[g].bg_free_inodes_count >= avg_inodes) return (int)g;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t g = (parent_group + i) % n;
+        if (m->bgdt[g].bg_free_inodes_count) return (int)g;
+    }
+    return -1;
+}
 
-        // symlink?
-        if ((nin.i_mode & 0xF000) == 0xA000) {
-            char target[512];
-            if (ext2_readlink(m, &nin, target, sizeof(target)) != 0) return -5;
+// Allocate an inode for a new child of parent_ino. Directories are placed
+// with ext2_find_group_dir(), everything else near the parent.
+static int ext2_alloc_inode(ext2_mount_ctx_t *m, uint32_t parent_ino, int is_dir, uint32_t *out_ino) {
+    if (!g_api || !out_ino) return -1;
+    if (!m->bgdt || parent_ino == 0) return -2;
+
+    uint32_t ipg = m->sb.s_inodes_per_group;
+    int pick = is_dir ? ext2_find_group_dir(m, parent_ino)
+                      : ext2_find_group_other(m, (parent_ino - 1) / ipg % m->groups);
+    if (pick < 0) return -7;
+
+    // skip reserved inodes 1..11 (or up to s_first_ino on rev1 volumes)
+    uint32_t reserved = 11;
+    if (m->sb.s_rev_level >= 1 && m->sb.s_first_ino > 12) reserved = m->sb.s_first_ino - 1;
+
+    // The descriptor counts steer the choice; the bitmap has the last word.
+    for (uint32_t i = 0; i < m->groups; i++) {
+        uint32_t group = ((uint32_t)pick + i) % m->groups;
+        if (m->bgdt[group].bg_free_inodes_count == 0) continue;
+        uint8_t *bmp = ext2_inode_bitmap(m, group);
+        if (!bmp) return -3;
+
+        uint32_t start = (group == 0) ? reserved : 0;
+        uint32_t bit = ext2_bitmap_find(bmp, start, ipg, 0);
+        if (bit >= ipg) continue;
+
+        set_bit(bmp, bit);
+        m->gbmp[group].inode_dirty = 1;
+        ext2_group_account(m, group, 0, -1, is_dir ? 1 : 0);
+        *out_ino = group * ipg + bit + 1;
+        return 0;
+    }
+    return -7;
+}
 
-            // build new path: target + '/' + remainder
-            char newp[1024];
-            newp[0] = 0;
-            if (target[0] == '/') {
-                m_strncpy(newp, target, sizeof(newp) - 1);
-            } else {
-                // relative to current directory
-                m_strncpy(newp, "/", sizeof(newp) - 1);
-                m_strncat(newp, target, sizeof(newp) - m_strlen(newp) - 1);
-            }
-            if (*next) {
-                if (newp[m_strlen(newp) - 1] != '/') m_strncat(newp, "/", sizeof(newp) - m_strlen(newp) - 1);
-                m_strncat(newp, next, sizeof(newp) - m_strlen(newp) - 1);
+// Journal mode: mark bits [bit, bit + n) of group as freed by the running
+// transaction without clearing them. Returns how many were newly held.
+static uint32_t ext2_free_hold(ext2_mount_ctx_t *m, uint32_t group, uint8_t *bmp, uint32_t bit, uint32_t n) {
+    ext2_group_bmp_t *gb = &m->gbmp[group];
+    if (!gb->pfree) {
+        gb->pfree = (uint8_t*)g_api->kmalloc(m->block_size);
+        if (!gb->pfree) {
+            // No memory to hold them: free now and checkpoint on commit.
+            m->journal.must_checkpoint = 1;
+            uint32_t c = ext2_bitmap_clear_range(bmp, bit, n);
+            if (c) {
+                gb->block_dirty = 1;
+                ext2_group_account(m, group, (int)c, 0, 0);
             }
-
-            return ext2_resolve_path(m, newp, out_ino, hop + 1);
+            return c;
         }
+        m_memset(gb->pfree, 0, m->block_size);
+    }
+    uint32_t c = 0;
+    for (uint32_t b = bit; b < bit + n; b++) {
+        if (test_bit(bmp, b) && !test_bit(gb->pfree, b)) {
+            set_bit(gb->pfree, b);
+            c++;
+        }
+    }
+    m->journal.nfreed += c;
+    return c;
+}
 
-        // advance
-        cur_ino = next_ino;
-        cur = nin;
-        p = next;
-        if (!*p) break;
+// Free blocks [start, start + count): the bitmap is cleared a group at a
+// time and each group's counters are adjusted once. Cached copies of the
+// blocks are dropped so dirty buffers are not written to freed space.
+// With a journal the blocks stay allocated until the transaction freeing
+// them commits (ext2_journal_release()).
+// Returns the number of blocks that were actually in use.
+static uint32_t ext2_free_run(ext2_mount_ctx_t *m, uint32_t start, uint32_t count) {
+    if (!g_api || count == 0) return 0;
+    if (start < m->sb.s_first_data_block || start >= m->sb.s_blocks_count) return 0;
+    if (count > m->sb.s_blocks_count - start) count = m->sb.s_blocks_count - start;
+
+    ext2_bcache_invalidate_range(m, start, count);
+    ext2_journal_revoke(m, start, count);
+
+    uint32_t bpg = m->sb.s_blocks_per_group;
+    uint32_t freed = 0;
+    while (count) {
+        uint32_t group = (start - m->sb.s_first_data_block) / bpg;
+        uint32_t bit = (start - m->sb.s_first_data_block) % bpg;
+        uint32_t n = bpg - bit;
+        if (n > count) n = count;
+        uint8_t *bmp = ext2_block_bitmap(m, group);
+        if (bmp && m->journal.active) {
+            freed += ext2_free_hold(m, group, bmp, bit, n);
+        } else if (bmp) {
+            uint32_t c = ext2_bitmap_clear_range(bmp, bit, n);
+            if (c) {
+                m->gbmp[group].block_dirty = 1;
+                ext2_group_account(m, group, (int)c, 0, 0);
+                freed += c;
+            }
+        }
+        start += n;
+        count -= n;
     }
+    return freed;
+}
 
-    *out_ino = cur_ino;
+static int ext2_free_block(ext2_mount_ctx_t *m, uint32_t blk) {
+    if (!g_api) return -1;
+    if (blk < m->sb.s_first_data_block || blk >= m->sb.s_blocks_count) return -3;
+    (void)ext2_free_run(m, blk, 1);
     return 0;
 }
 
-static int ext2_stat(fs_mount_t *mount, const char *path, fs_file_info_t *info) {
-    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
-    uint32_t ino;
-    if (ext2_resolve_path(m, path, &ino, 0) != 0) return -1;
-    ext2_inode_t in;
-    if (ext2_read_inode(m, ino, &in) != 0) return -2;
+// Blocks released by one operation, merged into physical runs as they are
+// queued and handed to ext2_free_run() when the list fills or is flushed.
+#define EXT2_FREE_RUNS 32u
 
-    m_memset(info, 0, sizeof(*info));
-    info->size = in.i_size;
-    info->is_directory = ((in.i_mode & 0xF000) == 0x4000);
-    return 0;
+typedef struct {
+    uint32_t start[EXT2_FREE_RUNS];
+    uint32_t len[EXT2_FREE_RUNS];
+    uint32_t n;
+    uint32_t freed; // blocks released so far
+} ext2_freelist_t;
+
+static void ext2_freelist_flush(ext2_mount_ctx_t *m, ext2_freelist_t *fl) {
+    for (uint32_t i = 0; i < fl->n; i++) fl->freed += ext2_free_run(m, fl->start[i], fl->len[i]);
+    fl->n = 0;
 }
 
-static int ext2_file_exists(fs_mount_t *mount, const char *path) {
-    fs_file_info_t i;
-    if (ext2_stat(mount, path, &i) != 0) return 0;
-    return i.is_directory ? 0 : 1;
+static void ext2_freelist_add(ext2_mount_ctx_t *m, ext2_freelist_t *fl, uint32_t blk) {
+    if (!blk) return;
+    if (fl->n) {
+        uint32_t k = fl->n - 1;
+        if (blk == fl->start[k] + fl->len[k]) { fl->len[k]++; return; }
+        if (blk + 1u == fl->start[k]) { fl->start[k] = blk; fl->len[k]++; return; }
+    }
+    if (fl->n == EXT2_FREE_RUNS) ext2_freelist_flush(m, fl);
+    fl->start[fl->n] = blk;
+    fl->len[fl->n] = 1;
+    fl->n++;
 }
 
-static int ext2_dir_exists(fs_mount_t *mount, const char *path) {
-    fs_file_info_t i;
-    if (ext2_stat(mount, path, &i) != 0) return 0;
-    return i.is_directory ? 1 : 0;
-}
+static int ext2_free_inode(ext2_mount_ctx_t *m, uint32_t ino, int is_dir) {
+    if (!g_api) return -1;
+    if (ino == 0 || ino > m->sb.s_inodes_count) return -3;
 
-static int ext2_read_file(fs_mount_t *mount, const char *path, void *buffer, size_t buffer_size, size_t *bytes_read) {
-    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
-    uint32_t ino;
-    if (ext2_resolve_path(m, path, &ino, 0) != 0) return -1;
-    ext2_inode_t in;
-    if (ext2_read_inode(m, ino, &in) != 0) return -2;
-    if (((in.i_mode & 0xF000) != 0x8000) && ((in.i_mode & 0xF000) != 0xA000)) return -3;
+    uint32_t group = (ino - 1) / m->sb.s_inodes_per_group;
+    uint32_t bit = (ino - 1) % m->sb.s_inodes_per_group;
+    uint8_t *bmp = ext2_inode_bitmap(m, group);
+    if (!bmp) return -4;
 
-    int r = ext2_read_inode_data(m, &in, 0, buffer, buffer_size);
-    if (r < 0) return r;
-    if (bytes_read) *bytes_read = (size_t)r;
+    if (!test_bit(bmp, bit)) return 0;
+    clear_bit(bmp, bit);
+    m->gbmp[group].inode_dirty = 1;
+    ext2_group_account(m, group, 0, 1, is_dir ? -1 : 0);
     return 0;
 }
 
-static int ext2_add_dirent_root_typed(ext2_mount_ctx_t *m, uint32_t ino, const char *name, uint8_t ftype) {
-    // Minimal: add to root directory only (inode 2), single-block directories from ModuOS mkfs.
-    ext2_inode_t root;
-    if (ext2_read_inode(m, 2, &root) != 0) return -1;
-    if ((root.i_mode & 0xF000) != 0x4000) return -2;
-
-    uint32_t bs = m->block_size;
-    uint32_t pblk = root.i_block[0];
-    if (!pblk) return -3;
+// Byte offset of an inode's on-disk slot.
+static int ext2_inode_offset(ext2_mount_ctx_t *m, uint32_t ino, uint64_t *out_off) {
+    if (ino == 0) return -1;
+    uint32_t idx = ino - 1;
+    uint32_t group = idx / m->sb.s_inodes_per_group;
+    uint32_t in_group = idx % m->sb.s_inodes_per_group;
 
-    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
-    if (!blk) return -4;
-    if (ext2_read_block(m, pblk, blk) != 0) { g_api->kfree(blk); return -5; }
+    ext2_bgdt_t bg;
+    if (ext2_read_bgdt(m, group, &bg) != 0) return -2;
 
-    size_t nlen = m_strlen(name);
-    if (nlen == 0 || nlen > 255) { g_api->kfree(blk); return -6; }
+    *out_off = (uint64_t)bg.bg_inode_table * m->block_size + (uint64_t)in_group * m->inode_size;
+    return 0;
+}
 
-    // Find last entry in block to see if it has slack.
-    uint32_t off = 0;
-    ext2_dirent_t *last = NULL;
-    while (off + sizeof(ext2_dirent_t) <= bs) {
-        ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
-        if (de->rec_len == 0) break;
-        last = de;
-        off += de->rec_len;
-        if (off >= bs) break;
-    }
-    if (!last) { g_api->kfree(blk); return -7; }
+static int ext2_read_inode_disk(ext2_mount_ctx_t *m, uint32_t ino, ext2_inode_t *out) {
+    uint64_t off;
+    if (ext2_inode_offset(m, ino, &off) != 0) return -2;
+    m_memset(out, 0, sizeof(*out));
+    // read only the common header portion
+    size_t rd = sizeof(ext2_inode_t);
+    if (m->inode_size < rd) rd = m->inode_size;
+    return ext2_read_meta(m, off, out, rd);
+}
 
-    uint32_t last_name = last->name_len;
-    uint32_t last_used = (uint32_t)((8 + last_name + 3) & ~3u);
-    uint32_t last_slack = last->rec_len - last_used;
+static int ext2_write_inode_disk(ext2_mount_ctx_t *m, uint32_t ino, const ext2_inode_t *in) {
+    uint64_t off;
+    if (ext2_inode_offset(m, ino, &off) != 0) return -3;
+    return ext2_write_meta(m, off, in, sizeof(*in));
+}
 
-    uint32_t need = (uint32_t)((8 + nlen + 3) & ~3u);
-    if (last_slack < need) { g_api->kfree(blk); return -8; }
+// --- block map cache ---
+
+static void ext2_bmap_reset(ext2_bmap_t *map) {
+    if (!map) return;
+    map->ind_blk = 0;
+    map->dind_blk = 0;
+    map->dind2_blk = 0;
+    map->tind_blk = 0;
+    map->tind2_blk = 0;
+    map->tind3_blk = 0;
+    map->leaf_blk = 0;
+    map->ext_len = 0;
+}
 
-    // Shrink last and place new entry after it.
-    last->rec_len = (uint16_t)last_used;
-    ext2_dirent_t *ne = (ext2_dirent_t*)((uint8_t*)last + last_used);
-    m_memset(ne, 0, sizeof(ext2_dirent_t));
-    ne->inode = ino;
-    ne->name_len = (uint8_t)nlen;
-    ne->file_type = ftype;
-    ne->rec_len = (uint16_t)last_slack;
-    m_memcpy(ne->name, name, nlen);
+static void ext2_bmap_free(ext2_bmap_t *map) {
+    if (!map) return;
+    if (map->ind) g_api->kfree(map->ind);
+    if (map->dind) g_api->kfree(map->dind);
+    if (map->dind2) g_api->kfree(map->dind2);
+    if (map->tind) g_api->kfree(map->tind);
+    if (map->tind2) g_api->kfree(map->tind2);
+    if (map->tind3) g_api->kfree(map->tind3);
+    if (map->leaf) g_api->kfree(map->leaf);
+    m_memset(map, 0, sizeof(*map));
+}
 
-    int rc = ext2_write_block(m, pblk, blk);
-    g_api->kfree(blk);
-    return rc;
+// Return the decoded table for indirect block blk, reading it only if the
+// slot currently holds a different block.
+static uint32_t *ext2_bmap_table(ext2_mount_ctx_t *m, uint32_t *tag, uint32_t **tbl, uint32_t blk) {
+    if (!blk) return NULL;
+    if (!*tbl) {
+        *tbl = (uint32_t*)g_api->kmalloc(m->block_size);
+        if (!*tbl) return NULL;
+        *tag = 0;
+    }
+    if (*tag == blk) return *tbl;
+    *tag = 0;
+    if (ext2_read_block(m, blk, *tbl) != 0) return NULL;
+    *tag = blk;
+    return *tbl;
 }
 
-static int ext2_add_dirent_root(ext2_mount_ctx_t *m, uint32_t file_ino, const char *name) {
-    return ext2_add_dirent_root_typed(m, file_ino, name, 1);
+static void ext2_dirhash_free(ext2_dirhash_t **pdh) {
+    if (!*pdh) return;
+    if ((*pdh)->slots) g_api->kfree((*pdh)->slots);
+    g_api->kfree(*pdh);
+    *pdh = NULL;
 }
 
-static int ext2_free_block0(ext2_mount_ctx_t *m, uint32_t blk) {
-    if (!g_api) return -1;
-    if (m->groups != 1 || m->block_size != 4096) return -2;
+static void ext2_dirfree_free(ext2_dirfree_t **pdf) {
+    if (!*pdf) return;
+    if ((*pdf)->free) g_api->kfree((*pdf)->free);
+    g_api->kfree(*pdf);
+    *pdf = NULL;
+}
 
-    ext2_bgdt_t bg;
-    if (ext2_read_bgdt(m, 0, &bg) != 0) return -3;
+// --- inode cache ---
 
-    uint8_t *bmp = (uint8_t*)g_api->kmalloc(m->block_size);
-    if (!bmp) return -4;
-    if (ext2_read_block(m, bg.bg_block_bitmap, bmp) != 0) { g_api->kfree(bmp); return -5; }
+static uint32_t ext2_icache_hash(const ext2_icache_t *c, uint32_t ino) {
+    return (ino * 2654435761u) & c->hmask;
+}
 
-    // Clear bit
-    bmp[blk / 8] &= (uint8_t)~(1u << (blk % 8));
-    int rc = ext2_write_block(m, bg.bg_block_bitmap, bmp);
-    g_api->kfree(bmp);
-    return rc;
+static void ext2_icache_lru_unlink(ext2_icache_t *c, int32_t i) {
+    ext2_icache_ent_t *e = &c->ents[i];
+    if (e->lru_prev >= 0) c->ents[e->lru_prev].lru_next = e->lru_next;
+    else c->lru_head = e->lru_next;
+    if (e->lru_next >= 0) c->ents[e->lru_next].lru_prev = e->lru_prev;
+    else c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = -1;
 }
 
-static int ext2_free_inode0(ext2_mount_ctx_t *m, uint32_t ino) {
-    if (!g_api) return -1;
-    if (m->groups != 1 || m->block_size != 4096) return -2;
-    if (ino == 0) return -3;
+static void ext2_icache_lru_push_head(ext2_icache_t *c, int32_t i) {
+    ext2_icache_ent_t *e = &c->ents[i];
+    e->lru_prev = -1;
+    e->lru_next = c->lru_head;
+    if (c->lru_head >= 0) c->ents[c->lru_head].lru_prev = i;
+    c->lru_head = i;
+    if (c->lru_tail < 0) c->lru_tail = i;
+}
 
-    ext2_bgdt_t bg;
-    if (ext2_read_bgdt(m, 0, &bg) != 0) return -4;
+static void ext2_icache_hash_remove(ext2_icache_t *c, int32_t i) {
+    ext2_icache_ent_t *e = &c->ents[i];
+    int32_t *pp = &c->buckets[ext2_icache_hash(c, e->ino)];
+    while (*pp >= 0) {
+        if (*pp == i) { *pp = e->hnext; break; }
+        pp = &c->ents[*pp].hnext;
+    }
+    e->hnext = -1;
+}
 
-    uint8_t *bmp = (uint8_t*)g_api->kmalloc(m->block_size);
-    if (!bmp) return -5;
-    if (ext2_read_block(m, bg.bg_inode_bitmap, bmp) != 0) { g_api->kfree(bmp); return -6; }
+static int32_t ext2_icache_find(ext2_icache_t *c, uint32_t ino) {
+    int32_t i = c->buckets[ext2_icache_hash(c, ino)];
+    while (i >= 0) {
+        if (c->ents[i].ino == ino) return i;
+        i = c->ents[i].hnext;
+    }
+    return -1;
+}
 
-    uint32_t idx = ino - 1;
-    bmp[idx / 8] &= (uint8_t)~(1u << (idx % 8));
-    int rc = ext2_write_block(m, bg.bg_inode_bitmap, bmp);
-    g_api->kfree(bmp);
-    return rc;
+static int ext2_icache_init(ext2_mount_ctx_t *m) {
+    ext2_icache_t *c = &m->icache;
+    m_memset(c, 0, sizeof(*c));
+
+    uint32_t n = EXT2_ICACHE_ENTS;
+    c->ents = (ext2_icache_ent_t*)g_api->kmalloc(sizeof(ext2_icache_ent_t) * n);
+    c->buckets = (int32_t*)g_api->kmalloc(sizeof(int32_t) * n);
+    if (!c->ents || !c->buckets) {
+        if (c->ents) g_api->kfree(c->ents);
+        if (c->buckets) g_api->kfree(c->buckets);
+        m_memset(c, 0, sizeof(*c));
+        return -1;
+    }
+    m_memset(c->ents, 0, sizeof(ext2_icache_ent_t) * n);
+
+    c->nents = n;
+    c->hmask = n - 1;
+    c->lru_head = c->lru_tail = -1;
+    for (uint32_t b = 0; b < n; b++) c->buckets[b] = -1;
+    for (uint32_t i = 0; i < n; i++) {
+        c->ents[i].hnext = -1;
+        ext2_icache_lru_push_head(c, (int32_t)i);
+    }
+    return 0;
 }
 
-static int ext2_remove_dirent_root(ext2_mount_ctx_t *m, const char *name) {
-    // Minimal: root only, one-block directory. We just mark inode=0.
-    ext2_inode_t root;
-    if (ext2_read_inode(m, 2, &root) != 0) return -1;
-    if ((root.i_mode & 0xF000) != 0x4000) return -2;
+static int ext2_icache_writeout(ext2_mount_ctx_t *m, int32_t i) {
+    ext2_icache_t *c = &m->icache;
+    ext2_icache_ent_t *e = &c->ents[i];
+    if (!e->ino || !e->dirty) return 0;
+    if (ext2_write_inode_disk(m, e->ino, &e->inode) != 0) return -1;
+    e->dirty = 0;
+    c->ndirty--;
+    return 0;
+}
 
-    uint32_t bs = m->block_size;
-    uint32_t pblk = root.i_block[0];
-    if (!pblk) return -3;
+// Look up (and pin) the cache entry for ino. With load == 0 the caller is
+// about to overwrite the whole inode, so a miss does not read the disk.
+static ext2_icache_ent_t *ext2_icache_lookup(ext2_mount_ctx_t *m, uint32_t ino, int load) {
+    ext2_icache_t *c = &m->icache;
+    int32_t i = ext2_icache_find(c, ino);
+    if (i >= 0) {
+        if (c->lru_head != i) {
+            ext2_icache_lru_unlink(c, i);
+            ext2_icache_lru_push_head(c, i);
+        }
+        return &c->ents[i];
+    }
 
-    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
-    if (!blk) return -4;
-    if (ext2_read_block(m, pblk, blk) != 0) { g_api->kfree(blk); return -5; }
+    // Recycle the least recently used unpinned entry.
+    i = c->lru_tail;
+    while (i >= 0 && c->ents[i].refs) i = c->ents[i].lru_prev;
+    if (i < 0) return NULL;
 
-    size_t nlen = m_strlen(name);
-    if (nlen == 0 || nlen > 255) { g_api->kfree(blk); return -6; }
+    ext2_icache_ent_t *e = &c->ents[i];
+    if (e->ino) {
+        if (ext2_icache_writeout(m, i) != 0) return NULL;
+        ext2_icache_hash_remove(c, i);
+        e->ino = 0;
+    }
+    ext2_bmap_free(&e->map);
+    ext2_dirhash_free(&e->dh);
+    ext2_dirfree_free(&e->df);
 
-    uint32_t off = 0;
-    while (off + sizeof(ext2_dirent_t) <= bs) {
-        ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
-        if (de->rec_len == 0) break;
-        if (de->inode != 0 && de->name_len == nlen) {
-            // compare
-            int match = 1;
-            for (size_t i = 0; i < nlen; i++) {
-                if (((const char*)de->name)[i] != name[i]) { match = 0; break; }
-            }
-            if (match) {
-                de->inode = 0;
-                int rc = ext2_write_block(m, pblk, blk);
-                g_api->kfree(blk);
-                return rc;
-            }
-        }
-        off += de->rec_len;
-        if (off >= bs) break;
+    if (load) {
+        if (ext2_read_inode_disk(m, ino, &e->inode) != 0) return NULL;
     }
 
-    g_api->kfree(blk);
-    return -7;
+    e->ino = ino;
+    e->dirty = 0;
+    e->refs = 0;
+    e->ra_next = e->ra_end = e->ra_win = 0;
+    uint32_t h = ext2_icache_hash(c, ino);
+    e->hnext = c->buckets[h];
+    c->buckets[h] = i;
+    ext2_icache_lru_unlink(c, i);
+    ext2_icache_lru_push_head(c, i);
+    return e;
 }
 
-static uint16_t ext2_dirent_min_rec_len(uint8_t name_len) {
+// Take a reference on a cached inode. The entry stays resident (and the
+// pointer valid) until the matching ext2_iput().
+static ext2_icache_ent_t *ext2_iget(ext2_mount_ctx_t *m, uint32_t ino) {
+    if (!m->icache.ents || ino == 0) return NULL;
+    ext2_icache_ent_t *e = ext2_icache_lookup(m, ino, 1);
+    if (e) e->refs++;
+    return e;
+}
+
+static void ext2_iput(ext2_mount_ctx_t *m, ext2_icache_ent_t *e) {
+    (void)m;
+    if (e && e->refs) e->refs--;
+}
+
+static void ext2_icache_mark_dirty(ext2_mount_ctx_t *m, ext2_icache_ent_t *e) {
+    if (e->dirty) return;
+    e->dirty = 1;
+    m->icache.ndirty++;
+}
+
+// Write back all dirty inodes. Dirty slots are grouped by inode-table block
+// so several updates to the same block cost one block write.
+static int ext2_icache_flush(ext2_mount_ctx_t *m) {
+    ext2_icache_t *c = &m->icache;
+    if (!c->ents || c->ndirty == 0) return 0;
+
+    int rc = 0;
+    uint8_t *tmp = NULL;
+    if (!m->bcache.ents) {
+        tmp = (uint8_t*)g_api->kmalloc(m->block_size);
+        if (!tmp) {
+            for (uint32_t i = 0; i < c->nents; i++) {
+                if (ext2_icache_writeout(m, (int32_t)i) != 0) rc = -1;
+            }
+            return rc;
+        }
+    }
+
+    for (uint32_t i = 0; i < c->nents; i++) {
+        ext2_icache_ent_t *e = &c->ents[i];
+        if (!e->ino || !e->dirty) continue;
+
+        uint64_t off;
+        if (ext2_inode_offset(m, e->ino, &off) != 0) { rc = -2; continue; }
+        uint32_t blk = (uint32_t)(off / m->block_size);
+
+        uint8_t *data = tmp;
+        if (!tmp) data = ext2_bcache_get(m, blk, 1);
+        else if (ext2_read_block(m, blk, tmp) != 0) data = NULL;
+        if (!data) { rc = -3; continue; }
+
+        // Patch every dirty inode that lives in this block.
+        for (uint32_t j = i; j < c->nents; j++) {
+            ext2_icache_ent_t *o = &c->ents[j];
+            if (!o->ino || !o->dirty) continue;
+            uint64_t ooff;
+            if (ext2_inode_offset(m, o->ino, &ooff) != 0) continue;
+            if ((uint32_t)(ooff / m->block_size) != blk) continue;
+            m_memcpy(data + (ooff % m->block_size), &o->inode, sizeof(o->inode));
+            o->dirty = 0;
+            c->ndirty--;
+        }
+
+        if (!tmp) ext2_bcache_mark_dirty(m, blk);
+        else if (ext2_write_block(m, blk, tmp) != 0) rc = -4;
+    }
+
+    if (tmp) g_api->kfree(tmp);
+    return rc;
+}
+
+static void ext2_icache_destroy(ext2_mount_ctx_t *m) {
+    ext2_icache_t *c = &m->icache;
+    if (!c->ents) return;
+    (void)ext2_icache_flush(m);
+    for (uint32_t i = 0; i < c->nents; i++) {
+        ext2_bmap_free(&c->ents[i].map);
+        ext2_dirhash_free(&c->ents[i].dh);
+        ext2_dirfree_free(&c->ents[i].df);
+        if (c->ents[i].da_buf) g_api->kfree(c->ents[i].da_buf);
+    }
+    g_api->kfree(c->buckets);
+    g_api->kfree(c->ents);
+    m_memset(c, 0, sizeof(*c));
+}
+
+// Drop the buffered contents of e along with its reservation and pin.
+static void ext2_da_release(ext2_mount_ctx_t *m, ext2_icache_ent_t *e) {
+    if (!e->da_buf) return;
+    g_api->kfree(e->da_buf);
+    m->da_bytes -= e->da_len;
+    m->da_reserved -= e->da_res;
+    m->da_files--;
+    e->da_buf = NULL;
+    e->da_len = e->da_cap = 0;
+    e->da_res = 0;
+    e->da_goal = 0;
+    ext2_iput(m, e);
+}
+
+// Replace the buffered contents of e, reserving nres blocks for the eventual
+// allocation. The buffer is reused when it is big enough, so a file that is
+// rewritten over and over costs one copy per write and no disk I/O.
+static int ext2_da_stage(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, const void *src, size_t size, uint32_t nres, uint32_t goal) {
+    if (!e->da_buf || e->da_cap < size) {
+        uint8_t *nb = (uint8_t*)g_api->kmalloc(size);
+        if (!nb) return -1;
+        if (e->da_buf) {
+            g_api->kfree(e->da_buf);
+        } else {
+            e->refs++;
+            m->da_files++;
+        }
+        e->da_buf = nb;
+        e->da_cap = size;
+    }
+    m->da_bytes = m->da_bytes - e->da_len + size;
+    m->da_reserved = m->da_reserved - e->da_res + nres;
+    m_memcpy(e->da_buf, src, size);
+    e->da_len = size;
+    e->da_res = nres;
+    e->da_goal = goal;
+    return 0;
+}
+
+// Block map of a cached inode, or NULL when the inode cache is unavailable.
+static ext2_bmap_t *ext2_bmap_for(ext2_mount_ctx_t *m, uint32_t ino) {
+    if (!m->icache.ents || ino == 0) return NULL;
+    ext2_icache_ent_t *e = ext2_icache_lookup(m, ino, 1);
+    return e ? &e->map : NULL;
+}
+
+static int ext2_read_inode(ext2_mount_ctx_t *m, uint32_t ino, ext2_inode_t *out) {
+    if (ino == 0) return -1;
+    if (!m->icache.ents) return ext2_read_inode_disk(m, ino, out);
+    ext2_icache_ent_t *e = ext2_icache_lookup(m, ino, 1);
+    if (!e) return -2;
+    *out = e->inode;
+    return 0;
+}
+
+static int ext2_write_inode(ext2_mount_ctx_t *m, uint32_t ino, const ext2_inode_t *in) {
+    if (ino == 0) return -1;
+    if (!ext2_writable(m)) return -2;
+
+    if (!m->icache.ents) return ext2_write_inode_disk(m, ino, in);
+    ext2_icache_ent_t *e = ext2_icache_lookup(m, ino, 0);
+    if (!e) return -3;
+    e->inode = *in;
+    ext2_icache_mark_dirty(m, e);
+    return 0;
+}
+
+// --- ext4 extent trees (read-only) ---
+
+// Index of the last of n sorted keys (stride bytes apart, starting at base)
+// that is <= lbn, or -1 if lbn comes before all of them.
+static int32_t ext2_ext_search(const uint8_t *base, uint32_t n, uint32_t stride, uint32_t lbn) {
+    int32_t lo = 0, hi = (int32_t)n - 1, pick = -1;
+    while (lo <= hi) {
+        int32_t mid = (lo + hi) / 2;
+        uint32_t key = *(const uint32_t*)(base + (size_t)mid * stride);
+        if (key <= lbn) { pick = mid; lo = mid + 1; }
+        else hi = mid - 1;
+    }
+    return pick;
+}
+
+// Map lbn of an extent-mapped inode. Returns the physical block (0 = hole or
+// unwritten extent) and in *out_len how many blocks from lbn on stay inside
+// the same extent or hole. The leaf block and the last extent found are kept
+// in map, so walking a file costs one tree descent per extent.
+static uint32_t ext2_ext_map(ext2_mount_ctx_t *m, const ext2_inode_t *in, ext2_bmap_t *map, uint32_t lbn, uint32_t *out_len) {
+    *out_len = 1;
+    if (map && map->ext_len && lbn - map->ext_lbn < map->ext_len) {
+        uint32_t k = lbn - map->ext_lbn;
+        *out_len = map->ext_len - k;
+        return map->ext_pblk ? map->ext_pblk + k : 0;
+    }
+
+    ext2_bmap_t tmp;
+    if (!map) {
+        m_memset(&tmp, 0, sizeof(tmp));
+        map = &tmp;
+    }
+
+    uint32_t bs = m->block_size;
+    const ext4_extent_header_t *h = (const ext4_extent_header_t*)in->i_block;
+    uint32_t cap = (uint32_t)((sizeof(in->i_block) - sizeof(*h)) / sizeof(ext4_extent_t));
+    uint32_t *ibuf = NULL;
+    uint32_t v = 0;
+
+    for (uint32_t level = 0; ; level++) {
+        if (h->eh_magic != EXT4_EXT_MAGIC || h->eh_entries > cap || level > 5) goto out;
+        if (h->eh_depth == 0) break;
+
+        const ext4_extent_idx_t *ix = (const ext4_extent_idx_t*)(h + 1);
+        int32_t i = ext2_ext_search((const uint8_t*)ix, h->eh_entries, sizeof(*ix), lbn);
+        if (i < 0 || ix[i].ei_leaf_hi) goto out;
+        uint32_t child = ix[i].ei_leaf_lo;
+        uint16_t depth = h->eh_depth;
+
+        // Leaves stay cached in map; upper index levels are re-read (they
+        // normally come from the block cache).
+        if (depth == 1) {
+            h = (const ext4_extent_header_t*)ext2_bmap_table(m, &map->leaf_blk, &map->leaf, child);
+        } else {
+            if (!ibuf) ibuf = (uint32_t*)g_api->kmalloc(bs);
+            h = (ibuf && ext2_read_block(m, child, ibuf) == 0) ? (const ext4_extent_header_t*)ibuf : NULL;
+        }
+        if (!h || h->eh_depth != depth - 1) goto out;
+        cap = (bs - (uint32_t)sizeof(*h)) / (uint32_t)sizeof(ext4_extent_t);
+    }
+
+    const ext4_extent_t *ex = (const ext4_extent_t*)(h + 1);
+    int32_t i = ext2_ext_search((const uint8_t*)ex, h->eh_entries, sizeof(*ex), lbn);
+    if (i >= 0) {
+        uint32_t len = ex[i].ee_len;
+        int unwritten = len > EXT4_EXT_INIT_MAX;
+        if (unwritten) len -= EXT4_EXT_INIT_MAX;
+        if (lbn - ex[i].ee_block < len) {
+            uint32_t pstart = (unwritten || ex[i].ee_start_hi) ? 0 : ex[i].ee_start_lo;
+            map->ext_lbn = ex[i].ee_block;
+            map->ext_len = len;
+            map->ext_pblk = pstart;
+            uint32_t k = lbn - ex[i].ee_block;
+            *out_len = len - k;
+            v = pstart ? pstart + k : 0;
+            goto out;
+        }
+    }
+    // A hole, up to the next extent of this leaf.
+    if ((uint32_t)(i + 1) < h->eh_entries) *out_len = ex[i + 1].ee_block - lbn;
+
+out:
+    if (ibuf) g_api->kfree(ibuf);
+    if (map == &tmp) ext2_bmap_free(&tmp);
+    return v;
+}
+
+// Size of an inode. On regular files i_dir_acl holds the high 32 bits
+// (large_file); other inodes keep it for its old meaning.
+static uint64_t ext2_isize(const ext2_inode_t *in) {
+    uint64_t size = in->i_size;
+    if ((in->i_mode & 0xF000) == 0x8000) size |= (uint64_t)in->i_dir_acl << 32;
+    return size;
+}
+
+// Store the size of a regular file. The first file to reach 2 GiB turns on
+// large_file in the superblock, as Linux does.
+static void ext2_set_isize(ext2_mount_ctx_t *m, ext2_inode_t *in, uint64_t size) {
+    in->i_size = (uint32_t)size;
+    in->i_dir_acl = (uint32_t)(size >> 32);
+    if (size > 0x7FFFFFFFull && !(m->sb.s_feature_ro_compat & EXT2_RO_COMPAT_LARGE_FILE)) {
+        m->sb.s_feature_ro_compat |= EXT2_RO_COMPAT_LARGE_FILE;
+        m->sb_dirty = 1;
+    }
+}
+
+// Map a logical block to its physical block (0 = hole). map may be NULL, in
+// which case the indirect tables are read into a temporary map and dropped.
+static uint32_t ext2_get_block_ptr(ext2_mount_ctx_t *m, const ext2_inode_t *in, ext2_bmap_t *map, uint32_t lbn) {
+    uint32_t ppb = m->block_size / 4;
+    if (in->i_flags & EXT4_EXTENTS_FL) {
+        uint32_t len;
+        return ext2_ext_map(m, in, map, lbn, &len);
+    }
+    if (lbn < 12) return in->i_block[lbn];
+
+    ext2_bmap_t tmp;
+    if (!map) {
+        m_memset(&tmp, 0, sizeof(tmp));
+        map = &tmp;
+    }
+
+    uint32_t v = 0;
+    uint64_t l = lbn - 12u;
+    if (l < ppb) {
+        uint32_t *t = ext2_bmap_table(m, &map->ind_blk, &map->ind, in->i_block[12]);
+        if (t) v = t[l];
+    } else if ((l -= ppb) < (uint64_t)ppb * ppb) {
+        // double indirect
+        uint32_t *t1 = ext2_bmap_table(m, &map->dind_blk, &map->dind, in->i_block[13]);
+        uint32_t *t2 = t1 ? ext2_bmap_table(m, &map->dind2_blk, &map->dind2, t1[l / ppb]) : NULL;
+        if (t2) v = t2[l % ppb];
+    } else {
+        // triple indirect; each level keeps its last table, so a sequential
+        // walk reads a level-2 table once per ppb * ppb blocks and a leaf
+        // once per ppb blocks
+        l -= (uint64_t)ppb * ppb;
+        uint32_t idx1 = (uint32_t)(l / ((uint64_t)ppb * ppb));
+        if (idx1 < ppb) {
+            uint32_t *t1 = ext2_bmap_table(m, &map->tind_blk, &map->tind, in->i_block[14]);
+            uint32_t *t2 = t1 ? ext2_bmap_table(m, &map->tind2_blk, &map->tind2, t1[idx1]) : NULL;
+            uint32_t *t3 = t2 ? ext2_bmap_table(m, &map->tind3_blk, &map->tind3, t2[(l / ppb) % ppb]) : NULL;
+            if (t3) v = t3[l % ppb];
+        }
+    }
+
+    if (map == &tmp) ext2_bmap_free(&tmp);
+    return v;
+}
+
+// Length of the run of logical blocks starting at lbn (at most max) that map to
+// consecutive physical blocks, or that are all holes. *out_pblk receives the
+// first physical block (0 for a hole run).
+static uint32_t ext2_map_run(ext2_mount_ctx_t *m, const ext2_inode_t *in, ext2_bmap_t *map, uint32_t lbn, uint32_t max, uint32_t *out_pblk) {
+    if (in->i_flags & EXT4_EXTENTS_FL) {
+        // Whole extents at a time, joined when they continue each other.
+        uint32_t n = 0;
+        uint32_t first = ext2_ext_map(m, in, map, lbn, &n);
+        *out_pblk = first;
+        while (n < max) {
+            uint32_t len = 0;
+            uint32_t next = ext2_ext_map(m, in, map, lbn + n, &len);
+            if (first == 0 ? (next != 0) : (next != first + n)) break;
+            n += len;
+        }
+        return n < max ? n : max;
+    }
+
+    uint32_t first = ext2_get_block_ptr(m, in, map, lbn);
+    *out_pblk = first;
+    uint32_t n = 1;
+    while (n < max) {
+        uint32_t next = ext2_get_block_ptr(m, in, map, lbn + n);
+        if (first == 0 ? (next != 0) : (next != first + n)) break;
+        n++;
+    }
+    return n;
+}
+
+// Length of the hole starting at lbn (at most max blocks) of a block-mapped
+// inode; 0 if lbn is mapped. Ranges under an unallocated indirect, double-
+// or triple-indirect block are skipped whole instead of block by block.
+static uint32_t ext2_hole_run(ext2_mount_ctx_t *m, const ext2_inode_t *in, ext2_bmap_t *map, uint32_t lbn, uint32_t max) {
+    uint64_t ppb = m->block_size / 4;
+    uint64_t ind_end = 12 + ppb, dind_end = ind_end + ppb * ppb, tind_end = dind_end + ppb * ppb * ppb;
+    uint32_t n = 0;
+    while (n < max) {
+        uint64_t l = (uint64_t)lbn + n;
+        uint64_t span = 1;
+        if (l >= 12 && l < ind_end && !in->i_block[12]) span = ind_end - l;
+        else if (l >= ind_end && l < dind_end && !in->i_block[13]) span = dind_end - l;
+        else if (l >= dind_end && l < tind_end && !in->i_block[14]) span = tind_end - l;
+        else if (ext2_get_block_ptr(m, in, map, (uint32_t)l)) break;
+        n = span >= max - n ? max : n + (uint32_t)span;
+    }
+    return n;
+}
+
+// --- journal ---
+
+static uint32_t jbd_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void jbd_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void jbd_header(uint8_t *p, uint32_t type, uint32_t seq) {
+    jbd_put32(p, JBD_MAGIC);
+    jbd_put32(p + 4, type);
+    jbd_put32(p + 8, seq);
+}
+
+// Log block n blocks after lblk, wrapping inside [first, maxlen).
+static uint32_t ext2_journal_next(const ext2_journal_t *j, uint32_t lblk, uint32_t n) {
+    uint32_t v = lblk + n;
+    while (v >= j->maxlen) v -= j->maxlen - j->first;
+    return v;
+}
+
+// Device extent holding log block lblk: *out_pblk and how many blocks of
+// the same run follow (including lblk). 0 if the block is unmapped.
+static uint32_t ext2_journal_map(const ext2_journal_t *j, uint32_t lblk, uint32_t *out_pblk) {
+    for (uint32_t i = 0; i < j->nruns; i++) {
+        const ext2_jrun_t *r = &j->runs[i];
+        if (lblk >= r->lblk && lblk - r->lblk < r->len) {
+            *out_pblk = r->pblk + (lblk - r->lblk);
+            return r->len - (lblk - r->lblk);
+        }
+    }
+    return 0;
+}
+
+// Log I/O never goes through the block cache, so a commit started from
+// inside the cache cannot recurse into it.
+static int ext2_journal_io(ext2_mount_ctx_t *m, uint32_t lblk, uint32_t n, uint8_t *buf, int write) {
+    ext2_journal_t *j = &m->journal;
+    uint32_t bs = m->block_size;
+    while (n) {
+        uint32_t pblk = 0;
+        uint32_t run = ext2_journal_map(j, lblk, &pblk);
+        if (run == 0) return -1;
+        if (run > n) run = n;
+        int rc = write ? bdev_write_bytes(m, (uint64_t)pblk * bs, buf, (size_t)run * bs)
+                       : bdev_read_bytes(m, (uint64_t)pblk * bs, buf, (size_t)run * bs);
+        if (rc != 0) return -2;
+        lblk += run;
+        n -= run;
+        buf += (size_t)run * bs;
+    }
+    return 0;
+}
+
+static int ext2_journal_write_sb(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    jbd_put32(j->jsb + JBD_SB_SEQUENCE, j->seq);
+    jbd_put32(j->jsb + JBD_SB_START, j->start);
+    return ext2_journal_io(m, 0, 1, j->jsb, 1);
+}
+
+static uint32_t ext2_journal_hash(uint32_t blk) {
+    return blk * 2654435761u;
+}
+
+// The live set holds every block with a copy in the log since the last
+// checkpoint. Freeing one of them needs a revoke record.
+static void ext2_journal_live_add(ext2_journal_t *j, uint32_t blk) {
+    uint32_t i = ext2_journal_hash(blk) & j->live_mask;
+    while (j->live[i] && j->live[i] != blk + 1) i = (i + 1) & j->live_mask;
+    j->live[i] = blk + 1;
+}
+
+static int ext2_journal_live_has(const ext2_journal_t *j, uint32_t blk) {
+    uint32_t i = ext2_journal_hash(blk) & j->live_mask;
+    while (j->live[i]) {
+        if (j->live[i] == blk + 1) return 1;
+        i = (i + 1) & j->live_mask;
+    }
+    return 0;
+}
+
+// Blocks [blk, blk + count) are being freed. Older copies of them in the
+// log must not be replayed over whatever the blocks hold next.
+static void ext2_journal_revoke(ext2_mount_ctx_t *m, uint32_t blk, uint32_t count) {
+    ext2_journal_t *j = &m->journal;
+    if (!j->active || j->start == 0) return;
+    for (uint32_t k = 0; k < count; k++) {
+        if (!ext2_journal_live_has(j, blk + k)) continue;
+        if (j->nrevoke == j->revoke_cap) {
+            uint32_t cap = j->revoke_cap ? j->revoke_cap * 2u : 64u;
+            uint32_t *r = (uint32_t*)g_api->kmalloc(sizeof(uint32_t) * cap);
+            if (!r) {
+                j->must_checkpoint = 1;
+                continue;
+            }
+            if (j->revoke) {
+                m_memcpy(r, j->revoke, sizeof(uint32_t) * j->nrevoke);
+                g_api->kfree(j->revoke);
+            }
+            j->revoke = r;
+            j->revoke_cap = cap;
+        }
+        j->revoke[j->nrevoke++] = blk + k;
+    }
+}
+
+// Log blocks a transaction of nblk metadata blocks and nrev revokes takes.
+static uint32_t ext2_journal_need(ext2_mount_ctx_t *m, uint32_t nblk, uint32_t nrev) {
+    uint32_t bs = m->block_size;
+    uint32_t tpd = (bs - 12u - 24u) / 8u + 1u; // tags per descriptor
+    uint32_t rpb = (bs - 16u) / 4u;            // records per revoke block
+    return nblk + (nblk + tpd - 1u) / tpd + (nrev + rpb - 1u) / rpb + 1u;
+}
+
+// Whether the running transaction has to commit before another block may
+// join it. Unlogged blocks cannot be evicted without a commit, so they may
+// fill at most half the cache.
+static int ext2_journal_full(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    if (m->bcache.nunlogged + 4u > m->bcache.nents / 2u) return 1;
+    return ext2_journal_need(m, m->bcache.nunlogged + 4u, j->nrevoke + 4u) > j->max_txn;
+}
+
+// Write every logged block home and empty the log.
+static int ext2_journal_checkpoint(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    if (ext2_bcache_flush(m) != 0) return -1;
+    if (j->start == 0) return 0;
+    j->start = 0;
+    j->head = j->first;
+    j->must_checkpoint = 0;
+    m_memset(j->live, 0, sizeof(uint32_t) * (j->live_mask + 1u));
+    return ext2_journal_write_sb(m);
+}
+
+// Staging buffer for log blocks; full buffers go out as one request.
+typedef struct {
+    ext2_mount_ctx_t *m;
+    uint8_t *buf;
+    uint32_t cap; // blocks
+    uint32_t n;
+    uint32_t at;  // log block of buf[0]
+    int rc;
+} ext2_jwriter_t;
+
+static void ext2_jw_flush(ext2_jwriter_t *w) {
+    if (w->n == 0) return;
+    if (ext2_journal_io(w->m, w->at, w->n, w->buf, 1) != 0) w->rc = -1;
+    w->at = ext2_journal_next(&w->m->journal, w->at, w->n);
+    w->n = 0;
+}
+
+static uint8_t *ext2_jw_next(ext2_jwriter_t *w) {
+    ext2_journal_t *j = &w->m->journal;
+    // A request never wraps past the end of the log.
+    if (w->n == w->cap || w->at + w->n == j->maxlen) ext2_jw_flush(w);
+    uint8_t *p = w->buf + (size_t)w->n++ * w->m->block_size;
+    m_memset(p, 0, w->m->block_size);
+    return p;
+}
+
+// Write the running transaction to the log: revoke records, then
+// descriptor blocks each followed by the blocks they describe, then the
+// commit block in a request of its own. File data in the cache goes home
+// first (ordered mode). The log is checkpointed once it is half full.
+static int ext2_journal_commit(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    ext2_bcache_t *c = &m->bcache;
+    uint32_t bs = m->block_size;
+    if (!j->active) return 0;
+    if (c->nunlogged == 0 && j->nrevoke == 0 && !j->must_checkpoint) return 0;
+
+    for (uint32_t i = 0; i < c->nents; i++) {
+        ext2_bcache_ent_t *e = &c->ents[i];
+        if (!e->valid || !e->dirty || !e->ordered) continue;
+        if (bdev_write_bytes(m, (uint64_t)e->blk * bs, e->data, bs) != 0) return -1;
+        ext2_bcache_clean(c, e);
+    }
+
+    int32_t *list = NULL;
+    uint32_t n = 0;
+    if (c->nunlogged) {
+        list = (int32_t*)g_api->kmalloc(sizeof(int32_t) * c->nunlogged);
+        if (!list) return -2;
+        for (uint32_t i = 0; i < c->nents && n < c->nunlogged; i++) {
+            ext2_bcache_ent_t *e = &c->ents[i];
+            if (e->valid && e->dirty && !e->ordered && !e->logged) list[n++] = (int32_t)i;
+        }
+    }
+
+    // A block logged again after being freed needs no revoke.
+    uint32_t nrev = 0;
+    for (uint32_t r = 0; r < j->nrevoke; r++) {
+        int32_t i = ext2_bcache_find(c, j->revoke[r]);
+        if (i >= 0 && c->ents[i].dirty && !c->ents[i].logged && !c->ents[i].ordered) continue;
+        j->revoke[nrev++] = j->revoke[r];
+    }
+    j->nrevoke = nrev;
+
+    int rc = 0;
+    uint32_t need = ext2_journal_need(m, n, nrev);
+    uint32_t used = (j->start == 0) ? 0 : (j->head >= j->start ? j->head - j->start : j->maxlen - j->start + j->head - j->first);
+    if (n == 0 && nrev == 0) goto done;
+    if (used + need >= j->maxlen - j->first) { rc = -3; goto out; }
+
+    if (j->start == 0) {
+        j->start = j->first;
+        j->head = j->first;
+        if (ext2_journal_write_sb(m) != 0) { rc = -4; goto out; }
+    }
+
+    ext2_jwriter_t w;
+    m_memset(&w, 0, sizeof(w));
+    w.m = m;
+    w.cap = EXT2_MAX_IO_BYTES / bs;
+    if (w.cap > need) w.cap = need;
+    w.buf = (uint8_t*)g_api->kmalloc((size_t)w.cap * bs);
+    if (!w.buf) { rc = -2; goto out; }
+    w.at = j->head;
+
+    uint32_t rpb = (bs - 16u) / 4u;
+    for (uint32_t r = 0; r < nrev; r += rpb) {
+        uint8_t *p = ext2_jw_next(&w);
+        uint32_t cnt = nrev - r < rpb ? nrev - r : rpb;
+        jbd_header(p, JBD_REVOKE_BLOCK, j->seq);
+        jbd_put32(p + 12, 16u + cnt * 4u);
+        for (uint32_t k = 0; k < cnt; k++) jbd_put32(p + 16 + k * 4u, j->revoke[r + k]);
+    }
+
+    uint32_t k = 0;
+    while (k < n) {
+        uint8_t *d = ext2_jw_next(&w);
+        jbd_header(d, JBD_DESCRIPTOR_BLOCK, j->seq);
+        uint32_t off = 12, first_tag = k;
+        uint8_t *last = NULL;
+        while (k < n && off + (k == first_tag ? 24u : 8u) <= bs) {
+            const ext2_bcache_ent_t *e = &c->ents[list[k]];
+            uint32_t flags = (k == first_tag) ? 0 : JBD_FLAG_SAME_UUID;
+            uint8_t *p = ext2_jw_next(&w);
+            m_memcpy(p, e->data, bs);
+            if (jbd_get32(p) == JBD_MAGIC) {
+                jbd_put32(p, 0);
+                flags |= JBD_FLAG_ESCAPE;
+            }
+            jbd_put32(d + off, e->blk);
+            jbd_put32(d + off + 4, flags);
+            last = d + off;
+            off += 8;
+            if (k == first_tag) {
+                m_memcpy(d + off, j->jsb + JBD_SB_UUID, 16);
+                off += 16;
+            }
+            k++;
+        }
+        jbd_put32(last + 4, jbd_get32(last + 4) | JBD_FLAG_LAST_TAG);
+    }
+    ext2_jw_flush(&w);
+
+    // The commit block goes out only once everything it seals is written.
+    if (w.rc == 0) {
+        jbd_header(ext2_jw_next(&w), JBD_COMMIT_BLOCK, j->seq);
+        ext2_jw_flush(&w);
+    }
+    g_api->kfree(w.buf);
+    if (w.rc != 0) { rc = -5; goto out; }
+
+    for (uint32_t i = 0; i < n; i++) {
+        ext2_bcache_ent_t *e = &c->ents[list[i]];
+        e->logged = 1;
+        c->nunlogged--;
+        ext2_journal_live_add(j, e->blk);
+    }
+    j->head = w.at;
+    j->seq++;
+    j->nrevoke = 0;
+
+done:
+    j->nops = 0;
+    if (j->must_checkpoint || used + need > (j->maxlen - j->first) / 2u) {
+        if (ext2_journal_checkpoint(m) != 0) rc = -6;
+    }
+out:
+    if (list) g_api->kfree(list);
+    return rc;
+}
+
+// Return the blocks held back by the running transaction to the bitmaps,
+// which then join that transaction.
+static void ext2_journal_release(ext2_mount_ctx_t *m) {
+    if (!m->journal.nfreed || !m->gbmp) return;
+    uint32_t words = m->block_size / 8u;
+    for (uint32_t g = 0; g < m->groups; g++) {
+        ext2_group_bmp_t *gb = &m->gbmp[g];
+        if (!gb->pfree) continue;
+        uint64_t *w = (uint64_t*)gb->block_bmp;
+        const uint64_t *f = (const uint64_t*)gb->pfree;
+        uint32_t cnt = 0;
+        for (uint32_t i = 0; i < words; i++) {
+            uint64_t x = w[i] & f[i];
+            if (!x) continue;
+            w[i] &= ~x;
+            cnt += (uint32_t)__builtin_popcountll(x);
+        }
+        g_api->kfree(gb->pfree);
+        gb->pfree = NULL;
+        if (cnt) {
+            gb->block_dirty = 1;
+            ext2_group_account(m, g, (int)cnt, 0, 0);
+        }
+    }
+    m->journal.nfreed = 0;
+}
+
+// Close the running transaction: everything the finished operations left
+// in memory (held frees, inodes, bitmaps, descriptors) joins it, then it
+// commits.
+static int ext2_journal_flush(ext2_mount_ctx_t *m) {
+    int rc = 0;
+    ext2_journal_release(m);
+    if (ext2_icache_flush(m) != 0) rc = -1;
+    if (ext2_flush_bitmaps(m) != 0) rc = -1;
+    if (ext2_flush_meta(m) != 0) rc = -1;
+    if (ext2_journal_commit(m) != 0) rc = -1;
+    return rc;
+}
+
+// Called after each operation. Operations are grouped into one commit
+// until enough of them, or enough dirty metadata, has piled up.
+static int ext2_journal_due(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    if (++j->nops >= EXT2_JOURNAL_BATCH || j->must_checkpoint) return 1;
+    uint32_t pending = m->bcache.nunlogged + m->icache.ndirty;
+    if (pending > m->bcache.nents / 4u) return 1;
+    if (ext2_journal_need(m, pending, j->nrevoke) > j->max_txn / 2u) return 1;
+    // Do not let held frees starve allocation.
+    return j->nfreed > (m->sb.s_free_blocks_count - m->da_reserved) / 4u;
+}
+
+// Replay state, shared by the three passes over the log.
+typedef struct {
+    uint32_t end;      // sequence after the last committed transaction
+    uint32_t nrevoke;
+    uint32_t *rblk;    // revoked block + 1 -> latest revoking sequence
+    uint32_t *rseq;
+    uint32_t rmask;
+    uint32_t tag_bytes;
+    uint32_t tail;     // bytes reserved at the end of descriptors
+    int is64;
+    uint8_t *buf;
+    uint8_t *data;
+} ext2_jreplay_t;
+
+static void ext2_jreplay_set(ext2_jreplay_t *r, uint32_t blk, uint32_t seq) {
+    uint32_t i = ext2_journal_hash(blk) & r->rmask;
+    while (r->rblk[i] && r->rblk[i] != blk + 1) i = (i + 1) & r->rmask;
+    if (!r->rblk[i] || (int32_t)(seq - r->rseq[i]) > 0) r->rseq[i] = seq;
+    r->rblk[i] = blk + 1;
+}
+
+static int ext2_jreplay_revoked(const ext2_jreplay_t *r, uint32_t blk, uint32_t seq) {
+    if (!r->rblk) return 0;
+    uint32_t i = ext2_journal_hash(blk) & r->rmask;
+    while (r->rblk[i]) {
+        if (r->rblk[i] == blk + 1) return (int32_t)(r->rseq[i] - seq) >= 0;
+        i = (i + 1) & r->rmask;
+    }
+    return 0;
+}
+
+// One pass over the log from its start. Pass 0 finds the end of the last
+// complete transaction and counts revoke records, pass 1 collects them and
+// pass 2 writes every block no later revoke covers to its home location.
+static int ext2_journal_pass(ext2_mount_ctx_t *m, ext2_jreplay_t *r, int pass) {
+    ext2_journal_t *j = &m->journal;
+    uint32_t bs = m->block_size;
+    uint32_t blk = j->start, seq = j->seq, walked = 0;
+    for (;;) {
+        if (pass > 0 && seq == r->end) return 0;
+        if (walked >= j->maxlen - j->first) return pass == 0 ? 0 : -1;
+        if (ext2_journal_io(m, blk, 1, r->buf, 0) != 0) return -2;
+        if (jbd_get32(r->buf) != JBD_MAGIC || jbd_get32(r->buf + 8) != seq) return pass == 0 ? 0 : -3;
+
+        uint32_t type = jbd_get32(r->buf + 4);
+        uint32_t used = 1;
+        if (type == JBD_DESCRIPTOR_BLOCK) {
+            uint32_t off = 12;
+            while (off + r->tag_bytes <= bs - r->tail) {
+                const uint8_t *t = r->buf + off;
+                uint32_t target = jbd_get32(t);
+                uint32_t flags = jbd_get32(t + 4) & 0xFFFFu;
+                uint32_t lblk = ext2_journal_next(j, blk, used++);
+                int high = r->is64 && jbd_get32(t + 8) != 0;
+                if (pass == 2 && !high && target < m->sb.s_blocks_count && !ext2_jreplay_revoked(r, target, seq)) {
+                    if (ext2_journal_io(m, lblk, 1, r->data, 0) != 0) return -2;
+                    if (flags & JBD_FLAG_ESCAPE) jbd_put32(r->data, JBD_MAGIC);
+                    if (bdev_write_bytes(m, (uint64_t)target * bs, r->data, bs) != 0) return -4;
+                }
+                off += r->tag_bytes;
+                if (!(flags & JBD_FLAG_SAME_UUID)) off += 16;
+                if (flags & JBD_FLAG_LAST_TAG) break;
+            }
+        } else if (type == JBD_COMMIT_BLOCK) {
+            seq++;
+            if (pass == 0) r->end = seq;
+        } else if (type == JBD_REVOKE_BLOCK) {
+            uint32_t size = jbd_get32(r->buf + 12);
+            uint32_t rsz = r->is64 ? 8u : 4u;
+            if (size > bs) size = bs;
+            for (uint32_t off = 16; off + rsz <= size; off += rsz) {
+                if (pass == 0) r->nrevoke++;
+                else if (pass == 1 && !(r->is64 && jbd_get32(r->buf + off) != 0)) {
+                    ext2_jreplay_set(r, jbd_get32(r->buf + off + rsz - 4u), seq);
+                }
+            }
+        } else {
+            return pass == 0 ? 0 : -3;
+        }
+        walked += used;
+        blk = ext2_journal_next(j, blk, used);
+    }
+}
+
+// Bring the home locations up to date with every committed transaction in
+// the log. j->seq becomes the sequence for the next transaction.
+static int ext2_journal_replay(ext2_mount_ctx_t *m, uint32_t incompat) {
+    ext2_journal_t *j = &m->journal;
+    ext2_jreplay_t r;
+    m_memset(&r, 0, sizeof(r));
+    r.end = j->seq;
+    r.is64 = (incompat & JBD_INCOMPAT_64BIT) != 0;
+    if (incompat & JBD_INCOMPAT_CSUM_V3) {
+        r.tag_bytes = 16;
+    } else {
+        r.tag_bytes = 8u + ((incompat & JBD_INCOMPAT_CSUM_V2) ? 2u : 0u) + (r.is64 ? 4u : 0u);
+    }
+    if (incompat & (JBD_INCOMPAT_CSUM_V2 | JBD_INCOMPAT_CSUM_V3)) r.tail = 4;
+
+    int rc = -1;
+    r.buf = (uint8_t*)g_api->kmalloc(m->block_size);
+    r.data = (uint8_t*)g_api->kmalloc(m->block_size);
+    if (!r.buf || !r.data) goto out;
+
+    if ((rc = ext2_journal_pass(m, &r, 0)) != 0) goto out;
+    if (r.nrevoke) {
+        uint32_t cap = 64;
+        while (cap < r.nrevoke * 2u) cap <<= 1;
+        r.rblk = (uint32_t*)g_api->kmalloc(sizeof(uint32_t) * cap);
+        r.rseq = (uint32_t*)g_api->kmalloc(sizeof(uint32_t) * cap);
+        rc = -1;
+        if (!r.rblk || !r.rseq) goto out;
+        m_memset(r.rblk, 0, sizeof(uint32_t) * cap);
+        r.rmask = cap - 1u;
+        if ((rc = ext2_journal_pass(m, &r, 1)) != 0) goto out;
+    }
+    if ((rc = ext2_journal_pass(m, &r, 2)) != 0) goto out;
+    // Skip a sequence number, as jbd2 does, so no stale block past the end
+    // of the replayed log can pass for part of the next transaction.
+    j->seq = r.end + 1u;
+
+out:
+    if (r.buf) g_api->kfree(r.buf);
+    if (r.data) g_api->kfree(r.data);
+    if (r.rblk) g_api->kfree(r.rblk);
+    if (r.rseq) g_api->kfree(r.rseq);
+    return rc;
+}
+
+// Resolve the log's device blocks once, so log I/O needs no block map.
+static int ext2_journal_map_inode(ext2_mount_ctx_t *m, const ext2_inode_t *in, uint32_t nblk) {
+    ext2_journal_t *j = &m->journal;
+    ext2_bmap_t map;
+    m_memset(&map, 0, sizeof(map));
+    uint32_t cap = 0;
+    int rc = 0;
+    for (uint32_t l = 0; l < nblk;) {
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, in, &map, l, nblk - l, &pblk);
+        if (n == 0 || pblk == 0) { rc = -1; break; }
+        if (j->nruns == cap) {
+            cap = cap ? cap * 2u : 8u;
+            ext2_jrun_t *runs = (ext2_jrun_t*)g_api->kmalloc(sizeof(ext2_jrun_t) * cap);
+            if (!runs) { rc = -2; break; }
+            if (j->runs) {
+                m_memcpy(runs, j->runs, sizeof(ext2_jrun_t) * j->nruns);
+                g_api->kfree(j->runs);
+            }
+            j->runs = runs;
+        }
+        j->runs[j->nruns].lblk = l;
+        j->runs[j->nruns].pblk = pblk;
+        j->runs[j->nruns].len = n;
+        j->nruns++;
+        l += n;
+    }
+    ext2_bmap_free(&map);
+    return rc;
+}
+
+static void ext2_journal_free(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    if (j->runs) g_api->kfree(j->runs);
+    if (j->jsb) g_api->kfree(j->jsb);
+    if (j->live) g_api->kfree(j->live);
+    if (j->revoke) g_api->kfree(j->revoke);
+    m_memset(j, 0, sizeof(*j));
+}
+
+// Find the volume's internal journal, replay it if it holds transactions,
+// and start journalling when the log is in a format this driver appends
+// to. Runs at mount before the caches exist, so all I/O is direct.
+// Journals that cannot be used leave the volume as it was: a volume this
+// driver will not write is mounted without recovery and its log is kept
+// for Linux to replay.
+static int ext2_journal_load(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    uint32_t bs = m->block_size;
+    if (m->sb.s_rev_level < 1 || !(m->sb.s_feature_compat & EXT3_COMPAT_HAS_JOURNAL)) return 0;
+    if (!m->sb.s_journal_inum || m->sb.s_journal_dev) return 0; // external journals are not supported
+    if (m->sb.s_feature_incompat & EXT3_INCOMPAT_JOURNAL_DEV) return 0;
+
+    ext2_inode_t in;
+    if (ext2_read_inode_disk(m, m->sb.s_journal_inum, &in) != 0) return -1;
+    uint32_t nblk = in.i_size / bs;
+    if (nblk < 2) return 0;
+    if (ext2_journal_map_inode(m, &in, nblk) != 0) goto unused;
+
+    j->jsb = (uint8_t*)g_api->kmalloc(bs);
+    if (!j->jsb || ext2_journal_io(m, 0, 1, j->jsb, 0) != 0) goto unused;
+    uint32_t type = jbd_get32(j->jsb + 4);
+    if (jbd_get32(j->jsb) != JBD_MAGIC || (type != JBD_SUPERBLOCK_V1 && type != JBD_SUPERBLOCK_V2)) goto unused;
+    if (jbd_get32(j->jsb + JBD_SB_BLOCKSIZE) != bs) goto unused;
+    j->maxlen = jbd_get32(j->jsb + JBD_SB_MAXLEN);
+    j->first = jbd_get32(j->jsb + JBD_SB_FIRST);
+    j->seq = jbd_get32(j->jsb + JBD_SB_SEQUENCE);
+    j->start = jbd_get32(j->jsb + JBD_SB_START);
+    if (j->maxlen > nblk || j->first == 0 || j->first >= j->maxlen) goto unused;
+    uint32_t incompat = (type == JBD_SUPERBLOCK_V2) ? jbd_get32(j->jsb + JBD_SB_INCOMPAT) : 0;
+
+    if (j->start) {
+        // Replay writes home metadata, so decide first whether we write at all.
+        j->active = 1;
+        int writable = ext2_writable(m);
+        j->active = 0;
+        if (!writable || (incompat & ~JBD_INCOMPAT_REPLAY) || !g_api->block_write) goto unused;
+        if (j->start < j->first || j->start >= j->maxlen) goto unused;
+        if (ext2_journal_replay(m, incompat) != 0) goto unused;
+
+        // Replay rewrote metadata behind our back.
+        if (ext2_read_super(m, &m->sb) != 0) return -1;
+        g_api->kfree(m->bgdt);
+        g_api->kfree(m->bgdt_dirty);
+        m->bgdt = NULL;
+        m->bgdt_dirty = NULL;
+        if (ext2_load_bgdt(m) != 0) return -1;
+
+        j->start = 0;
+        if (ext2_journal_write_sb(m) != 0) return -1;
+        m->sb.s_feature_incompat &= ~EXT3_INCOMPAT_RECOVER;
+        if (ext2_write_super(m) != 0) return -1;
+    }
+
+    if (type != JBD_SUPERBLOCK_V2 || (incompat & ~JBD_INCOMPAT_WRITE) || !g_api->block_write) goto unused;
+    j->max_txn = (j->maxlen - j->first) / 4u;
+    if (j->max_txn < 64u) goto unused;
+    j->active = 1;
+    if (!ext2_writable(m)) goto unused;
+
+    uint32_t cap = 64;
+    while (cap < j->maxlen * 2u) cap <<= 1;
+    j->live = (uint32_t*)g_api->kmalloc(sizeof(uint32_t) * cap);
+    if (!j->live) goto unused;
+    m_memset(j->live, 0, sizeof(uint32_t) * cap);
+    j->live_mask = cap - 1u;
+    j->head = j->first;
+
+    // This driver writes revoke records; say so before the first one.
+    jbd_put32(j->jsb + JBD_SB_INCOMPAT, incompat | JBD_INCOMPAT_REVOKE);
+    if (ext2_journal_write_sb(m) != 0) goto unused;
+    m->sb.s_feature_incompat |= EXT3_INCOMPAT_RECOVER;
+    if (ext2_write_super(m) != 0) return -1;
+    return 0;
+
+unused:
+    ext2_journal_free(m);
+    return 0;
+}
+
+// Commit everything, write it home and mark the volume clean.
+static int ext2_journal_close(ext2_mount_ctx_t *m) {
+    ext2_journal_t *j = &m->journal;
+    int rc = 0;
+    if (j->active) {
+        if (ext2_journal_flush(m) != 0 || ext2_journal_checkpoint(m) != 0) {
+            rc = -1; // RECOVER stays set: the log replays on the next mount
+        } else {
+            m->sb.s_feature_incompat &= ~EXT3_INCOMPAT_RECOVER;
+            m->sb_dirty = 1;
+        }
+        j->active = 0;
+    }
+    ext2_journal_free(m);
+    return rc;
+}
+
+// Copy part of one block into the caller's buffer. Goes through the block
+// cache when there is one, otherwise through a lazily allocated bounce buffer.
+static int ext2_read_partial(ext2_mount_ctx_t *m, uint32_t pblk, uint32_t in_blk, void *out, size_t csz, uint8_t **bounce) {
+    if (m->bcache.ents) {
+        uint8_t *data = ext2_bcache_get(m, pblk, 1);
+        if (!data) return -1;
+        m_memcpy(out, data + in_blk, csz);
+        return 0;
+    }
+    if (!*bounce) {
+        *bounce = (uint8_t*)g_api->kmalloc(m->block_size);
+        if (!*bounce) return -2;
+    }
+    if (ext2_read_block(m, pblk, *bounce) != 0) return -3;
+    m_memcpy(out, *bounce + in_blk, csz);
+    return 0;
+}
+
+// Read up to sz bytes at off into buf; *got receives the count, short at
+// the end of the file.
+static int ext2_read_inode_data(ext2_mount_ctx_t *m, const ext2_inode_t *in, ext2_bmap_t *map, uint64_t off, void *buf, size_t sz, size_t *got) {
+    uint8_t *out = (uint8_t*)buf;
+    uint64_t file_size = ext2_isize(in);
+    *got = 0;
+    if (off >= file_size) return 0;
+    if (off + sz > file_size) sz = (size_t)(file_size - off);
+
+    uint32_t bs = m->block_size;
+    uint32_t max_run = EXT2_MAX_IO_BYTES / bs;
+    if (max_run == 0) max_run = 1;
+
+    uint8_t *bounce = NULL;
+    uint64_t pos = off;
+    uint64_t end = off + sz;
+    size_t outpos = 0;
+    int rc = 0;
+
+    while (pos < end) {
+        uint32_t lbn = (uint32_t)(pos / bs);
+        uint32_t in_blk = (uint32_t)(pos % bs);
+
+        // Unaligned head or tail: copy a slice of one block.
+        if (in_blk != 0 || end - pos < bs) {
+            size_t csz = bs - in_blk;
+            if (csz > end - pos) csz = (size_t)(end - pos);
+            uint32_t pblk = ext2_get_block_ptr(m, in, map, lbn);
+            if (pblk == 0) m_memset(out + outpos, 0, csz);
+            else if (ext2_read_partial(m, pblk, in_blk, out + outpos, csz, &bounce) != 0) { rc = -2; break; }
+            pos += csz;
+            outpos += csz;
+            continue;
+        }
+
+        // Aligned middle: one device request per physically contiguous run,
+        // straight into the caller's buffer. Holes are zero-filled whatever
+        // their length and blocks already in the cache (read ahead, or
+        // dirty) copied from it.
+        uint32_t left = (uint32_t)((end - pos) / bs);
+        uint32_t want = left > max_run ? max_run : left;
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, in, map, lbn, want, &pblk);
+        if (pblk == 0) {
+            if (n == want && n < left && !(in->i_flags & EXT4_EXTENTS_FL))
+                n += ext2_hole_run(m, in, map, lbn + n, left - n);
+            m_memset(out + outpos, 0, (size_t)n * bs);
+        } else if (m->bcache.ents && ext2_bcache_find(&m->bcache, pblk) >= 0) {
+            uint8_t *data = ext2_bcache_get(m, pblk, 1);
+            if (!data) { rc = -3; break; }
+            m_memcpy(out + outpos, data, bs);
+            n = 1;
+        } else {
+            uint32_t k = 1;
+            while (k < n && !(m->bcache.ents && ext2_bcache_find(&m->bcache, pblk + k) >= 0)) k++;
+            n = k;
+            if (bdev_read_blocks(m, pblk, n, out + outpos) != 0) { rc = -4; break; }
+        }
+        pos += (uint64_t)n * bs;
+        outpos += (size_t)n * bs;
+    }
+
+    if (bounce) g_api->kfree(bounce);
+    if (rc != 0) return rc;
+    *got = outpos;
+    return 0;
+}
+
+static int ext2_readlink(ext2_mount_ctx_t *m, const ext2_inode_t *in, char *out, size_t out_sz) {
+    if (out_sz == 0) return -1;
+    size_t len = in->i_size;
+    if (len >= out_sz) len = out_sz - 1;
+
+    // Fast symlink: stored in i_block bytes if small
+    if (in->i_size <= sizeof(in->i_block)) {
+        m_memcpy(out, in->i_block, len);
+        out[len] = 0;
+        return 0;
+    }
+
+    size_t got = 0;
+    int r = ext2_read_inode_data(m, in, NULL, 0, out, len, &got);
+    if (r < 0) return r;
+    out[got] = 0;
+    return 0;
+}
+
+static int ext2_dirent_match(const ext2_dirent_t *de, const char *name, size_t nlen) {
+    if (!de || !name) return 0;
+    if (de->inode == 0) return 0;
+    if (de->name_len != nlen) return 0;
+    for (size_t i = 0; i < nlen; i++) {
+        if (((const char*)de->name)[i] != name[i]) return 0;
+    }
+    return 1;
+}
+
+// Find name in one directory block.
+static int ext2_dir_block_find(const uint8_t *blk, uint32_t bs, const char *name, size_t nlen, uint32_t *out_ino) {
+    uint32_t off = 0;
+    while (off + sizeof(ext2_dirent_t) <= bs) {
+        const ext2_dirent_t *de = (const ext2_dirent_t*)(blk + off);
+        if (de->rec_len == 0) break;
+        if (ext2_dirent_match(de, name, nlen)) {
+            *out_ino = de->inode;
+            return 0;
+        }
+        off += de->rec_len;
+    }
+    return -1;
+}
+
+// Scan every block of dir for name. Returns 0 on a hit, -2 if the whole
+// directory was read without finding it and -1 if it could not be read.
+static int ext2_lookup_linear(ext2_mount_ctx_t *m, const ext2_inode_t *dir, ext2_bmap_t *map, const char *name, size_t nlen, uint32_t *out_ino) {
+    uint32_t bs = m->block_size;
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (!blk) return -1;
+
+    int rc = -2;
+    uint32_t entries = (dir->i_size + bs - 1) / bs;
+    for (uint32_t lbn = 0; lbn < entries && rc == -2; lbn++) {
+        uint32_t pblk = ext2_get_block_ptr(m, dir, map, lbn);
+        if (!pblk) continue;
+        if (ext2_read_block(m, pblk, blk) != 0) rc = -1;
+        else if (ext2_dir_block_find(blk, bs, name, nlen, out_ino) == 0) rc = 0;
+    }
+
+    g_api->kfree(blk);
+    return rc;
+}
+
+// --- htree (dir_index) ---
+
+// Directory name hashes as defined by the ext3/ext4 dir_index format.
+static uint32_t ext2_dx_hack_hash(const char *name, size_t len, int uns) {
+    uint32_t hash, hash0 = 0x12a3fe2du, hash1 = 0x37abe8f9u;
+    for (size_t i = 0; i < len; i++) {
+        int c = uns ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000u) hash -= 0x7fffffffu;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void ext2_dx_str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num, int uns) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    uint32_t val = pad;
+    if (len > (size_t)num * 4) len = (size_t)num * 4;
+    for (size_t i = 0; i < len; i++) {
+        int c = uns ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) *buf++ = val;
+    while (--num >= 0) *buf++ = pad;
+}
+
+static uint32_t rol32(uint32_t x, int s) {
+    return (x << s) | (x >> (32 - s));
+}
+
+#define EXT2_MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define EXT2_MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT2_MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define EXT2_MD4_ROUND(f, a, b, c, d, x, s) ((a) += f((b), (c), (d)) + (x), (a) = rol32((a), (s)))
+
+static void ext2_dx_half_md4(uint32_t buf[4], const uint32_t in[8]) {
+    const uint32_t k2 = 013240474631u, k3 = 015666365641u;
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[0], 3);
+    EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[1], 7);
+    EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[2], 11);
+    EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[3], 19);
+    EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[4], 3);
+    EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[5], 7);
+    EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[6], 11);
+    EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[7], 19);
+
+    EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[1] + k2, 3);
+    EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[3] + k2, 5);
+    EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[5] + k2, 9);
+    EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[7] + k2, 13);
+    EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[0] + k2, 3);
+    EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[2] + k2, 5);
+    EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[4] + k2, 9);
+    EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[6] + k2, 13);
+
+    EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[3] + k3, 3);
+    EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[7] + k3, 9);
+    EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[2] + k3, 11);
+    EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[6] + k3, 15);
+    EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[1] + k3, 3);
+    EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[5] + k3, 9);
+    EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[0] + k3, 11);
+    EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[4] + k3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void ext2_dx_tea(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9u;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// Major hash of name for the given (possibly unsigned-adjusted) version.
+static uint32_t ext2_dx_hash(ext2_mount_ctx_t *m, const char *name, size_t len, int version) {
+    uint32_t buf[4] = { 0x67452301u, 0xefcdab89u, 0x98badcfeu, 0x10325476u };
+    uint32_t in[8];
+    uint32_t seed[4];
+    m_memcpy(seed, m->sb.s_hash_seed, sizeof(seed));
+    if (seed[0] || seed[1] || seed[2] || seed[3]) {
+        for (int i = 0; i < 4; i++) buf[i] = seed[i];
+    }
+
+    int uns = version >= EXT2_DX_HASH_UNSIGNED;
+    uint32_t hash = 0;
+    switch (uns ? version - EXT2_DX_HASH_UNSIGNED : version) {
+    case EXT2_DX_HASH_LEGACY:
+        hash = ext2_dx_hack_hash(name, len, uns);
+        break;
+    case EXT2_DX_HASH_HALF_MD4:
+        for (size_t off = 0; off < len; off += 32) {
+            ext2_dx_str2hashbuf(name + off, len - off, in, 8, uns);
+            ext2_dx_half_md4(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case EXT2_DX_HASH_TEA:
+        for (size_t off = 0; off < len; off += 16) {
+            ext2_dx_str2hashbuf(name + off, len - off, in, 4, uns);
+            ext2_dx_tea(buf, in);
+        }
+        hash = buf[0];
+        break;
+    }
+    hash &= ~1u;
+    if (hash == (0x7fffffffu << 1)) hash = (0x7fffffffu - 1) << 1;
+    return hash;
+}
+
+typedef struct __attribute__((packed)) {
+    uint32_t hash; // entry 0 holds the limit/count pair instead
+    uint32_t block;
+} ext2_dx_entry_t;
+
+// Validate the dx entry array at off in a node block and return it.
+static const ext2_dx_entry_t *ext2_dx_entries(const uint8_t *blk, uint32_t bs, uint32_t off, uint32_t *out_count) {
+    if (off + 8 > bs) return NULL;
+    const uint16_t *cl = (const uint16_t*)(blk + off);
+    uint32_t limit = cl[0], count = cl[1];
+    if (count == 0 || count > limit || off + limit * 8u > bs) return NULL;
+    *out_count = count;
+    return (const ext2_dx_entry_t*)(blk + off);
+}
+
+// Look name up through the htree index of dir: descend the index nodes by
+// hash to a single leaf block, following the collision chain into the next
+// leaves if the hash continues there. Returns 0 on a hit, -2 if the name is
+// not in the directory and -1 if the index cannot be used, in which case
+// the caller falls back to a scan.
+static int ext2_dx_lookup(ext2_mount_ctx_t *m, const ext2_inode_t *dir, ext2_bmap_t *map, const char *name, size_t nlen, uint32_t *out_ino) {
+    uint32_t bs = m->block_size;
+    uint8_t *node = (uint8_t*)g_api->kmalloc(bs);
+    uint8_t *leaf = (uint8_t*)g_api->kmalloc(bs);
+    int rc = -1;
+    if (!node || !leaf) goto out;
+
+    uint32_t pblk = ext2_get_block_ptr(m, dir, map, 0);
+    if (!pblk || ext2_read_block(m, pblk, node) != 0) goto out;
+
+    // The root block holds "." and "..", then dx_root_info at byte 24:
+    // reserved (4), hash_version, info_length, indirect_levels, flags.
+    const uint8_t *info = node + 24;
+    if (*(const uint32_t*)info != 0) goto out;
+    int version = info[4];
+    uint32_t info_len = info[5], levels = info[6];
+    if (version > EXT2_DX_HASH_TEA || info_len < 8 || levels > 2) goto out;
+    if (m->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH) version += EXT2_DX_HASH_UNSIGNED;
+    uint32_t hash = ext2_dx_hash(m, name, nlen, version);
+
+    uint32_t off = 24 + info_len;
+    const ext2_dx_entry_t *ents = NULL;
+    uint32_t count = 0, at = 0;
+    for (uint32_t lvl = 0; ; lvl++) {
+        ents = ext2_dx_entries(node, bs, off, &count);
+        if (!ents) goto out;
+        // last entry with hash <= target; entry 0 covers everything below entry 1
+        uint32_t lo = 1, hi = count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ents[mid].hash > hash) hi = mid;
+            else lo = mid + 1;
+        }
+        at = lo - 1;
+        if (lvl == levels) break;
+        pblk = ext2_get_block_ptr(m, dir, map, ents[at].block & 0x0FFFFFFFu);
+        if (!pblk || ext2_read_block(m, pblk, node) != 0) goto out;
+        off = 8; // interior nodes start with an empty dirent
+    }
+
+    rc = -2;
+    for (;;) {
+        pblk = ext2_get_block_ptr(m, dir, map, ents[at].block & 0x0FFFFFFFu);
+        if (!pblk || ext2_read_block(m, pblk, leaf) != 0) { rc = -1; break; }
+        if (ext2_dir_block_find(leaf, bs, name, nlen, out_ino) == 0) { rc = 0; break; }
+        // A set low bit on the next entry means our hash spills into its leaf.
+        if (++at >= count) break;
+        if (!(ents[at].hash & 1u) || (ents[at].hash & ~1u) != hash) break;
+    }
+
+out:
+    if (node) g_api->kfree(node);
+    if (leaf) g_api->kfree(leaf);
+    return rc;
+}
+
+// --- in-memory directory hash ---
+
+static uint32_t ext2_name_hash(const char *name, size_t nlen) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < nlen; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void ext2_dirhash_put(ext2_dirhash_t *dh, uint32_t hash, uint32_t lbn1) {
+    uint32_t i = hash & dh->mask;
+    while (dh->slots[i].lbn1) i = (i + 1) & dh->mask;
+    dh->slots[i].hash = hash;
+    dh->slots[i].lbn1 = lbn1;
+    dh->count++;
+}
+
+// Record that the name with this hash lives in directory block lbn. The
+// table is kept at most half full.
+static int ext2_dirhash_add(ext2_dirhash_t *dh, uint32_t hash, uint32_t lbn) {
+    if ((dh->count + 1) * 2 > dh->mask + 1) {
+        uint32_t nslots = (dh->mask + 1) * 2;
+        ext2_dirhash_slot_t *ns = (ext2_dirhash_slot_t*)g_api->kmalloc(sizeof(*ns) * nslots);
+        if (!ns) return -1;
+        m_memset(ns, 0, sizeof(*ns) * nslots);
+        ext2_dirhash_slot_t *old = dh->slots;
+        uint32_t oslots = dh->mask + 1;
+        dh->slots = ns;
+        dh->mask = nslots - 1;
+        dh->count = 0;
+        for (uint32_t i = 0; i < oslots; i++) {
+            if (old[i].lbn1) ext2_dirhash_put(dh, old[i].hash, old[i].lbn1);
+        }
+        g_api->kfree(old);
+    }
+    ext2_dirhash_put(dh, hash, lbn + 1);
+    return 0;
+}
+
+// Forget one (hash, lbn) record; later slots of the probe run are shifted
+// back so lookups never stop at a hole.
+static void ext2_dirhash_del(ext2_dirhash_t *dh, uint32_t hash, uint32_t lbn) {
+    uint32_t i = hash & dh->mask;
+    while (dh->slots[i].lbn1) {
+        if (dh->slots[i].hash == hash && dh->slots[i].lbn1 == lbn + 1) break;
+        i = (i + 1) & dh->mask;
+    }
+    if (!dh->slots[i].lbn1) return;
+
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & dh->mask;
+        if (!dh->slots[j].lbn1) break;
+        uint32_t k = dh->slots[j].hash & dh->mask;
+        // move j into the hole unless its home lies cyclically in (i, j]
+        int stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            dh->slots[i] = dh->slots[j];
+            i = j;
+        }
+    }
+    dh->slots[i].lbn1 = 0;
+    dh->count--;
+}
+
+static ext2_dirhash_t *ext2_dirhash_build(ext2_mount_ctx_t *m, const ext2_inode_t *dir, ext2_bmap_t *map) {
+    uint32_t bs = m->block_size;
+    uint32_t blocks = (dir->i_size + bs - 1) / bs;
+
+    ext2_dirhash_t *dh = (ext2_dirhash_t*)g_api->kmalloc(sizeof(*dh));
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    uint32_t nslots = 64;
+    // size for a typical 16-byte-per-entry fill, the table grows if needed
+    while (nslots < (blocks * (bs / 16u)) * 2u && nslots < (1u << 24)) nslots <<= 1;
+    if (dh) {
+        dh->slots = (ext2_dirhash_slot_t*)g_api->kmalloc(sizeof(ext2_dirhash_slot_t) * nslots);
+        dh->mask = nslots - 1;
+        dh->count = 0;
+    }
+    if (!dh || !dh->slots || !blk) goto fail;
+    m_memset(dh->slots, 0, sizeof(ext2_dirhash_slot_t) * nslots);
+
+    for (uint32_t lbn = 0; lbn < blocks; lbn++) {
+        uint32_t pblk = ext2_get_block_ptr(m, dir, map, lbn);
+        if (!pblk) continue;
+        if (ext2_read_block(m, pblk, blk) != 0) goto fail;
+        uint32_t off = 0;
+        while (off + sizeof(ext2_dirent_t) <= bs) {
+            const ext2_dirent_t *de = (const ext2_dirent_t*)(blk + off);
+            if (de->rec_len == 0) break;
+            if (de->inode != 0 && de->name_len > 0) {
+                if (ext2_dirhash_add(dh, ext2_name_hash(de->name, de->name_len), lbn) != 0) goto fail;
+            }
+            off += de->rec_len;
+        }
+    }
+    g_api->kfree(blk);
+    return dh;
+
+fail:
+    if (blk) g_api->kfree(blk);
+    ext2_dirhash_free(&dh);
+    return NULL;
+}
+
+// Same contract as ext2_dx_lookup(); -1 means the directory is too small
+// for a table or one could not be built.
+static int ext2_dirhash_lookup(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, const ext2_inode_t *dir, const char *name, size_t nlen, uint32_t *out_ino) {
+    uint32_t bs = m->block_size;
+    if (!e->dh) {
+        if ((dir->i_size + bs - 1) / bs < EXT2_DIRHASH_MIN_BLOCKS) return -1;
+        e->dh = ext2_dirhash_build(m, dir, &e->map);
+        if (!e->dh) return -1;
+    }
+
+    uint32_t hash = ext2_name_hash(name, nlen);
+    ext2_dirhash_t *dh = e->dh;
+    uint8_t *blk = NULL;
+    uint32_t have = 0; // lbn + 1 of the block in blk
+    int rc = -2;
+    for (uint32_t i = hash & dh->mask; dh->slots[i].lbn1; i = (i + 1) & dh->mask) {
+        if (dh->slots[i].hash != hash) continue;
+        uint32_t lbn1 = dh->slots[i].lbn1;
+        if (lbn1 == have) continue;
+        if (!blk) {
+            blk = (uint8_t*)g_api->kmalloc(bs);
+            if (!blk) { rc = -1; break; }
+        }
+        uint32_t pblk = ext2_get_block_ptr(m, dir, &e->map, lbn1 - 1);
+        if (!pblk || ext2_read_block(m, pblk, blk) != 0) { rc = -1; break; }
+        have = lbn1;
+        if (ext2_dir_block_find(blk, bs, name, nlen, out_ino) == 0) { rc = 0; break; }
+    }
+    if (blk) g_api->kfree(blk);
+    return rc;
+}
+
+// Keep a directory's in-memory hash in step with an entry added to or
+// removed from block lbn. A table that cannot grow is dropped and rebuilt
+// on the next lookup.
+static void ext2_dirhash_note(ext2_mount_ctx_t *m, uint32_t dir_ino, const char *name, size_t nlen, uint32_t lbn, int add) {
+    if (!m->icache.ents) return;
+    int32_t i = ext2_icache_find(&m->icache, dir_ino);
+    if (i < 0) return;
+    ext2_icache_ent_t *e = &m->icache.ents[i];
+    if (!e->dh) return;
+    uint32_t hash = ext2_name_hash(name, nlen);
+    if (!add) ext2_dirhash_del(e->dh, hash, lbn);
+    else if (ext2_dirhash_add(e->dh, hash, lbn) != 0) ext2_dirhash_free(&e->dh);
+}
+
+// Forget the in-memory name index and free space map of a directory.
+static void ext2_dir_index_drop(ext2_mount_ctx_t *m, uint32_t dir_ino) {
+    if (!m->icache.ents) return;
+    int32_t i = ext2_icache_find(&m->icache, dir_ino);
+    if (i < 0) return;
+    ext2_dirhash_free(&m->icache.ents[i].dh);
+    ext2_dirfree_free(&m->icache.ents[i].df);
+}
+
+// Find name in directory dir_ino (whose inode is dir). Indexed directories
+// use their htree, large linear ones an in-memory hash, and small ones a
+// plain scan; an index that cannot be used falls back to the scan. Returns
+// 0 on a hit, -2 only when the name is known to be absent and -1 when the
+// directory could not be read (nothing may be concluded then).
+static int ext2_lookup_in_dir(ext2_mount_ctx_t *m, uint32_t dir_ino, const ext2_inode_t *dir, const char *name, uint32_t *out_ino) {
+    size_t nlen = m_strlen(name);
+    if (nlen == 0 || nlen > 255) return -2;
+
+    ext2_icache_ent_t *e = ext2_iget(m, dir_ino);
+    ext2_bmap_t *map = e ? &e->map : NULL;
+
+    int rc = -1;
+    if ((dir->i_flags & EXT2_INDEX_FL) && (m->sb.s_feature_compat & EXT2_COMPAT_DIR_INDEX)) {
+        rc = ext2_dx_lookup(m, dir, map, name, nlen, out_ino);
+    }
+    if (rc == -1 && e) rc = ext2_dirhash_lookup(m, e, dir, name, nlen, out_ino);
+    if (rc == -1) rc = ext2_lookup_linear(m, dir, map, name, nlen, out_ino);
+
+    ext2_iput(m, e);
+    return rc;
+}
+
+// --- dentry cache ---
+
+static uint32_t ext2_dcache_hash(uint32_t parent, const char *name, size_t nlen) {
+    return ext2_name_hash(name, nlen) ^ (parent * 2654435761u);
+}
+
+static void ext2_dcache_lru_unlink(ext2_dcache_t *c, int32_t i) {
+    ext2_dcache_ent_t *e = &c->ents[i];
+    if (e->lru_prev >= 0) c->ents[e->lru_prev].lru_next = e->lru_next;
+    else c->lru_head = e->lru_next;
+    if (e->lru_next >= 0) c->ents[e->lru_next].lru_prev = e->lru_prev;
+    else c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = -1;
+}
+
+static void ext2_dcache_lru_push_head(ext2_dcache_t *c, int32_t i) {
+    ext2_dcache_ent_t *e = &c->ents[i];
+    e->lru_prev = -1;
+    e->lru_next = c->lru_head;
+    if (c->lru_head >= 0) c->ents[c->lru_head].lru_prev = i;
+    c->lru_head = i;
+    if (c->lru_tail < 0) c->lru_tail = i;
+}
+
+static void ext2_dcache_hash_remove(ext2_dcache_t *c, int32_t i) {
+    ext2_dcache_ent_t *e = &c->ents[i];
+    int32_t *pp = &c->buckets[e->hash & c->hmask];
+    while (*pp >= 0) {
+        if (*pp == i) { *pp = e->hnext; break; }
+        pp = &c->ents[*pp].hnext;
+    }
+    e->hnext = -1;
+}
+
+static int ext2_dcache_init(ext2_mount_ctx_t *m) {
+    ext2_dcache_t *c = &m->dcache;
+    m_memset(c, 0, sizeof(*c));
+
+    uint32_t n = EXT2_DCACHE_ENTS;
+    c->ents = (ext2_dcache_ent_t*)g_api->kmalloc(sizeof(ext2_dcache_ent_t) * n);
+    c->buckets = (int32_t*)g_api->kmalloc(sizeof(int32_t) * n);
+    if (!c->ents || !c->buckets) {
+        if (c->ents) g_api->kfree(c->ents);
+        if (c->buckets) g_api->kfree(c->buckets);
+        m_memset(c, 0, sizeof(*c));
+        return -1;
+    }
+    m_memset(c->ents, 0, sizeof(ext2_dcache_ent_t) * n);
+
+    c->nents = n;
+    c->hmask = n - 1;
+    c->lru_head = c->lru_tail = -1;
+    for (uint32_t b = 0; b < n; b++) c->buckets[b] = -1;
+    for (uint32_t i = 0; i < n; i++) {
+        c->ents[i].hnext = -1;
+        ext2_dcache_lru_push_head(c, (int32_t)i);
+    }
+    return 0;
+}
+
+static void ext2_dcache_destroy(ext2_mount_ctx_t *m) {
+    ext2_dcache_t *c = &m->dcache;
+    if (!c->ents) return;
+    g_api->kfree(c->buckets);
+    g_api->kfree(c->ents);
+    m_memset(c, 0, sizeof(*c));
+}
+
+static int32_t ext2_dcache_find(ext2_dcache_t *c, uint32_t parent, const char *name, size_t nlen, uint32_t hash) {
+    for (int32_t i = c->buckets[hash & c->hmask]; i >= 0; i = c->ents[i].hnext) {
+        ext2_dcache_ent_t *e = &c->ents[i];
+        if (e->hash != hash || e->parent != parent || e->name_len != nlen) continue;
+        size_t k = 0;
+        while (k < nlen && e->name[k] == name[k]) k++;
+        if (k == nlen) return i;
+    }
+    return -1;
+}
+
+// Record that name in directory parent refers to ino (0: does not exist).
+static void ext2_dcache_set(ext2_mount_ctx_t *m, uint32_t parent, const char *name, size_t nlen, uint32_t ino) {
+    ext2_dcache_t *c = &m->dcache;
+    if (!c->ents || nlen == 0 || nlen > EXT2_DCACHE_NAME_MAX) return;
+
+    uint32_t hash = ext2_dcache_hash(parent, name, nlen);
+    int32_t i = ext2_dcache_find(c, parent, name, nlen, hash);
+    if (i < 0) {
+        i = c->lru_tail;
+        ext2_dcache_ent_t *e = &c->ents[i];
+        if (e->parent) ext2_dcache_hash_remove(c, i);
+        e->parent = parent;
+        e->hash = hash;
+        e->name_len = (uint8_t)nlen;
+        m_memcpy(e->name, name, nlen);
+        e->hnext = c->buckets[hash & c->hmask];
+        c->buckets[hash & c->hmask] = i;
+    }
+    c->ents[i].ino = ino;
+    if (c->lru_head != i) {
+        ext2_dcache_lru_unlink(c, i);
+        ext2_dcache_lru_push_head(c, i);
+    }
+}
+
+// Drop every entry whose parent is dir, used when the directory goes away
+// so a reused inode number cannot resolve its old children.
+static void ext2_dcache_purge_dir(ext2_mount_ctx_t *m, uint32_t dir) {
+    ext2_dcache_t *c = &m->dcache;
+    if (!c->ents) return;
+    for (uint32_t i = 0; i < c->nents; i++) {
+        ext2_dcache_ent_t *e = &c->ents[i];
+        if (e->parent != dir) continue;
+        ext2_dcache_hash_remove(c, (int32_t)i);
+        e->parent = 0;
+        ext2_dcache_lru_unlink(c, (int32_t)i);
+        e->lru_prev = c->lru_tail;
+        e->lru_next = -1;
+        if (c->lru_tail >= 0) c->ents[c->lru_tail].lru_next = (int32_t)i;
+        c->lru_tail = (int32_t)i;
+        if (c->lru_head < 0) c->lru_head = (int32_t)i;
+    }
+}
+
+// Called after name was added to (ino != 0) or removed from (ino == 0)
+// block lbn of directory dir_ino, to keep the lookup caches in step.
+static void ext2_dir_changed(ext2_mount_ctx_t *m, uint32_t dir_ino, const char *name, size_t nlen, uint32_t lbn, uint32_t ino) {
+    ext2_dirhash_note(m, dir_ino, name, nlen, lbn, ino != 0);
+    ext2_dcache_set(m, dir_ino, name, nlen, ino);
+}
+
+// ext2_lookup_in_dir() behind the dentry cache. Confirmed misses are cached
+// too, so repeated probes for absent names stay off the directory blocks;
+// lookup errors are not.
+static int ext2_lookup_cached(ext2_mount_ctx_t *m, uint32_t dir_ino, const ext2_inode_t *dir, const char *name, uint32_t *out_ino) {
+    ext2_dcache_t *c = &m->dcache;
+    size_t nlen = m_strlen(name);
+    if (c->ents && nlen > 0 && nlen <= EXT2_DCACHE_NAME_MAX) {
+        int32_t i = ext2_dcache_find(c, dir_ino, name, nlen, ext2_dcache_hash(dir_ino, name, nlen));
+        if (i >= 0) {
+            if (c->lru_head != i) {
+                ext2_dcache_lru_unlink(c, i);
+                ext2_dcache_lru_push_head(c, i);
+            }
+            if (!c->ents[i].ino) return -2;
+            *out_ino = c->ents[i].ino;
+            return 0;
+        }
+    }
+
+    uint32_t ino = 0;
+    int rc = ext2_lookup_in_dir(m, dir_ino, dir, name, &ino);
+    if (rc == 0 || rc == -2) ext2_dcache_set(m, dir_ino, name, nlen, rc == 0 ? ino : 0);
+    if (rc != 0) return rc;
+    *out_ino = ino;
+    return 0;
+}
+
+static int ext2_resolve_path(ext2_mount_ctx_t *m, const char *path, uint32_t *out_ino, int hop) {
+    if (!path || !out_ino) return -1;
+    if (hop > 8) return -9;
+
+    // Root
+    uint32_t cur_ino = 2;
+    ext2_inode_t cur;
+    if (ext2_read_inode(m, cur_ino, &cur) != 0) return -2;
+
+    // skip leading '/'
+    while (*path == '/') path++;
+    if (!*path) { *out_ino = cur_ino; return 0; }
+
+    char seg[256];
+    const char *p = path;
+    while (*p) {
+        size_t i = 0;
+        while (p[i] && p[i] != '/') {
+            if (i + 1 < sizeof(seg)) seg[i] = p[i];
+            i++;
+        }
+        seg[(i < sizeof(seg)) ? i : (sizeof(seg) - 1)] = 0;
+
+        while (p[i] == '/') i++;
+        const char *next = p + i;
+
+        uint32_t next_ino = 0;
+        if (ext2_lookup_cached(m, cur_ino, &cur, seg, &next_ino) != 0) return -3;
+
+        ext2_inode_t nin;
+        if (ext2_read_inode(m, next_ino, &nin) != 0) return -4;
+
+        // symlink?
+        if ((nin.i_mode & 0xF000) == 0xA000) {
+            char target[512];
+            if (ext2_readlink(m, &nin, target, sizeof(target)) != 0) return -5;
+
+            // build new path: target + '/' + remainder
+            char newp[1024];
+            newp[0] = 0;
+            if (target[0] == '/') {
+                m_strncpy(newp, target, sizeof(newp) - 1);
+            } else {
+                // relative to the directory holding the link
+                size_t dlen = (size_t)(p - path);
+                if (dlen + 2 > sizeof(newp)) return -5;
+                newp[0] = '/';
+                m_memcpy(newp + 1, path, dlen);
+                newp[dlen + 1] = 0;
+                m_strncat(newp, target, sizeof(newp) - m_strlen(newp) - 1);
+            }
+            if (*next) {
+                if (newp[m_strlen(newp) - 1] != '/') m_strncat(newp, "/", sizeof(newp) - m_strlen(newp) - 1);
+                m_strncat(newp, next, sizeof(newp) - m_strlen(newp) - 1);
+            }
+
+            return ext2_resolve_path(m, newp, out_ino, hop + 1);
+        }
+
+        // advance
+        cur_ino = next_ino;
+        cur = nin;
+        p = next;
+        if (!*p) break;
+    }
+
+    *out_ino = cur_ino;
+    return 0;
+}
+
+// Resolve the directory part of a path and look the last component up in it,
+// without following a symlink at the leaf. *out_ino is 0 if the leaf does
+// not exist; a failed lookup is an error, never "absent".
+static int ext2_resolve_leaf(ext2_mount_ctx_t *m, const char *parent_path, const char *name, uint32_t *out_parent, uint32_t *out_ino) {
+    uint32_t parent = 0;
+    if (ext2_resolve_path(m, parent_path, &parent, 0) != 0) return -1;
+
+    ext2_inode_t pin;
+    if (ext2_read_inode(m, parent, &pin) != 0) return -2;
+    if ((pin.i_mode & 0xF000) != 0x4000) return -3;
+
+    uint32_t ino = 0;
+    int rc = ext2_lookup_cached(m, parent, &pin, name, &ino);
+    if (rc == -2) ino = 0;
+    else if (rc != 0) return -2;
+    *out_parent = parent;
+    *out_ino = ino;
+    return 0;
+}
+
+static int ext2_stat(fs_mount_t *mount, const char *path, fs_file_info_t *info) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    uint32_t ino;
+    if (ext2_resolve_path(m, path, &ino, 0) != 0) return -1;
+    ext2_inode_t in;
+    if (ext2_read_inode(m, ino, &in) != 0) return -2;
+
+    m_memset(info, 0, sizeof(*info));
+    info->size = ext2_isize(&in);
+    info->is_directory = ((in.i_mode & 0xF000) == 0x4000);
+    return 0;
+}
+
+static int ext2_file_exists(fs_mount_t *mount, const char *path) {
+    fs_file_info_t i;
+    if (ext2_stat(mount, path, &i) != 0) return 0;
+    return i.is_directory ? 0 : 1;
+}
+
+static int ext2_dir_exists(fs_mount_t *mount, const char *path) {
+    fs_file_info_t i;
+    if (ext2_stat(mount, path, &i) != 0) return 0;
+    return i.is_directory ? 1 : 0;
+}
+
+static int ext2_read_file(fs_mount_t *mount, const char *path, void *buffer, size_t buffer_size, size_t *bytes_read) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    uint32_t ino;
+    if (ext2_resolve_path(m, path, &ino, 0) != 0) return -1;
+
+    // Pin the cached inode for the duration of the read instead of copying it.
+    ext2_icache_ent_t *ie = ext2_iget(m, ino);
+    ext2_inode_t in;
+    const ext2_inode_t *inp = ie ? &ie->inode : &in;
+    if (!ie && ext2_read_inode(m, ino, &in) != 0) return -2;
+    if (((inp->i_mode & 0xF000) != 0x8000) && ((inp->i_mode & 0xF000) != 0xA000)) { ext2_iput(m, ie); return -3; }
+
+    int r = 0;
+    size_t got = 0;
+    if (ie && ie->da_buf) {
+        // Not allocated yet: serve the buffered contents.
+        got = ie->da_len < buffer_size ? ie->da_len : buffer_size;
+        m_memcpy(buffer, ie->da_buf, got);
+    } else {
+        r = ext2_read_inode_data(m, inp, ie ? &ie->map : NULL, 0, buffer, buffer_size, &got);
+    }
+    ext2_iput(m, ie);
+    if (r < 0) return r;
+    if (bytes_read) *bytes_read = got;
+    return 0;
+}
+
+static int ext2_add_dirent_root_typed(ext2_mount_ctx_t *m, uint32_t ino, const char *name, uint8_t ftype) {
+    // Minimal: add to root directory only (inode 2), single-block directories from ModuOS mkfs.
+    ext2_inode_t root;
+    if (ext2_read_inode(m, 2, &root) != 0) return -1;
+    if ((root.i_mode & 0xF000) != 0x4000) return -2;
+
+    uint32_t bs = m->block_size;
+    uint32_t pblk = root.i_block[0];
+    if (!pblk) return -3;
+
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (!blk) return -4;
+    if (ext2_read_block(m, pblk, blk) != 0) { g_api->kfree(blk); return -5; }
+
+    size_t nlen = m_strlen(name);
+    if (nlen == 0 || nlen > 255) { g_api->kfree(blk); return -6; }
+
+    // Find last entry in block to see if it has slack.
+    uint32_t off = 0;
+    ext2_dirent_t *last = NULL;
+    while (off + sizeof(ext2_dirent_t) <= bs) {
+        ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
+        if (de->rec_len == 0) break;
+        last = de;
+        off += de->rec_len;
+        if (off >= bs) break;
+    }
+    if (!last) { g_api->kfree(blk); return -7; }
+
+    uint32_t last_name = last->name_len;
+    uint32_t last_used = (uint32_t)((8 + last_name + 3) & ~3u);
+    uint32_t last_slack = last->rec_len - last_used;
+
+    uint32_t need = (uint32_t)((8 + nlen + 3) & ~3u);
+    if (last_slack < need) { g_api->kfree(blk); return -8; }
+
+    // Shrink last and place new entry after it.
+    last->rec_len = (uint16_t)last_used;
+    ext2_dirent_t *ne = (ext2_dirent_t*)((uint8_t*)last + last_used);
+    m_memset(ne, 0, sizeof(ext2_dirent_t));
+    ne->inode = ino;
+    ne->name_len = (uint8_t)nlen;
+    ne->file_type = ftype;
+    ne->rec_len = (uint16_t)last_slack;
+    m_memcpy(ne->name, name, nlen);
+
+    int rc = ext2_write_block(m, pblk, blk);
+    g_api->kfree(blk);
+    return rc;
+}
+
+static int ext2_add_dirent_root(ext2_mount_ctx_t *m, uint32_t file_ino, const char *name) {
+    return ext2_add_dirent_root_typed(m, file_ino, name, 1);
+}
+
+static int ext2_remove_dirent_root(ext2_mount_ctx_t *m, const char *name) {
+    // Minimal: root only, one-block directory. We just mark inode=0.
+    ext2_inode_t root;
+    if (ext2_read_inode(m, 2, &root) != 0) return -1;
+    if ((root.i_mode & 0xF000) != 0x4000) return -2;
+
+    uint32_t bs = m->block_size;
+    uint32_t pblk = root.i_block[0];
+    if (!pblk) return -3;
+
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (!blk) return -4;
+    if (ext2_read_block(m, pblk, blk) != 0) { g_api->kfree(blk); return -5; }
+
+    size_t nlen = m_strlen(name);
+    if (nlen == 0 || nlen > 255) { g_api->kfree(blk); return -6; }
+
+    uint32_t off = 0;
+    while (off + sizeof(ext2_dirent_t) <= bs) {
+        ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
+        if (de->rec_len == 0) break;
+        if (de->inode != 0 && de->name_len == nlen) {
+            // compare
+            int match = 1;
+            for (size_t i = 0; i < nlen; i++) {
+                if (((const char*)de->name)[i] != name[i]) { match = 0; break; }
+            }
+            if (match) {
+                de->inode = 0;
+                int rc = ext2_write_block(m, pblk, blk);
+                g_api->kfree(blk);
+                return rc;
+            }
+        }
+        off += de->rec_len;
+        if (off >= bs) break;
+    }
+
+    g_api->kfree(blk);
+    return -7;
+}
+
+static uint16_t ext2_dirent_min_rec_len(uint8_t name_len) {
     return (uint16_t)((8u + (uint32_t)name_len + 3u) & ~3u);
 }
 
-static int ext2_dirent_match(const ext2_dirent_t *de, const char *name, size_t nlen) {
-    if (!de || !name) return 0;
-    if (de->inode == 0) return 0;
-    if (de->name_len != nlen) return 0;
-    for (size_t i = 0; i < nlen; i++) {
-        if (((const char*)de->name)[i] != name[i]) return 0;
+// Linear updates would leave an htree index stale, so clear the index flag
+// before touching an indexed directory. Index blocks read back as empty
+// records, which keeps the directory valid for linear scans.
+static void ext2_dir_drop_index(ext2_mount_ctx_t *m, uint32_t dir_ino, ext2_inode_t *dir) {
+    if (!(dir->i_flags & EXT2_INDEX_FL)) return;
+    dir->i_flags &= ~EXT2_INDEX_FL;
+    (void)ext2_write_inode(m, dir_ino, dir);
+}
+
+// Bytes of blk available to new records: everything not taken by the
+// minimal length of a live record. 0 for a malformed block.
+static uint32_t ext2_dir_block_free(const uint8_t *blk, uint32_t bs) {
+    uint32_t off = 0, used = 0;
+    while (off < bs) {
+        const ext2_dirent_t *de = (const ext2_dirent_t*)(blk + off);
+        if (off + 8u > bs || de->rec_len < 8u || off + de->rec_len > bs) return 0;
+        if (de->inode != 0) used += ext2_dirent_min_rec_len(de->name_len);
+        off += de->rec_len;
+    }
+    return bs - used;
+}
+
+// Place a record for name in the first slot of blk that can hold it,
+// either an unused record or the slack behind a live one. -1 = no room.
+static int ext2_dir_block_insert(uint8_t *blk, uint32_t bs, const char *name, size_t nlen, uint32_t ino, uint8_t ftype) {
+    uint16_t need = ext2_dirent_min_rec_len((uint8_t)nlen);
+    uint32_t off = 0;
+    while (off + sizeof(ext2_dirent_t) <= bs) {
+        ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
+        if (de->rec_len == 0) break;
+
+        ext2_dirent_t *ins = NULL;
+        uint16_t rec = 0;
+        if (de->inode == 0) {
+            if (de->rec_len >= need) {
+                ins = de;
+                rec = de->rec_len;
+            }
+        } else {
+            uint16_t used = ext2_dirent_min_rec_len(de->name_len);
+            if (de->rec_len >= used + need) {
+                rec = (uint16_t)(de->rec_len - used);
+                de->rec_len = used;
+                ins = (ext2_dirent_t*)((uint8_t*)de + used);
+            }
+        }
+        if (ins) {
+            m_memset(ins, 0, sizeof(*ins));
+            ins->inode = ino;
+            ins->name_len = (uint8_t)nlen;
+            ins->file_type = ftype;
+            ins->rec_len = rec;
+            m_memcpy(ins->name, name, nlen);
+            return 0;
+        }
+
+        off += de->rec_len;
+        if (off >= bs) break;
+    }
+    return -1;
+}
+
+// Slide the live records of blk to the front, each at its minimal length,
+// so all free space ends up in one slot behind the last of them.
+static int ext2_dir_block_compact(uint8_t *blk, uint32_t bs) {
+    if (ext2_dir_block_free(blk, bs) == 0) return -1;
+
+    uint32_t off = 0, dst = 0, last = bs;
+    while (off < bs) {
+        ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
+        uint32_t rec = de->rec_len;
+        if (de->inode != 0) {
+            uint16_t used = ext2_dirent_min_rec_len(de->name_len);
+            // dst never passes off, so a forward copy is safe
+            for (uint32_t k = 0; k < used && dst != off; k++) blk[dst + k] = blk[off + k];
+            ((ext2_dirent_t*)(blk + dst))->rec_len = used;
+            last = dst;
+            dst += used;
+        }
+        off += rec;
+    }
+
+    if (last == bs) {
+        ext2_dirent_t *de = (ext2_dirent_t*)blk;
+        m_memset(de, 0, sizeof(*de));
+        de->rec_len = (uint16_t)bs;
+    } else {
+        ext2_dirent_t *de = (ext2_dirent_t*)(blk + last);
+        de->rec_len = (uint16_t)(de->rec_len + (bs - dst));
+    }
+    return 0;
+}
+
+static int ext2_dirfree_set(ext2_dirfree_t *df, uint32_t lbn, uint32_t bytes) {
+    if (lbn >= df->cap) {
+        uint32_t cap = df->cap ? df->cap : 16u;
+        while (cap <= lbn) cap *= 2u;
+        uint16_t *nf = (uint16_t*)g_api->kmalloc(sizeof(uint16_t) * cap);
+        if (!nf) return -1;
+        m_memset(nf, 0, sizeof(uint16_t) * cap);
+        if (df->free) {
+            m_memcpy(nf, df->free, sizeof(uint16_t) * df->nblocks);
+            g_api->kfree(df->free);
+        }
+        df->free = nf;
+        df->cap = cap;
+    }
+    if (lbn >= df->nblocks) df->nblocks = lbn + 1;
+    df->free[lbn] = (uint16_t)(bytes > 0xFFFFu ? 0xFFFFu : bytes);
+    return 0;
+}
+
+static ext2_dirfree_t *ext2_dirfree_build(ext2_mount_ctx_t *m, const ext2_inode_t *dir, ext2_bmap_t *map) {
+    uint32_t bs = m->block_size;
+    uint32_t blocks = (dir->i_size + bs - 1) / bs;
+
+    ext2_dirfree_t *df = (ext2_dirfree_t*)g_api->kmalloc(sizeof(*df));
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (df) m_memset(df, 0, sizeof(*df));
+    if (!df || !blk) goto fail;
+
+    for (uint32_t lbn = 0; lbn < blocks; lbn++) {
+        uint32_t pblk = ext2_get_block_ptr(m, dir, map, lbn);
+        uint32_t bytes = 0;
+        if (pblk) {
+            if (ext2_read_block(m, pblk, blk) != 0) goto fail;
+            bytes = ext2_dir_block_free(blk, bs);
+        }
+        if (ext2_dirfree_set(df, lbn, bytes) != 0) goto fail;
+    }
+    g_api->kfree(blk);
+    return df;
+
+fail:
+    if (blk) g_api->kfree(blk);
+    ext2_dirfree_free(&df);
+    return NULL;
+}
+
+// Record the free bytes of block lbn after a change; a map that cannot
+// grow is dropped and rebuilt on the next insert.
+static void ext2_dirfree_note(ext2_mount_ctx_t *m, uint32_t dir_ino, uint32_t lbn, uint32_t bytes) {
+    if (!m->icache.ents) return;
+    int32_t i = ext2_icache_find(&m->icache, dir_ino);
+    if (i < 0) return;
+    ext2_icache_ent_t *e = &m->icache.ents[i];
+    if (e->df && ext2_dirfree_set(e->df, lbn, bytes) != 0) ext2_dirfree_free(&e->df);
+}
+
+static int ext2_dir_add_entry(ext2_mount_ctx_t *m, uint32_t dir_ino, const char *name, uint32_t ino, uint8_t ftype) {
+    if (!m || !name || !*name) return -1;
+    if (!ext2_writable(m)) return -2;
+
+    size_t nlen = m_strlen(name);
+    if (nlen == 0 || nlen > 255) return -3;
+
+    ext2_inode_t dir;
+    if (ext2_read_inode(m, dir_ino, &dir) != 0) return -4;
+    if ((dir.i_mode & 0xF000) != 0x4000) return -5;
+    ext2_dir_drop_index(m, dir_ino, &dir);
+    ext2_bmap_t *dmap = ext2_bmap_for(m, dir_ino);
+
+    // Must not already exist
+    uint32_t exists_ino = 0;
+    int lr = ext2_lookup_cached(m, dir_ino, &dir, name, &exists_ino);
+    if (lr == 0) return -6;
+    if (lr != -2) return -4;
+
+    uint32_t bs = m->block_size;
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (!blk) return -7;
+
+    uint16_t need = ext2_dirent_min_rec_len((uint8_t)nlen);
+    uint32_t blocks = (dir.i_size + bs - 1) / bs;
+    if (blocks == 0) blocks = 1;
+
+    // The free space map (when the inode cache has room for one) says which
+    // blocks can take the record; without it every block is tried.
+    ext2_icache_ent_t *e = m->icache.ents ? ext2_iget(m, dir_ino) : NULL;
+    if (e && !e->df) e->df = ext2_dirfree_build(m, &dir, dmap);
+    ext2_dirfree_t *df = e ? e->df : NULL;
+
+    int rc = 0;
+    for (uint32_t lbn = 0; lbn < blocks; lbn++) {
+        if (df && lbn < df->nblocks && df->free[lbn] < need) continue;
+        uint32_t pblk = ext2_get_block_ptr(m, &dir, dmap, lbn);
+        if (!pblk) continue;
+        if (ext2_read_block(m, pblk, blk) != 0) continue;
+
+        // Room that is split across several records is joined first.
+        uint32_t bytes = ext2_dir_block_free(blk, bs);
+        int placed = ext2_dir_block_insert(blk, bs, name, nlen, ino, ftype) == 0;
+        if (!placed && bytes >= need && ext2_dir_block_compact(blk, bs) == 0) {
+            placed = ext2_dir_block_insert(blk, bs, name, nlen, ino, ftype) == 0;
+        }
+        if (!placed) {
+            if (df) (void)ext2_dirfree_set(df, lbn, 0);
+            continue;
+        }
+
+        rc = ext2_write_block(m, pblk, blk);
+        if (rc == 0) {
+            ext2_dir_changed(m, dir_ino, name, nlen, lbn, ino);
+            ext2_dirfree_note(m, dir_ino, lbn, bytes - need);
+        }
+        goto out;
+    }
+
+    // Need a new directory block, placed after the directory's last block
+    // or in its inode's group.
+    uint32_t newblk = 0;
+    uint32_t goal = 0;
+    if (blocks > 0) goal = ext2_get_block_ptr(m, &dir, dmap, blocks - 1);
+    goal = goal ? goal + 1 : ext2_inode_goal(m, dir_ino);
+    if (ext2_alloc_block(m, goal, &newblk) != 0) { rc = -8; goto out; }
+
+    uint32_t new_lbn = blocks; // append
+    if (ext2_set_block_ptr(m, &dir, dmap, new_lbn, newblk) != 0) { rc = -9; goto out; }
+
+    dir.i_size += bs;
+    dir.i_blocks += (bs / 512u);
+    (void)ext2_write_inode(m, dir_ino, &dir);
+
+    // The new block holds just this record, which spans the whole block.
+    m_memset(blk, 0, bs);
+    ext2_dirent_t *de = (ext2_dirent_t*)blk;
+    de->inode = ino;
+    de->name_len = (uint8_t)nlen;
+    de->file_type = ftype;
+    de->rec_len = (uint16_t)bs;
+    m_memcpy(de->name, name, nlen);
+
+    rc = ext2_write_block(m, newblk, blk);
+    if (rc == 0) {
+        ext2_dir_changed(m, dir_ino, name, nlen, new_lbn, ino);
+        ext2_dirfree_note(m, dir_ino, new_lbn, bs - need);
+    }
+
+out:
+    g_api->kfree(blk);
+    ext2_iput(m, e);
+    return rc;
+}
+
+// Remove name from block lbn of the directory. The record is folded into
+// the one before it; only the first record of a block is left in place as
+// unused. Returns 1 if the name is not in this block.
+static int ext2_dir_remove_in_block(ext2_mount_ctx_t *m, uint32_t dir_ino, const ext2_inode_t *dir, ext2_bmap_t *dmap,
+                                    uint32_t lbn, uint8_t *blk, const char *name, size_t nlen) {
+    uint32_t bs = m->block_size;
+    uint32_t pblk = ext2_get_block_ptr(m, dir, dmap, lbn);
+    if (!pblk) return 1;
+    if (ext2_read_block(m, pblk, blk) != 0) return 1;
+
+    uint32_t off = 0;
+    ext2_dirent_t *prev = NULL;
+    while (off + sizeof(ext2_dirent_t) <= bs) {
+        ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
+        if (de->rec_len == 0) break;
+        if (ext2_dirent_match(de, name, nlen)) {
+            if (prev) prev->rec_len = (uint16_t)(prev->rec_len + de->rec_len);
+            else de->inode = 0;
+            int rc = ext2_write_block(m, pblk, blk);
+            if (rc != 0) return rc;
+            ext2_dir_changed(m, dir_ino, name, nlen, lbn, 0);
+            ext2_dirfree_note(m, dir_ino, lbn, ext2_dir_block_free(blk, bs));
+            return 0;
+        }
+        prev = de;
+        off += de->rec_len;
+        if (off >= bs) break;
+    }
+    return 1;
+}
+
+static int ext2_dir_remove_entry(ext2_mount_ctx_t *m, uint32_t dir_ino, const char *name) {
+    if (!m || !name || !*name) return -1;
+    if (!ext2_writable(m)) return -2;
+
+    size_t nlen = m_strlen(name);
+    if (nlen == 0 || nlen > 255) return -3;
+
+    ext2_inode_t dir;
+    if (ext2_read_inode(m, dir_ino, &dir) != 0) return -4;
+    if ((dir.i_mode & 0xF000) != 0x4000) return -5;
+    ext2_dir_drop_index(m, dir_ino, &dir);
+    ext2_bmap_t *dmap = ext2_bmap_for(m, dir_ino);
+
+    uint32_t bs = m->block_size;
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (!blk) return -6;
+
+    // The in-memory name hash, when built, names the candidate blocks.
+    int rc = 1;
+    int32_t ci = m->icache.ents ? ext2_icache_find(&m->icache, dir_ino) : -1;
+    ext2_dirhash_t *dh = ci >= 0 ? m->icache.ents[ci].dh : NULL;
+    if (dh) {
+        uint32_t hash = ext2_name_hash(name, nlen);
+        for (uint32_t i = hash & dh->mask; dh->slots[i].lbn1 && rc == 1; i = (i + 1) & dh->mask) {
+            if (dh->slots[i].hash != hash) continue;
+            rc = ext2_dir_remove_in_block(m, dir_ino, &dir, dmap, dh->slots[i].lbn1 - 1, blk, name, nlen);
+        }
+    }
+
+    uint32_t blocks = (dir.i_size + bs - 1) / bs;
+    for (uint32_t lbn = 0; lbn < blocks && rc == 1; lbn++) {
+        rc = ext2_dir_remove_in_block(m, dir_ino, &dir, dmap, lbn, blk, name, nlen);
+    }
+
+    g_api->kfree(blk);
+    if (rc == 1) return -7;
+    return rc;
+}
+
+static int ext2_split_parent(const char *path, char *parent, size_t parent_sz, const char **out_name) {
+    if (!path || !parent || parent_sz == 0 || !out_name) return -1;
+    *out_name = NULL;
+    parent[0] = 0;
+
+    if (path[0] != '/') return -2;
+
+    // strip trailing slashes
+    size_t len = m_strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+
+    // find last slash
+    size_t last = 0;
+    for (size_t i = 0; i < len; i++) if (path[i] == '/') last = i;
+
+    if (last == 0) {
+        // parent is root
+        m_strncpy(parent, "/", parent_sz);
+        *out_name = path + 1;
+        return 0;
+    }
+
+    // copy parent substring
+    size_t plen = last;
+    if (plen >= parent_sz) plen = parent_sz - 1;
+    for (size_t i = 0; i < plen; i++) parent[i] = path[i];
+    parent[plen] = 0;
+
+    *out_name = path + last + 1;
+    return 0;
+}
+
+static int ext2_do_mkdir(fs_mount_t *mount, const char *path) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    if (!m || !g_api || !g_api->block_write) return -1;
+    if (!ext2_writable(m)) return -2;
+    if (!path || path[0] != '/') return -2;
+
+    char parent_path[512];
+    const char *name = NULL;
+    if (ext2_split_parent(path, parent_path, sizeof(parent_path), &name) != 0) return -4;
+    if (!name || !*name) return -5;
+
+    uint32_t parent_ino = 0, existing = 0;
+    if (ext2_resolve_leaf(m, parent_path, name, &parent_ino, &existing) != 0) return -6;
+    if (existing) return -3;
+
+    ext2_inode_t pin;
+    if (ext2_read_inode(m, parent_ino, &pin) != 0) return -7;
+    if ((pin.i_mode & 0xF000) != 0x4000) return -8;
+
+    uint32_t ino = 0;
+    if (ext2_alloc_inode(m, parent_ino, 1, &ino) != 0) return -9;
+
+    uint32_t blkno = 0;
+    if (ext2_alloc_block(m, ext2_inode_goal(m, ino), &blkno) != 0) return -10;
+
+    // Add entry into parent directory
+    if (ext2_dir_add_entry(m, parent_ino, name, ino, 2) != 0) return -11;
+
+    // Create inode
+    ext2_inode_t din;
+    m_memset(&din, 0, sizeof(din));
+    din.i_mode = (uint16_t)(0x4000 | 0755);
+    din.i_size = m->block_size;
+    din.i_links_count = 2; // '.' and parent link
+    din.i_blocks = (m->block_size / 512u);
+    din.i_block[0] = blkno;
+
+    if (ext2_write_inode(m, ino, &din) != 0) return -12;
+
+    // Write directory block with '.' and '..'
+    uint32_t bs = m->block_size;
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (!blk) return -13;
+    m_memset(blk, 0, bs);
+
+    ext2_dirent_t *de1 = (ext2_dirent_t*)blk;
+    de1->inode = ino;
+    de1->name_len = 1;
+    de1->file_type = 2;
+    de1->rec_len = 12;
+    ((char*)blk)[8] = '.';
+
+    ext2_dirent_t *de2 = (ext2_dirent_t*)(blk + de1->rec_len);
+    de2->inode = parent_ino;
+    de2->name_len = 2;
+    de2->file_type = 2;
+    de2->rec_len = (uint16_t)(bs - de1->rec_len);
+    ((char*)blk)[de1->rec_len + 8] = '.';
+    ((char*)blk)[de1->rec_len + 9] = '.';
+
+    if (ext2_write_block(m, blkno, blk) != 0) { g_api->kfree(blk); return -14; }
+    g_api->kfree(blk);
+
+    // Update parent link count (best-effort)
+    pin.i_links_count++;
+    (void)ext2_write_inode(m, parent_ino, &pin);
+
+    return 0;
+}
+
+// Queue an indirect table and everything it maps on fl.
+static int ext2_free_indirect_chain(ext2_mount_ctx_t *m, uint32_t ind_blk, int level, ext2_freelist_t *fl) {
+    if (!m || !g_api) return -1;
+    if (!ind_blk) return 0;
+    if (level < 1 || level > 3) return -2;
+
+    uint32_t bs = m->block_size;
+    uint32_t ppb = bs / 4;
+    uint32_t *tbl = (uint32_t*)g_api->kmalloc(bs);
+    if (!tbl) return -3;
+    if (ext2_read_block(m, ind_blk, tbl) != 0) { g_api->kfree(tbl); return -4; }
+
+    for (uint32_t i = 0; i < ppb; i++) {
+        uint32_t v = tbl[i];
+        if (!v) continue;
+        if (level == 1) ext2_freelist_add(m, fl, v);
+        else (void)ext2_free_indirect_chain(m, v, level - 1, fl);
+    }
+
+    g_api->kfree(tbl);
+    ext2_freelist_add(m, fl, ind_blk);
+    return 0;
+}
+
+static int ext2_do_unlink(fs_mount_t *mount, const char *path) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    if (!m || !g_api || !g_api->block_write) return -1;
+    if (!ext2_writable(m)) return -2;
+    if (!path || path[0] != '/') return -2;
+
+    // refuse root
+    if (path[0] == '/' && path[1] == 0) return -3;
+
+    char parent_path[512];
+    const char *name = NULL;
+    if (ext2_split_parent(path, parent_path, sizeof(parent_path), &name) != 0) return -4;
+    if (!name || !*name) return -5;
+
+    uint32_t parent_ino = 0, ino = 0;
+    if (ext2_resolve_leaf(m, parent_path, name, &parent_ino, &ino) != 0) return -6;
+    if (!ino) return -7;
+
+    ext2_inode_t pin;
+    if (ext2_read_inode(m, parent_ino, &pin) != 0) return -8;
+    if ((pin.i_mode & 0xF000) != 0x4000) return -9;
+
+    ext2_inode_t in;
+    if (ext2_read_inode(m, ino, &in) != 0) return -10;
+
+    // Only regular files for now
+    if ((in.i_mode & 0xF000) == 0x4000) return -11; // directory
+
+    // Remove entry from parent directory
+    if (ext2_dir_remove_entry(m, parent_ino, name) != 0) return -12;
+
+    // Other hard links keep the inode alive.
+    if (in.i_links_count > 1) {
+        in.i_links_count--;
+        return ext2_write_inode(m, ino, &in) == 0 ? 0 : -13;
     }
-    return 1;
+
+    // Buffered data that never reached the disk is simply dropped.
+    ext2_icache_ent_t *ie = m->icache.ents ? ext2_icache_lookup(m, ino, 1) : NULL;
+    if (ie) ext2_da_release(m, ie);
+
+    // Fast symlinks keep their target in i_block; there is nothing to free.
+    int fast_link = ((in.i_mode & 0xF000) == 0xA000 && in.i_blocks == 0);
+    if (!fast_link) {
+        ext2_bmap_reset(ext2_bmap_for(m, ino));
+        (void)ext2_truncate_blocks(m, &in, 0);
+    }
+
+    // Clear inode and free inode bitmap
+    ext2_inode_t z;
+    m_memset(&z, 0, sizeof(z));
+    (void)ext2_write_inode(m, ino, &z);
+    (void)ext2_free_inode(m, ino, 0);
+
+    return 0;
 }
 
-static int ext2_dir_add_entry(ext2_mount_ctx_t *m, uint32_t dir_ino, const char *name, uint32_t ino, uint8_t ftype) {
-    if (!m || !name || !*name) return -1;
-    if (m->block_size != 4096 || m->groups != 1) return -2;
+static int ext2_do_rmdir(fs_mount_t *mount, const char *path) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    if (!m || !g_api || !g_api->block_write) return -1;
+    if (!ext2_writable(m)) return -2;
+    if (!path || path[0] != '/') return -2;
 
-    size_t nlen = m_strlen(name);
-    if (nlen == 0 || nlen > 255) return -3;
+    // refuse root
+    if (path[0] == '/' && path[1] == 0) return -3;
 
-    ext2_inode_t dir;
-    if (ext2_read_inode(m, dir_ino, &dir) != 0) return -4;
-    if ((dir.i_mode & 0xF000) != 0x4000) return -5;
+    char parent_path[512];
+    const char *name = NULL;
+    if (ext2_split_parent(path, parent_path, sizeof(parent_path), &name) != 0) return -4;
+    if (!name || !*name) return -5;
 
-    // Must not already exist
-    uint32_t exists_ino = 0;
-    if (ext2_lookup_in_dir(m, &dir, name, &exists_ino) == 0) return -6;
+    uint32_t parent_ino = 0, ino = 0;
+    if (ext2_resolve_leaf(m, parent_path, name, &parent_ino, &ino) != 0) return -6;
+    if (!ino) return -7;
+
+    ext2_inode_t pin;
+    if (ext2_read_inode(m, parent_ino, &pin) != 0) return -8;
+    if ((pin.i_mode & 0xF000) != 0x4000) return -9;
+
+    ext2_inode_t din;
+    if (ext2_read_inode(m, ino, &din) != 0) return -10;
+    if ((din.i_mode & 0xF000) != 0x4000) return -11;
 
     uint32_t bs = m->block_size;
-    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
-    if (!blk) return -7;
 
-    uint16_t need = ext2_dirent_min_rec_len((uint8_t)nlen);
+    // Ensure empty across all blocks (only '.' and '..')
+    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
+    if (!blk) return -12;
 
-    // Scan existing blocks for space.
-    uint32_t blocks = (dir.i_size + bs - 1) / bs;
-    if (blocks == 0) blocks = 1;
+    uint32_t blocks = (din.i_size + bs - 1) / bs;
+    int ok_empty = 1;
 
     for (uint32_t lbn = 0; lbn < blocks; lbn++) {
-        uint32_t pblk = ext2_get_block_ptr(m, &dir, lbn);
+        uint32_t pblk = ext2_get_block_ptr(m, &din, NULL, lbn);
         if (!pblk) continue;
         if (ext2_read_block(m, pblk, blk) != 0) continue;
 
@@ -786,478 +4283,1471 @@ static int ext2_dir_add_entry(ext2_mount_ctx_t *m, uint32_t dir_ino, const char
         while (off + sizeof(ext2_dirent_t) <= bs) {
             ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
             if (de->rec_len == 0) break;
-
-            // Reuse a free entry
-            if (de->inode == 0) {
-                if (de->rec_len >= need) {
-                    uint16_t old = de->rec_len;
-                    de->inode = ino;
-                    de->name_len = (uint8_t)nlen;
-                    de->file_type = ftype;
-                    de->rec_len = need;
-                    m_memcpy(de->name, name, nlen);
-
-                    uint16_t rem = (uint16_t)(old - need);
-                    if (rem >= 8) {
-                        ext2_dirent_t *ne = (ext2_dirent_t*)((uint8_t*)de + need);
-                        m_memset(ne, 0, sizeof(*ne));
-                        ne->inode = 0;
-                        ne->rec_len = rem;
-                        ne->name_len = 0;
-                        ne->file_type = 0;
-                    } else {
-                        // just consume the whole record
-                        de->rec_len = old;
-                    }
-
-                    int rc = ext2_write_block(m, pblk, blk);
-                    g_api->kfree(blk);
-                    return rc;
-                }
-            } else {
-                uint16_t used = ext2_dirent_min_rec_len(de->name_len);
-                if (de->rec_len > used) {
-                    uint16_t slack = (uint16_t)(de->rec_len - used);
-                    if (slack >= need) {
-                        // shrink current and insert new
-                        de->rec_len = used;
-                        ext2_dirent_t *ins = (ext2_dirent_t*)((uint8_t*)de + used);
-                        m_memset(ins, 0, sizeof(*ins));
-                        ins->inode = ino;
-                        ins->name_len = (uint8_t)nlen;
-                        ins->file_type = ftype;
-                        ins->rec_len = slack;
-                        m_memcpy(ins->name, name, nlen);
-
-                        int rc = ext2_write_block(m, pblk, blk);
-                        g_api->kfree(blk);
-                        return rc;
-                    }
+            if (de->inode != 0 && de->name_len > 0) {
+                if (!(de->name_len == 1 && de->name[0] == '.') && !(de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.')) {
+                    ok_empty = 0;
+                    break;
                 }
             }
-
             off += de->rec_len;
             if (off >= bs) break;
         }
+        if (!ok_empty) break;
     }
 
-    // Need a new directory block (direct blocks only via ext2_set_block_ptr)
-    uint32_t newblk = 0;
-    if (ext2_alloc_block0(m, &newblk) != 0) { g_api->kfree(blk); return -8; }
+    g_api->kfree(blk);
+    if (!ok_empty) return -13;
 
-    // Initialize the new block as one big free record.
-    m_memset(blk, 0, bs);
-    ext2_dirent_t *fre = (ext2_dirent_t*)blk;
-    fre->inode = 0;
-    fre->rec_len = (uint16_t)bs;
-    fre->name_len = 0;
-    fre->file_type = 0;
-    (void)ext2_write_block(m, newblk, blk);
+    // Remove dirent from parent
+    if (ext2_dir_remove_entry(m, parent_ino, name) != 0) return -14;
 
-    uint32_t new_lbn = blocks; // append
-    if (ext2_set_block_ptr(m, &dir, new_lbn, newblk) != 0) { g_api->kfree(blk); return -9; }
+    // Free directory data blocks (best-effort)
+    ext2_bmap_reset(ext2_bmap_for(m, ino));
+    (void)ext2_truncate_blocks(m, &din, 0);
 
-    dir.i_size += bs;
-    dir.i_blocks += (bs / 512u);
-    (void)ext2_write_inode(m, dir_ino, &dir);
+    ext2_inode_t z;
+    m_memset(&z, 0, sizeof(z));
+    (void)ext2_write_inode(m, ino, &z);
+    (void)ext2_free_inode(m, ino, 1);
+    ext2_dir_index_drop(m, ino);
+    ext2_dcache_purge_dir(m, ino);
 
-    // Now insert into the new block (reuse logic: write directly)
-    if (ext2_read_block(m, newblk, blk) != 0) { g_api->kfree(blk); return -10; }
-    ext2_dirent_t *de = (ext2_dirent_t*)blk;
-    de->inode = ino;
-    de->name_len = (uint8_t)nlen;
-    de->file_type = ftype;
-    de->rec_len = (uint16_t)bs;
-    m_memcpy(de->name, name, nlen);
+    // Update parent link count (best-effort)
+    if (pin.i_links_count > 2) pin.i_links_count--;
+    (void)ext2_write_inode(m, parent_ino, &pin);
 
-    int wrc = ext2_write_block(m, newblk, blk);
-    g_api->kfree(blk);
-    return wrc;
+    return 0;
 }
 
-static int ext2_dir_remove_entry(ext2_mount_ctx_t *m, uint32_t dir_ino, const char *name) {
-    if (!m || !name || !*name) return -1;
-    if (m->block_size != 4096 || m->groups != 1) return -2;
+// Number of indirect blocks needed to map nblk data blocks, or 0xFFFFFFFF
+// when the file does not fit in direct + single + double indirect.
+static uint32_t ext2_meta_blocks_for(ext2_mount_ctx_t *m, uint32_t nblk) {
+    uint64_t ppb = m->block_size / 4;
+    uint64_t n = nblk;
+    if (n <= 12) return 0;
+    n -= 12;
+    if (n <= ppb) return 1;
+    n -= ppb;
+    if (n <= ppb * ppb) return (uint32_t)(1 + 1 + (n + ppb - 1) / ppb);
+    n -= ppb * ppb;
+    if (n > ppb * ppb * ppb) return 0xFFFFFFFFu;
+    // ind, a full double-indirect tree, then the triple-indirect block with
+    // its level-2 tables and leaves
+    return (uint32_t)(1 + 1 + ppb + 1 + (n + ppb * ppb - 1) / (ppb * ppb) + (n + ppb - 1) / ppb);
+}
 
-    size_t nlen = m_strlen(name);
-    if (nlen == 0 || nlen > 255) return -3;
+// Largest file this volume can hold on a block-mapped inode: the reach of the
+// triple-indirect tree, capped so that i_blocks (512-byte sectors, tables
+// included) still fits in 32 bits. Revision 0 volumes cannot record the
+// large_file feature and stop at 2 GiB - 1.
+static uint64_t ext2_max_size(ext2_mount_ctx_t *m) {
+    if (m->sb.s_rev_level < 1) return 0x7FFFFFFFull;
+    uint64_t bs = m->block_size, ppb = bs / 4;
+    uint64_t reach = 12 + ppb + ppb * ppb + ppb * ppb * ppb;
+    uint64_t cap = 0xFFFFFFFFull / (bs / 512);
+    uint64_t n = cap < reach ? cap : reach;
+    uint32_t meta = ext2_meta_blocks_for(m, (uint32_t)n);
+    if (n + meta > cap) n = cap - meta;
+    return n * bs;
+}
 
-    ext2_inode_t dir;
-    if (ext2_read_inode(m, dir_ino, &dir) != 0) return -4;
-    if ((dir.i_mode & 0xF000) != 0x4000) return -5;
+// Hands out physical blocks in file order from runs reserved with
+// ext2_alloc_run(). Normally the first reservation covers the whole file.
+typedef struct {
+    uint32_t next; // next block of the current run (also the goal for the next run)
+    uint32_t left; // blocks remaining in the current run
+    uint32_t need; // blocks still to hand out
+} ext2_wcursor_t;
+
+static int ext2_wcursor_take(ext2_mount_ctx_t *m, ext2_wcursor_t *c, uint32_t *out) {
+    if (c->left == 0) {
+        uint32_t start = 0, got = 0;
+        if (c->need == 0 || ext2_alloc_run(m, c->next, c->need, &start, &got) != 0) return -1;
+        c->next = start;
+        c->left = got;
+    }
+    *out = c->next++;
+    c->left--;
+    c->need--;
+    return 0;
+}
 
+// Write n physically consecutive blocks of file data from src (avail bytes
+// valid; the rest of the last block is zero-filled). Full blocks go to the
+// device in requests of up to EXT2_MAX_IO_BYTES; only a partial last block is
+// staged in a bounce buffer.
+static int ext2_write_data_blocks(ext2_mount_ctx_t *m, uint32_t pblk, uint32_t n, const uint8_t *src, size_t avail) {
     uint32_t bs = m->block_size;
-    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
-    if (!blk) return -6;
+    uint32_t max_run = EXT2_MAX_IO_BYTES / bs;
+    if (max_run == 0) max_run = 1;
+
+    ext2_bcache_invalidate_range(m, pblk, n);
+
+    uint32_t full = (uint32_t)(avail / bs);
+    if (full > n) full = n;
+    uint32_t done = 0;
+    while (done < full) {
+        uint32_t cnt = full - done;
+        if (cnt > max_run) cnt = max_run;
+        if (bdev_write_bytes(m, (uint64_t)(pblk + done) * bs, src + (size_t)done * bs, (size_t)cnt * bs) != 0) return -1;
+        done += cnt;
+    }
+    if (done < n) {
+        uint8_t *tmp = (uint8_t*)g_api->kmalloc(bs);
+        if (!tmp) return -2;
+        m_memset(tmp, 0, bs);
+        size_t rem = avail - (size_t)done * bs;
+        if (rem > bs) rem = bs;
+        m_memcpy(tmp, src + (size_t)done * bs, rem);
+        int rc = bdev_write_bytes(m, (uint64_t)(pblk + done) * bs, tmp, bs);
+        g_api->kfree(tmp);
+        if (rc != 0) return -3;
+    }
+    return 0;
+}
+
+// Nonzero if the len bytes at p are all zero. Stops at the first set byte,
+// so real data costs a word or two.
+static int ext2_is_zero(const uint8_t *p, size_t len) {
+    while (len && ((uintptr_t)p & 7u)) {
+        if (*p++) return 0;
+        len--;
+    }
+    const uint64_t *w = (const uint64_t*)p;
+    for (; len >= 8; len -= 8) {
+        if (*w++) return 0;
+    }
+    p = (const uint8_t*)w;
+    while (len--) {
+        if (*p++) return 0;
+    }
+    return 1;
+}
+
+// Nonzero if logical block lbn of the size-byte image at src is all zero.
+static int ext2_block_is_zero(const uint8_t *src, size_t size, uint32_t bs, uint32_t lbn) {
+    size_t off = (size_t)lbn * bs;
+    size_t len = size - off < bs ? size - off : bs;
+    return ext2_is_zero(src + off, len);
+}
+
+// Where logical block lbn sits in the block map: 0 for a direct block, else
+// the depth of its indirect tree (1 to 3) with the index into each table
+// from the top down in idx.
+static int ext2_lbn_path(uint32_t ppb, uint32_t lbn, uint32_t idx[3]) {
+    if (lbn < 12) return 0;
+    uint64_t l = lbn - 12u;
+    if (l < ppb) {
+        idx[0] = (uint32_t)l;
+        return 1;
+    }
+    l -= ppb;
+    if (l < (uint64_t)ppb * ppb) {
+        idx[0] = (uint32_t)(l / ppb);
+        idx[1] = (uint32_t)(l % ppb);
+        return 2;
+    }
+    l -= (uint64_t)ppb * ppb;
+    idx[0] = (uint32_t)(l / ((uint64_t)ppb * ppb));
+    idx[1] = (uint32_t)((l / ppb) % ppb);
+    idx[2] = (uint32_t)(l % ppb);
+    return 3;
+}
+
+// Number of tables a block at (depth, idx) needs that the previous data
+// block, at (*pdepth, pidx), did not: blocks come in file order, so a table
+// is new exactly when some index above it changed. Updates the previous
+// path.
+static int ext2_lbn_new_tables(int depth, const uint32_t idx[3], int *pdepth, uint32_t pidx[3]) {
+    int first = 0;
+    if (depth == *pdepth) {
+        while (first < depth - 1 && idx[first] == pidx[first]) first++;
+        first++;
+        if (first > depth) first = depth;
+    }
+    *pdepth = depth;
+    for (int k = 0; k < depth; k++) pidx[k] = idx[k];
+    return depth - first;
+}
+
+// Lay out a file whose block pointers are all zero: reserve its data blocks
+// plus the indirect blocks that map them, build the indirect tables in memory
+// and write data in one request per contiguous run. Blocks that are all zero
+// are left as holes. Indirect blocks are placed inline, right before the data
+// they map, as Linux ext2 does. Allocation starts at goal and spills into
+// later groups only when the goal's group is full. The blocks taken are
+// added to in->i_blocks.
+static int ext2_write_file_blocks(ext2_mount_ctx_t *m, ext2_inode_t *in, uint32_t goal, const uint8_t *src, size_t size, uint32_t nblk) {
+    if (nblk == 0) return 0;
+
+    uint32_t bs = m->block_size;
+    uint32_t ppb = bs / 4;
+    uint32_t idx[3], pidx[3];
+    int depth, pdepth = -1;
+
+    // Count the data blocks and the tables that map them.
+    uint32_t ndata = 0, nmeta = 0;
+    for (uint32_t lbn = 0; lbn < nblk; lbn++) {
+        if (ext2_block_is_zero(src, size, bs, lbn)) continue;
+        ndata++;
+        depth = ext2_lbn_path(ppb, lbn, idx);
+        nmeta += (uint32_t)ext2_lbn_new_tables(depth, idx, &pdepth, pidx);
+    }
+    if (ndata == 0) return 0;
+
+    // The tables on the path of the current block, from the top down.
+    uint32_t *tbl[3] = { NULL, NULL, NULL };
+    uint32_t tblk[3] = { 0, 0, 0 };
+    int rc = 0;
+    if (nmeta) {
+        for (int k = 0; k < 3; k++) {
+            tbl[k] = (uint32_t*)g_api->kmalloc(bs);
+            if (!tbl[k]) rc = -1;
+        }
+    }
+
+    ext2_wcursor_t cur;
+    cur.next = goal;
+    cur.left = 0;
+    cur.need = ndata + nmeta;
+
+    uint32_t run_pblk = 0, run_n = 0, run_lbn = 0;
+    pdepth = -1;
+
+    for (uint32_t lbn = 0; lbn < nblk && rc == 0; lbn++) {
+        if (ext2_block_is_zero(src, size, bs, lbn)) {
+            if (run_n) {
+                size_t off = (size_t)run_lbn * bs;
+                if (ext2_write_data_blocks(m, run_pblk, run_n, src + off, size - off) != 0) rc = -4;
+                run_n = 0;
+            }
+            continue;
+        }
+
+        // Finish the tables this block leaves behind and start its own,
+        // each taken right before what it maps.
+        int old_depth = pdepth;
+        depth = ext2_lbn_path(ppb, lbn, idx);
+        int fresh = ext2_lbn_new_tables(depth, idx, &pdepth, pidx);
+        int from = depth - fresh;
+        for (int k = old_depth != depth ? 0 : from; k < (old_depth > 0 ? old_depth : 0); k++) {
+            if (tblk[k] && ext2_write_block(m, tblk[k], tbl[k]) != 0) { rc = -3; break; }
+            tblk[k] = 0;
+        }
+        for (int k = from; k < depth && rc == 0; k++) {
+            uint32_t mblk = 0;
+            if (ext2_wcursor_take(m, &cur, &mblk) != 0) { rc = -2; break; }
+            m_memset(tbl[k], 0, bs);
+            tblk[k] = mblk;
+            if (k == 0) in->i_block[11 + depth] = mblk;
+            else tbl[k - 1][idx[k - 1]] = mblk;
+        }
+        if (rc != 0) break;
+
+        uint32_t pblk = 0;
+        if (ext2_wcursor_take(m, &cur, &pblk) != 0) { rc = -2; break; }
+        if (depth == 0) in->i_block[lbn] = pblk;
+        else tbl[depth - 1][idx[depth - 1]] = pblk;
+
+        if (run_n && pblk == run_pblk + run_n) {
+            run_n++;
+            continue;
+        }
+        if (run_n) {
+            size_t off = (size_t)run_lbn * bs;
+            if (ext2_write_data_blocks(m, run_pblk, run_n, src + off, size - off) != 0) rc = -4;
+        }
+        run_pblk = pblk;
+        run_n = 1;
+        run_lbn = lbn;
+    }
+
+    if (rc == 0 && run_n) {
+        size_t off = (size_t)run_lbn * bs;
+        if (ext2_write_data_blocks(m, run_pblk, run_n, src + off, size - off) != 0) rc = -4;
+    }
+    for (int k = 0; k < 3 && rc == 0; k++) {
+        if (tblk[k] && ext2_write_block(m, tblk[k], tbl[k]) != 0) rc = -5;
+    }
+
+    // i_blocks counts 512-byte sectors, indirect blocks included.
+    in->i_blocks += (ndata + nmeta - cur.need) * (bs / 512u);
+
+    for (int k = 0; k < 3; k++) {
+        if (tbl[k]) g_api->kfree(tbl[k]);
+    }
+    return rc;
+}
+
+// Give a buffered file its blocks and write the data out. The reservation
+// is handed back to the allocator first so the file can use it.
+static int ext2_da_flush_one(ext2_mount_ctx_t *m, ext2_icache_ent_t *e) {
+    uint32_t bs = m->block_size;
+    uint32_t nblk = (uint32_t)((e->da_len + bs - 1) / bs);
+
+    m->da_reserved -= e->da_res;
+    e->da_res = 0;
+    int rc = ext2_write_file_blocks(m, &e->inode, e->da_goal, e->da_buf, e->da_len, nblk);
+    ext2_bmap_reset(&e->map);
+    ext2_icache_mark_dirty(m, e);
+    ext2_da_release(m, e);
+    return rc;
+}
+
+static int ext2_da_flush(ext2_mount_ctx_t *m) {
+    if (!m->icache.ents || m->da_bytes == 0) return 0;
+    int rc = 0;
+    for (uint32_t i = 0; i < m->icache.nents; i++) {
+        ext2_icache_ent_t *e = &m->icache.ents[i];
+        if (e->da_buf && ext2_da_flush_one(m, e) != 0) rc = -1;
+    }
+    return rc;
+}
+
+// Change the length of a file whose contents are still buffered, keeping it
+// buffered: growing zero-fills, and the block reservation follows the length.
+static int ext2_da_resize(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, size_t len) {
+    if (len == 0) {
+        ext2_da_release(m, e);
+        ext2_set_isize(m, &e->inode, 0);
+        ext2_icache_mark_dirty(m, e);
+        return 0;
+    }
+
+    uint32_t bs = m->block_size;
+    uint32_t nblk = (uint32_t)((len + bs - 1) / bs);
+    uint32_t nres = nblk + ext2_meta_blocks_for(m, nblk);
+    if (nres > e->da_res && (uint64_t)m->da_reserved - e->da_res + nres > m->sb.s_free_blocks_count) return -1;
+
+    if (len > e->da_cap) {
+        size_t cap = e->da_cap * 2;
+        if (cap < len) cap = len;
+        if (cap > EXT2_DA_FILE_MAX) cap = EXT2_DA_FILE_MAX;
+        uint8_t *nb = (uint8_t*)g_api->kmalloc(cap);
+        if (!nb) return -2;
+        m_memcpy(nb, e->da_buf, e->da_len);
+        g_api->kfree(e->da_buf);
+        e->da_buf = nb;
+        e->da_cap = cap;
+    }
+    if (len > e->da_len) m_memset(e->da_buf + e->da_len, 0, len - e->da_len);
+
+    m->da_bytes = m->da_bytes - e->da_len + len;
+    m->da_reserved = m->da_reserved - e->da_res + nres;
+    e->da_len = len;
+    e->da_res = nres;
+    ext2_set_isize(m, &e->inode, len);
+    ext2_icache_mark_dirty(m, e);
+    return 0;
+}
+
+static int ext2_table_empty(const uint32_t *tbl, uint32_t ppb) {
+    for (uint32_t i = 0; i < ppb; i++) {
+        if (tbl[i]) return 0;
+    }
+    return 1;
+}
+
+// Free what the indirect block *slot maps inside [from, to), where the table
+// is level deep and maps logical blocks from base on. Subtrees wholly inside
+// the range are freed without being read; the table itself is freed (and
+// *slot cleared) once nothing is left in it.
+static int ext2_punch_table(ext2_mount_ctx_t *m, uint32_t *slot, int level, uint64_t base,
+                            uint64_t from, uint64_t to, ext2_freelist_t *fl) {
+    uint32_t ppb = m->block_size / 4;
+    uint64_t span = 1;
+    for (int i = 1; i < level; i++) span *= ppb;
+    if (from <= base && to >= base + span * ppb) {
+        (void)ext2_free_indirect_chain(m, *slot, level, fl);
+        *slot = 0;
+        return 0;
+    }
+
+    uint32_t *tbl = (uint32_t*)g_api->kmalloc(m->block_size);
+    if (!tbl) return -1;
+    int rc = ext2_read_block(m, *slot, tbl) == 0 ? 0 : -1;
+    uint32_t i0 = from > base ? (uint32_t)((from - base) / span) : 0;
+    for (uint32_t i = i0; rc == 0 && i < ppb; i++) {
+        uint64_t start = base + (uint64_t)i * span;
+        if (start >= to) break;
+        if (!tbl[i]) continue;
+        if (level == 1) {
+            ext2_freelist_add(m, fl, tbl[i]);
+            tbl[i] = 0;
+        } else {
+            rc = ext2_punch_table(m, &tbl[i], level - 1, start, from, to, fl);
+        }
+    }
+    if (rc == 0) {
+        if (ext2_table_empty(tbl, ppb)) {
+            ext2_freelist_add(m, fl, *slot);
+            *slot = 0;
+        } else if (ext2_write_block(m, *slot, tbl) != 0) {
+            rc = -2;
+        }
+    }
+    g_api->kfree(tbl);
+    return rc;
+}
+
+// Free every block that maps a logical block in [from, to) and clear the
+// pointers to it. Tables left empty are freed too; i_blocks is updated.
+// The blocks are queued on a free list and released in runs at the end.
+static int ext2_punch_blocks(ext2_mount_ctx_t *m, ext2_inode_t *in, uint32_t from, uint32_t to) {
+    if (in->i_flags & EXT4_EXTENTS_FL) return -3; // extent trees are read-only
+    if (from >= to) return 0;
+    uint32_t bs = m->block_size;
+    uint64_t ppb = bs / 4;
+    ext2_freelist_t fl;
+    fl.n = 0;
+    fl.freed = 0;
+    int rc = 0;
+
+    for (uint32_t i = from; i < 12 && i < to; i++) {
+        ext2_freelist_add(m, &fl, in->i_block[i]);
+        in->i_block[i] = 0;
+    }
+
+    // Single, double and triple indirect trees in turn.
+    uint64_t base = 12, span = ppb;
+    for (int level = 1; level <= 3 && rc == 0; level++) {
+        uint32_t slot = in->i_block[11 + level]; // i_block is a packed member
+        if (slot && from < base + span && to > base) {
+            rc = ext2_punch_table(m, &slot, level, base, from, to, &fl);
+            in->i_block[11 + level] = slot;
+        }
+        base += span;
+        span *= ppb;
+    }
+
+    ext2_freelist_flush(m, &fl);
+    uint32_t sectors = fl.freed * (bs / 512u);
+    in->i_blocks = in->i_blocks > sectors ? in->i_blocks - sectors : 0;
+    return rc;
+}
+
+// Free every block that maps logical block keep or later.
+static int ext2_truncate_blocks(ext2_mount_ctx_t *m, ext2_inode_t *in, uint32_t keep) {
+    return ext2_punch_blocks(m, in, keep, 0xFFFFFFFFu);
+}
+
+// Zero len bytes at from within logical block lbn of the file cached in e.
+// A hole is left alone: it already reads back as zero.
+static int ext2_file_zero_partial(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, uint32_t lbn, uint32_t from, uint32_t len) {
+    uint32_t bs = m->block_size;
+    uint32_t pblk = ext2_get_block_ptr(m, &e->inode, &e->map, lbn);
+    if (!pblk || len == 0) return 0;
+    uint8_t *data = m->bcache.ents ? ext2_bcache_get(m, pblk, 1) : NULL;
+    if (data) {
+        m_memset(data + from, 0, len);
+        ext2_bcache_mark_data(m, pblk);
+        return 0;
+    }
+    uint8_t *tmp = (uint8_t*)g_api->kmalloc(bs);
+    if (!tmp) return -1;
+    int rc = ext2_read_block(m, pblk, tmp);
+    if (rc == 0) {
+        m_memset(tmp + from, 0, len);
+        rc = ext2_write_block(m, pblk, tmp);
+    }
+    g_api->kfree(tmp);
+    return rc == 0 ? 0 : -2;
+}
+
+// Set the size of the file cached in e. Shrinking frees the blocks past the
+// new end and zeroes the rest of the last block, so growing the file again
+// later reads zeroes; growing only moves i_size (the new range is a hole).
+static int ext2_file_set_size(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, uint64_t size) {
+    if (size > ext2_max_size(m)) return -1;
+    if (e->da_buf) {
+        if (size <= EXT2_DA_FILE_MAX) return ext2_da_resize(m, e, (size_t)size) == 0 ? 0 : -2;
+        if (ext2_da_flush_one(m, e) != 0) return -2;
+    }
+
+    ext2_inode_t *in = &e->inode;
+    uint32_t bs = m->block_size;
+    if (size < ext2_isize(in)) {
+        uint32_t keep = (uint32_t)((size + bs - 1) / bs);
+        ext2_bmap_reset(&e->map);
+        int rc = ext2_truncate_blocks(m, in, keep);
+        ext2_bmap_reset(&e->map);
+        if (rc != 0) { ext2_icache_mark_dirty(m, e); return -3; }
+
+        uint32_t tail = (uint32_t)(size % bs);
+        if (tail && ext2_file_zero_partial(m, e, keep - 1, tail, bs - tail) != 0) return -4;
+    }
+    ext2_set_isize(m, in, size);
+    ext2_icache_mark_dirty(m, e);
+    return 0;
+}
+
+// Write size bytes at off into the file cached in e. Mapped blocks are
+// overwritten in place, holes and the part past the end get new blocks.
+// Whole blocks go straight to the device, one request per physically
+// contiguous run; partial blocks are merged in the block cache.
+static int ext2_file_write_range(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, uint64_t off, const uint8_t *src, size_t size) {
+    if (size == 0) return 0;
+    uint32_t bs = m->block_size;
+    uint64_t end = off + size;
+    if (end > ext2_max_size(m)) return -1;
+    uint32_t last = (uint32_t)((end - 1) / bs);
+    uint32_t meta = ext2_meta_blocks_for(m, last + 1);
+    if (meta == 0xFFFFFFFFu) return -1;
+
+    // Buffered files stay buffered while they are small enough.
+    if (e->da_buf) {
+        if (end <= EXT2_DA_FILE_MAX) {
+            size_t len = end > e->da_len ? (size_t)end : e->da_len;
+            if (ext2_da_resize(m, e, len) != 0) return -2;
+            m_memcpy(e->da_buf + off, src, size);
+            return 0;
+        }
+        if (ext2_da_flush_one(m, e) != 0) return -3;
+    }
 
-    uint32_t blocks = (dir.i_size + bs - 1) / bs;
-    for (uint32_t lbn = 0; lbn < blocks; lbn++) {
-        uint32_t pblk = ext2_get_block_ptr(m, &dir, lbn);
-        if (!pblk) continue;
-        if (ext2_read_block(m, pblk, blk) != 0) continue;
+    ext2_inode_t *in = &e->inode;
+    ext2_bmap_t *map = &e->map;
+    uint32_t max_run = EXT2_MAX_IO_BYTES / bs;
+    if (max_run == 0) max_run = 1;
+
+    // Only holes need new blocks (plus, at worst, every table).
+    uint32_t first = (uint32_t)(off / bs);
+    uint32_t holes = 0;
+    for (uint32_t lbn = first; lbn <= last;) {
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, in, map, lbn, last - lbn + 1, &pblk);
+        if (!pblk) holes += n;
+        lbn += n;
+    }
+    if (holes && (uint64_t)holes + meta + m->da_reserved > m->sb.s_free_blocks_count) return -2;
+
+    uint32_t goal = 0;
+    uint64_t pos = off;
+    size_t inpos = 0;
+    int rc = 0;
+    while (pos < end && rc == 0) {
+        uint32_t lbn = (uint32_t)(pos / bs);
+        uint32_t in_blk = (uint32_t)(pos % bs);
+        if (!goal) {
+            uint32_t prev = lbn ? ext2_get_block_ptr(m, in, map, lbn - 1) : 0;
+            goal = prev ? prev + 1 : ext2_inode_goal(m, e->ino);
+        }
 
-        uint32_t off = 0;
-        while (off + sizeof(ext2_dirent_t) <= bs) {
-            ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
-            if (de->rec_len == 0) break;
-            if (ext2_dirent_match(de, name, nlen)) {
-                de->inode = 0;
-                int rc = ext2_write_block(m, pblk, blk);
-                g_api->kfree(blk);
-                return rc;
+        if (in_blk != 0 || end - pos < bs) {
+            size_t csz = bs - in_blk;
+            if (csz > end - pos) csz = (size_t)(end - pos);
+            uint32_t pblk = ext2_get_block_ptr(m, in, map, lbn);
+            int fresh = 0;
+            if (!pblk && ext2_is_zero(src + inpos, csz)) {
+                // Zeroes over a hole: the hole already reads back as zero.
+                pos += csz;
+                inpos += csz;
+                continue;
             }
-            off += de->rec_len;
-            if (off >= bs) break;
+            if (!pblk) {
+                if (ext2_alloc_block(m, goal, &pblk) != 0) { rc = -4; break; }
+                if (ext2_set_block_ptr(m, in, map, lbn, pblk) != 0) {
+                    (void)ext2_free_block(m, pblk);
+                    rc = -5;
+                    break;
+                }
+                in->i_blocks += bs / 512u;
+                fresh = 1;
+            }
+            uint8_t *tmp = NULL;
+            uint8_t *data = m->bcache.ents ? ext2_bcache_get(m, pblk, !fresh) : NULL;
+            if (!data) {
+                tmp = (uint8_t*)g_api->kmalloc(bs);
+                if (!tmp) { rc = -6; break; }
+                if (!fresh && ext2_read_block(m, pblk, tmp) != 0) { g_api->kfree(tmp); rc = -7; break; }
+                data = tmp;
+            }
+            if (fresh) m_memset(data, 0, bs);
+            m_memcpy(data + in_blk, src + inpos, csz);
+            if (tmp) {
+                if (ext2_write_block(m, pblk, tmp) != 0) rc = -8;
+                g_api->kfree(tmp);
+            } else {
+                ext2_bcache_mark_data(m, pblk);
+            }
+            goal = pblk + 1;
+            pos += csz;
+            inpos += csz;
+            continue;
         }
+
+        // Aligned middle: a run of mapped blocks is written where it is,
+        // a run of holes gets one contiguous allocation. Zero blocks that
+        // land on holes stay holes.
+        uint32_t want = (uint32_t)((end - pos) / bs);
+        if (want > max_run) want = max_run;
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, in, map, lbn, want, &pblk);
+        if (pblk == 0) {
+            uint32_t z = 0;
+            while (z < n && ext2_is_zero(src + inpos + (size_t)z * bs, bs)) z++;
+            if (z) {
+                pos += (uint64_t)z * bs;
+                inpos += (size_t)z * bs;
+                continue;
+            }
+            while (z < n && !ext2_is_zero(src + inpos + (size_t)z * bs, bs)) z++;
+            n = z;
+            uint32_t got = 0;
+            if (ext2_alloc_run(m, goal, n, &pblk, &got) != 0) { rc = -4; break; }
+            for (uint32_t k = 0; k < got; k++) {
+                if (ext2_set_block_ptr(m, in, map, lbn + k, pblk + k) != 0) {
+                    (void)ext2_free_run(m, pblk + k, got - k);
+                    got = k;
+                    rc = -5;
+                    break;
+                }
+                in->i_blocks += bs / 512u;
+            }
+            n = got;
+            if (n == 0) break;
+        }
+        if (ext2_write_data_blocks(m, pblk, n, src + inpos, (size_t)n * bs) != 0) { rc = -9; break; }
+        goal = pblk + n;
+        pos += (uint64_t)n * bs;
+        inpos += (size_t)n * bs;
     }
 
-    g_api->kfree(blk);
-    return -7;
+    if (pos > ext2_isize(in)) ext2_set_isize(m, in, pos);
+    ext2_icache_mark_dirty(m, e);
+    return rc;
 }
 
-static int ext2_split_parent(const char *path, char *parent, size_t parent_sz, const char **out_name) {
-    if (!path || !parent || parent_sz == 0 || !out_name) return -1;
-    *out_name = NULL;
-    parent[0] = 0;
-
-    if (path[0] != '/') return -2;
+// Free the blocks under [off, off + len) of the file cached in e, keeping
+// its size. Partial blocks at either end are zeroed in place; a range that
+// runs to the end of the file frees the last block too.
+static int ext2_file_punch(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, uint64_t off, uint64_t len) {
+    ext2_inode_t *in = &e->inode;
+    uint64_t isize = ext2_isize(in);
+    if (len == 0 || off >= isize) return 0;
+    uint64_t end = off + len;
+    if (end > isize || end < off) end = isize;
+
+    // Still buffered: the zeroes become holes when the buffer is flushed.
+    if (e->da_buf) {
+        m_memset(e->da_buf + off, 0, (size_t)(end - off));
+        return 0;
+    }
 
-    // strip trailing slashes
-    size_t len = m_strlen(path);
-    while (len > 1 && path[len - 1] == '/') len--;
+    uint32_t bs = m->block_size;
+    uint32_t first = (uint32_t)((off + bs - 1) / bs);
+    uint32_t stop = end == isize ? (uint32_t)((end + bs - 1) / bs) : (uint32_t)(end / bs);
+    uint32_t head = (uint32_t)(off % bs);
+    if (head) {
+        uint64_t n = bs - head;
+        if (n > end - off) n = end - off;
+        if (ext2_file_zero_partial(m, e, (uint32_t)(off / bs), head, (uint32_t)n) != 0) return -1;
+    }
+    if (end % bs && end != isize && end / bs >= first) {
+        if (ext2_file_zero_partial(m, e, (uint32_t)(end / bs), 0, (uint32_t)(end % bs)) != 0) return -1;
+    }
+    if (first >= stop) return 0;
 
-    // find last slash
-    size_t last = 0;
-    for (size_t i = 0; i < len; i++) if (path[i] == '/') last = i;
+    ext2_bmap_reset(&e->map);
+    int rc = ext2_punch_blocks(m, in, first, stop);
+    ext2_bmap_reset(&e->map);
+    ext2_icache_mark_dirty(m, e);
+    return rc == 0 ? 0 : -2;
+}
 
-    if (last == 0) {
-        // parent is root
-        m_strncpy(parent, "/", parent_sz);
-        *out_name = path + 1;
-        return 0;
+// Give every hole in [off, off + len) of the file cached in e a block of
+// its own. ext2 has no unwritten extents, so the new blocks are written with
+// zeroes. The size grows to cover the range unless keep_size is set; then
+// the range stops at the end of the file, since e2fsck rejects blocks past
+// i_size on an ext2 inode.
+static int ext2_file_alloc_range(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, uint64_t off, uint64_t len, int keep_size) {
+    uint32_t bs = m->block_size;
+    uint64_t end = off + len;
+    if (end < off) return -1;
+    if (keep_size && end > ext2_isize(&e->inode)) end = ext2_isize(&e->inode);
+    if (end <= off) return 0;
+    if (end > ext2_max_size(m)) return -1;
+    uint32_t last = (uint32_t)((end - 1) / bs);
+    uint32_t meta = ext2_meta_blocks_for(m, last + 1);
+    if (meta == 0xFFFFFFFFu) return -1;
+    if (e->da_buf && ext2_da_flush_one(m, e) != 0) return -3;
+
+    ext2_inode_t *in = &e->inode;
+    ext2_bmap_t *map = &e->map;
+    uint32_t max_run = EXT2_MAX_IO_BYTES / bs;
+    if (max_run == 0) max_run = 1;
+
+    uint32_t first = (uint32_t)(off / bs);
+    uint32_t holes = 0;
+    for (uint32_t lbn = first; lbn <= last;) {
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, in, map, lbn, last - lbn + 1, &pblk);
+        if (!pblk) holes += n;
+        lbn += n;
     }
+    if (holes && (uint64_t)holes + meta + m->da_reserved > m->sb.s_free_blocks_count) return -2;
+
+    uint8_t *zero = NULL;
+    uint32_t goal = 0;
+    int rc = 0;
+    for (uint32_t lbn = first; holes && lbn <= last && rc == 0;) {
+        uint32_t want = last - lbn + 1;
+        if (want > max_run) want = max_run;
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, in, map, lbn, want, &pblk);
+        if (pblk) {
+            goal = pblk + n;
+            lbn += n;
+            continue;
+        }
+        if (!goal) {
+            uint32_t prev = lbn ? ext2_get_block_ptr(m, in, map, lbn - 1) : 0;
+            goal = prev ? prev + 1 : ext2_inode_goal(m, e->ino);
+        }
+        if (!zero) {
+            zero = (uint8_t*)g_api->kmalloc((size_t)max_run * bs);
+            if (!zero) { rc = -4; break; }
+            m_memset(zero, 0, (size_t)max_run * bs);
+        }
+        uint32_t got = 0;
+        if (ext2_alloc_run(m, goal, n, &pblk, &got) != 0) { rc = -5; break; }
+        for (uint32_t k = 0; k < got; k++) {
+            if (ext2_set_block_ptr(m, in, map, lbn + k, pblk + k) != 0) {
+                (void)ext2_free_run(m, pblk + k, got - k);
+                got = k;
+                rc = -6;
+                break;
+            }
+            in->i_blocks += bs / 512u;
+        }
+        if (got && ext2_write_data_blocks(m, pblk, got, zero, (size_t)got * bs) != 0) rc = -7;
+        goal = pblk + got;
+        lbn += got;
+        if (got == 0) break;
+    }
+    if (zero) g_api->kfree(zero);
 
-    // copy parent substring
-    size_t plen = last;
-    if (plen >= parent_sz) plen = parent_sz - 1;
-    for (size_t i = 0; i < plen; i++) parent[i] = path[i];
-    parent[plen] = 0;
-
-    *out_name = path + last + 1;
-    return 0;
+    if (rc == 0 && !keep_size && end > ext2_isize(in)) ext2_set_isize(m, in, end);
+    ext2_icache_mark_dirty(m, e);
+    return rc;
 }
 
-static int ext2_mkdir(fs_mount_t *mount, const char *path) {
+static int ext2_do_write_file(fs_mount_t *mount, const char *path, const void *buffer, size_t size) {
     ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
     if (!m || !g_api || !g_api->block_write) return -1;
-    if (!path || path[0] != '/') return -2;
 
-    // Already exists?
-    uint32_t existing = 0;
-    if (ext2_resolve_path(m, path, &existing, 0) == 0) return -3;
+    if (!ext2_writable(m)) return -2;
 
+    if (!path || path[0] != '/') return -3;
+    if ((uint64_t)size > ext2_max_size(m)) return -13;
+    if (ext2_meta_blocks_for(m, (uint32_t)((size + m->block_size - 1) / m->block_size)) == 0xFFFFFFFFu) return -13;
+
+    // Split parent + leaf
     char parent_path[512];
     const char *name = NULL;
     if (ext2_split_parent(path, parent_path, sizeof(parent_path), &name) != 0) return -4;
     if (!name || !*name) return -5;
 
-    uint32_t parent_ino = 0;
-    if (ext2_resolve_path(m, parent_path, &parent_ino, 0) != 0) return -6;
+    uint32_t parent_ino = 0, ino = 0;
+    if (ext2_resolve_leaf(m, parent_path, name, &parent_ino, &ino) != 0) return -6;
+    if (ino) {
+        // A symlink at the leaf writes through to its target.
+        ext2_inode_t lin;
+        if (ext2_read_inode(m, ino, &lin) != 0) return -9;
+        if ((lin.i_mode & 0xF000) == 0xA000 && ext2_resolve_path(m, path, &ino, 0) != 0) ino = 0;
+    }
+    int exists = (ino != 0);
 
     ext2_inode_t pin;
     if (ext2_read_inode(m, parent_ino, &pin) != 0) return -7;
     if ((pin.i_mode & 0xF000) != 0x4000) return -8;
 
-    uint32_t ino = 0;
-    if (ext2_alloc_inode0(m, &ino) != 0) return -9;
+    ext2_inode_t in;
+    ext2_bmap_t *map = NULL;
+    uint32_t goal = 0;
+    if (exists) {
+        if (ext2_read_inode(m, ino, &in) != 0) return -9;
+        if ((in.i_mode & 0xF000) != 0x8000) return -10;
 
-    uint32_t blkno = 0;
-    if (ext2_alloc_block0(m, &blkno) != 0) return -10;
+        // A file that already has blocks is overwritten in place: they keep
+        // their position on disk and only the difference in size is
+        // allocated or freed.
+        if (in.i_blocks && m->icache.ents) {
+            ext2_icache_ent_t *ie = ext2_iget(m, ino);
+            if (!ie) return -9;
+            int rc = 0;
+            if (size < ext2_isize(&in)) rc = ext2_file_set_size(m, ie, size);
+            if (rc == 0) rc = ext2_file_write_range(m, ie, 0, (const uint8_t*)buffer, size);
+            ext2_iput(m, ie);
+            return rc == 0 ? 0 : -15;
+        }
 
-    // Add entry into parent directory
-    if (ext2_dir_add_entry(m, parent_ino, name, ino, 2) != 0) return -11;
+        // Full overwrite semantics: free existing blocks (direct + indirect) and reset pointers.
+        // The new data goes back where the old data started.
+        goal = in.i_block[0];
+        map = ext2_bmap_for(m, ino);
+        ext2_bmap_reset(map);
+        (void)ext2_truncate_blocks(m, &in, 0);
 
-    // Create inode
-    ext2_inode_t din;
-    m_memset(&din, 0, sizeof(din));
-    din.i_mode = (uint16_t)(0x4000 | 0755);
-    din.i_size = m->block_size;
-    din.i_links_count = 2; // '.' and parent link
-    din.i_blocks = (m->block_size / 512u);
-    din.i_block[0] = blkno;
+        ext2_set_isize(m, &in, 0);
+        in.i_blocks = 0;
+    } else {
+        if (ext2_alloc_inode(m, parent_ino, 0, &ino) != 0) return -11;
+        m_memset(&in, 0, sizeof(in));
+        in.i_mode = (uint16_t)(0x8000 | 0644);
+        in.i_links_count = 1;
+        in.i_size = 0;
 
-    if (ext2_write_inode(m, ino, &din) != 0) return -12;
+        // Insert into parent directory
+        if (ext2_dir_add_entry(m, parent_ino, name, ino, 1) != 0) return -12;
+        map = ext2_bmap_for(m, ino);
+        ext2_bmap_reset(map);
+    }
 
-    // Write directory block with '.' and '..'
     uint32_t bs = m->block_size;
-    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
-    if (!blk) return -13;
-    m_memset(blk, 0, bs);
+    uint32_t nblk = (uint32_t)((size + bs - 1) / bs);
+    uint32_t nmeta = ext2_meta_blocks_for(m, nblk);
+
+    // The cache entry carries any buffered contents; its own reservation is
+    // about to be replaced, everyone else's stays off limits.
+    ext2_icache_ent_t *e = NULL;
+    uint32_t held = m->da_reserved;
+    if (m->icache.ents) {
+        if (ext2_write_inode(m, ino, &in) != 0) return -17;
+        e = ext2_icache_lookup(m, ino, 1);
+        if (e) held -= e->da_res;
+    }
+    if (nblk + nmeta + held > m->sb.s_free_blocks_count) return -14;
 
-    ext2_dirent_t *de1 = (ext2_dirent_t*)blk;
-    de1->inode = ino;
-    de1->name_len = 1;
-    de1->file_type = 2;
-    de1->rec_len = 12;
-    ((char*)blk)[8] = '.';
+    if (!goal) goal = (e && e->da_buf) ? e->da_goal : ext2_inode_goal(m, ino);
 
-    ext2_dirent_t *de2 = (ext2_dirent_t*)(blk + de1->rec_len);
-    de2->inode = parent_ino;
-    de2->name_len = 2;
-    de2->file_type = 2;
-    de2->rec_len = (uint16_t)(bs - de1->rec_len);
-    ((char*)blk)[de1->rec_len + 8] = '.';
-    ((char*)blk)[de1->rec_len + 9] = '.';
+    if (e && size > 0 && size <= EXT2_DA_FILE_MAX) {
+        // Delayed allocation: the inode gets its size now and its blocks
+        // when the buffer is flushed.
+        ext2_set_isize(m, &in, size);
+        in.i_blocks = 0;
+        if (ext2_write_inode(m, ino, &in) != 0) return -17;
+        if (ext2_da_stage(m, e, buffer, size, nblk + nmeta, goal) != 0) return -16;
+        return 0;
+    }
+    if (e) ext2_da_release(m, e);
 
-    if (ext2_write_block(m, blkno, blk) != 0) { g_api->kfree(blk); return -14; }
-    g_api->kfree(blk);
+    if (ext2_write_file_blocks(m, &in, goal, (const uint8_t*)buffer, size, nblk) != 0) return -15;
+    ext2_bmap_reset(map);
 
-    // Update parent link count (best-effort)
-    pin.i_links_count++;
-    (void)ext2_write_inode(m, parent_ino, &pin);
+    ext2_set_isize(m, &in, size);
+
+    if (ext2_write_inode(m, ino, &in) != 0) return -17;
 
     return 0;
 }
 
-static int ext2_free_indirect_chain(ext2_mount_ctx_t *m, uint32_t ind_blk, int level) {
-    if (!m || !g_api) return -1;
-    if (!ind_blk) return 0;
-    if (level < 1 || level > 2) return -2;
-
-    uint32_t bs = m->block_size;
-    uint32_t ppb = bs / 4;
-    uint32_t *tbl = (uint32_t*)g_api->kmalloc(bs);
-    if (!tbl) return -3;
-    if (ext2_read_block(m, ind_blk, tbl) != 0) { g_api->kfree(tbl); return -4; }
-
-    for (uint32_t i = 0; i < ppb; i++) {
-        uint32_t v = tbl[i];
-        if (!v) continue;
-        if (level == 1) {
-            (void)ext2_free_block0(m, v);
-        } else {
-            (void)ext2_free_indirect_chain(m, v, level - 1);
-        }
+// Mutating entry points batch their metadata updates in the block cache and
+// push them to disk once the operation is complete. With a journal the
+// operation joins the running transaction, which commits as a group.
+static int ext2_commit(fs_mount_t *mount, int rc) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    if (!m) return rc;
+    int frc = ext2_da_flush(m);
+    if (m->journal.active) {
+        if (ext2_journal_due(m) && ext2_journal_flush(m) != 0) frc = -1;
+    } else {
+        if (ext2_icache_flush(m) != 0) frc = -1;
+        if (ext2_flush_bitmaps(m) != 0) frc = -1;
+        if (ext2_flush_meta(m) != 0) frc = -1;
+        if (ext2_bcache_flush(m) != 0) frc = -1;
     }
+    if (rc == 0 && frc != 0) return -100;
+    return rc;
+}
 
-    g_api->kfree(tbl);
-    (void)ext2_free_block0(m, ind_blk);
+// File writes are write-back: their data and metadata stay in memory until
+// ext2_sync(), the next committing operation, or until too much is buffered.
+// The file count limit keeps buffered entries from pinning the whole inode
+// cache.
+static int ext2_write_back(fs_mount_t *mount, int rc) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    if (rc != 0 || !m || m->da_bytes > EXT2_DA_MAX_BYTES || m->da_files >= EXT2_DA_MAX_FILES) {
+        return ext2_commit(mount, rc);
+    }
     return 0;
 }
 
-static int ext2_unlink(fs_mount_t *mount, const char *path) {
+static int ext2_write_file(fs_mount_t *mount, const char *path, const void *buffer, size_t size) {
+    return ext2_write_back(mount, ext2_do_write_file(mount, path, buffer, size));
+}
+
+// Write into an existing file without replacing it; only the written range
+// (and any growth) is touched. A missing file is created.
+static int ext2_do_write_file_at(fs_mount_t *mount, const char *path, const void *buffer, size_t size, uint64_t offset) {
     ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
     if (!m || !g_api || !g_api->block_write) return -1;
-    if (!path || path[0] != '/') return -2;
-
-    // refuse root
-    if (path[0] == '/' && path[1] == 0) return -3;
-
-    char parent_path[512];
-    const char *name = NULL;
-    if (ext2_split_parent(path, parent_path, sizeof(parent_path), &name) != 0) return -4;
-    if (!name || !*name) return -5;
-
-    uint32_t parent_ino = 0;
-    if (ext2_resolve_path(m, parent_path, &parent_ino, 0) != 0) return -6;
-
-    uint32_t ino = 0;
-    if (ext2_resolve_path(m, path, &ino, 0) != 0) return -7;
-
-    ext2_inode_t pin;
-    if (ext2_read_inode(m, parent_ino, &pin) != 0) return -8;
-    if ((pin.i_mode & 0xF000) != 0x4000) return -9;
-
-    ext2_inode_t in;
-    if (ext2_read_inode(m, ino, &in) != 0) return -10;
-
-    // Only regular files for now
-    if ((in.i_mode & 0xF000) == 0x4000) return -11; // directory
-
-    // Remove entry from parent directory
-    if (ext2_dir_remove_entry(m, parent_ino, name) != 0) return -12;
+    if (!ext2_writable(m) || !m->icache.ents) return -2;
+    if (!path || path[0] != '/') return -3;
 
-    // Free data blocks (direct)
-    for (int i = 0; i < 12; i++) {
-        if (in.i_block[i]) (void)ext2_free_block0(m, in.i_block[i]);
+    uint32_t ino;
+    if (ext2_resolve_path(m, path, &ino, 0) != 0) {
+        if (offset == 0 || offset == FS_WRITE_APPEND) return ext2_do_write_file(mount, path, buffer, size);
+        int rc = ext2_do_write_file(mount, path, "", 0);
+        if (rc != 0) return rc;
+        if (ext2_resolve_path(m, path, &ino, 0) != 0) return -6;
     }
 
-    // Free single-indirect and double-indirect blocks
-    if (in.i_block[12]) (void)ext2_free_indirect_chain(m, in.i_block[12], 1);
-    if (in.i_block[13]) (void)ext2_free_indirect_chain(m, in.i_block[13], 2);
-
-    // Clear inode and free inode bitmap
-    ext2_inode_t z;
-    m_memset(&z, 0, sizeof(z));
-    (void)ext2_write_inode(m, ino, &z);
-    (void)ext2_free_inode0(m, ino);
+    ext2_icache_ent_t *ie = ext2_iget(m, ino);
+    if (!ie) return -9;
+    int rc = -10;
+    if ((ie->inode.i_mode & 0xF000) == 0x8000) {
+        uint64_t off = (offset == FS_WRITE_APPEND) ? ext2_isize(&ie->inode) : offset;
+        rc = ext2_file_write_range(m, ie, off, (const uint8_t*)buffer, size) == 0 ? 0 : -15;
+    }
+    ext2_iput(m, ie);
+    return rc;
+}
 
-    return 0;
+static int ext2_write_file_at(fs_mount_t *mount, const char *path, const void *buffer, size_t size, uint64_t offset) {
+    return ext2_write_back(mount, ext2_do_write_file_at(mount, path, buffer, size, offset));
 }
 
-static int ext2_rmdir(fs_mount_t *mount, const char *path) {
+static int ext2_sync(fs_mount_t *mount) {
+    if (!mount) return -1;
     ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
-    if (!m || !g_api || !g_api->block_write) return -1;
-    if (!path || path[0] != '/') return -2;
-
-    // refuse root
-    if (path[0] == '/' && path[1] == 0) return -3;
-
-    char parent_path[512];
-    const char *name = NULL;
-    if (ext2_split_parent(path, parent_path, sizeof(parent_path), &name) != 0) return -4;
-    if (!name || !*name) return -5;
+    int rc = ext2_commit(mount, 0);
+    if (rc == 0 && m && m->journal.active && ext2_journal_flush(m) != 0) rc = -100;
+    return rc;
+}
 
-    uint32_t parent_ino = 0;
-    if (ext2_resolve_path(m, parent_path, &parent_ino, 0) != 0) return -6;
+static int ext2_mkdir(fs_mount_t *mount, const char *path) {
+    return ext2_commit(mount, ext2_do_mkdir(mount, path));
+}
 
-    uint32_t ino = 0;
-    if (ext2_resolve_path(m, path, &ino, 0) != 0) return -7;
+static int ext2_rmdir(fs_mount_t *mount, const char *path) {
+    return ext2_commit(mount, ext2_do_rmdir(mount, path));
+}
 
-    ext2_inode_t pin;
-    if (ext2_read_inode(m, parent_ino, &pin) != 0) return -8;
-    if ((pin.i_mode & 0xF000) != 0x4000) return -9;
+static int ext2_unlink(fs_mount_t *mount, const char *path) {
+    return ext2_commit(mount, ext2_do_unlink(mount, path));
+}
 
-    ext2_inode_t din;
-    if (ext2_read_inode(m, ino, &din) != 0) return -10;
-    if ((din.i_mode & 0xF000) != 0x4000) return -11;
+// --- defragmentation ---
 
-    uint32_t bs = m->block_size;
+// Blocks reserved for a relocated file, handed out in order.
+typedef struct {
+    uint32_t start[EXT2_DEFRAG_MAX_RUNS];
+    uint32_t len[EXT2_DEFRAG_MAX_RUNS];
+    uint32_t n;
+    uint32_t cur;  // run being handed out
+    uint32_t used; // blocks of it already taken
+} ext2_defrag_runs_t;
+
+// Extend the walk over a file's blocks in layout order by n blocks starting
+// at blk, counting a break whenever they do not follow the previous ones.
+static int ext2_defrag_step(uint32_t *prev, int32_t *breaks, uint32_t blk, uint32_t n) {
+    if (!blk) return -1;
+    if (*prev && blk != *prev + 1) (*breaks)++;
+    *prev = blk + n - 1;
+    return 0;
+}
 
-    // Ensure empty across all blocks (only '.' and '..')
-    uint8_t *blk = (uint8_t*)g_api->kmalloc(bs);
-    if (!blk) return -12;
+// Number of places where the blocks of a file do not follow each other on
+// disk, walked in the order ext2_write_file_blocks() lays them out (each
+// indirect table right before the data it maps). -1 when the file has holes
+// or a table cannot be read; such files are left alone.
+static int32_t ext2_defrag_breaks(ext2_mount_ctx_t *m, const ext2_inode_t *in, ext2_bmap_t *map, uint32_t nblk) {
+    uint32_t ppb = m->block_size / 4;
+    uint32_t prev = 0;
+    int32_t breaks = 0;
+    uint32_t lbn = 0;
+    while (lbn < nblk) {
+        uint32_t limit;
+        if (lbn == 12 && ext2_defrag_step(&prev, &breaks, in->i_block[12], 1) != 0) return -1;
+        if (lbn >= 12 + ppb) {
+            uint32_t k = (lbn - 12 - ppb) / ppb;
+            if ((lbn - 12 - ppb) % ppb == 0) {
+                if (k == 0 && ext2_defrag_step(&prev, &breaks, in->i_block[13], 1) != 0) return -1;
+                uint32_t *t1 = ext2_bmap_table(m, &map->dind_blk, &map->dind, in->i_block[13]);
+                if (!t1 || ext2_defrag_step(&prev, &breaks, t1[k], 1) != 0) return -1;
+            }
+            limit = 12 + ppb + (k + 1) * ppb;
+        } else {
+            limit = lbn < 12 ? 12 : 12 + ppb;
+        }
+        if (limit > nblk) limit = nblk;
 
-    uint32_t blocks = (din.i_size + bs - 1) / bs;
-    int ok_empty = 1;
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, in, map, lbn, limit - lbn, &pblk);
+        if (ext2_defrag_step(&prev, &breaks, pblk, n) != 0) return -1;
+        lbn += n;
+    }
+    return breaks;
+}
 
-    for (uint32_t lbn = 0; lbn < blocks; lbn++) {
-        uint32_t pblk = ext2_get_block_ptr(m, &din, lbn);
-        if (!pblk) continue;
-        if (ext2_read_block(m, pblk, blk) != 0) continue;
+static void ext2_defrag_release(ext2_mount_ctx_t *m, ext2_defrag_runs_t *r) {
+    for (uint32_t i = 0; i < r->n; i++) (void)ext2_free_run(m, r->start[i], r->len[i]);
+    r->n = 0;
+}
 
-        uint32_t off = 0;
-        while (off + sizeof(ext2_dirent_t) <= bs) {
-            ext2_dirent_t *de = (ext2_dirent_t*)(blk + off);
-            if (de->rec_len == 0) break;
-            if (de->inode != 0 && de->name_len > 0) {
-                if (!(de->name_len == 1 && de->name[0] == '.') && !(de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.')) {
-                    ok_empty = 0;
-                    break;
-                }
-            }
-            off += de->rec_len;
-            if (off >= bs) break;
+// Reserve total blocks in at most max_runs runs, or nothing at all.
+static int ext2_defrag_reserve(ext2_mount_ctx_t *m, uint32_t goal, uint32_t total, uint32_t max_runs, ext2_defrag_runs_t *r) {
+    r->n = 0;
+    r->cur = 0;
+    r->used = 0;
+    while (total) {
+        uint32_t start = 0, cnt = 0;
+        if (r->n == max_runs || ext2_alloc_run(m, goal, total, &start, &cnt) != 0) {
+            ext2_defrag_release(m, r);
+            return -1;
         }
-        if (!ok_empty) break;
+        r->start[r->n] = start;
+        r->len[r->n] = cnt;
+        r->n++;
+        total -= cnt;
+        goal = start + cnt;
     }
+    return 0;
+}
 
-    g_api->kfree(blk);
-    if (!ok_empty) return -13;
+// Up to want consecutive blocks from the reserved runs; returns how many.
+static uint32_t ext2_defrag_take(ext2_defrag_runs_t *r, uint32_t want, uint32_t *out) {
+    if (r->cur < r->n && r->used == r->len[r->cur]) {
+        r->cur++;
+        r->used = 0;
+    }
+    if (r->cur >= r->n) return 0;
+    uint32_t left = r->len[r->cur] - r->used;
+    if (want > left) want = left;
+    *out = r->start[r->cur] + r->used;
+    r->used += want;
+    return want;
+}
 
-    // Remove dirent from parent
-    if (ext2_dir_remove_entry(m, parent_ino, name) != 0) return -14;
+// Copy the nblk data blocks of in into the reserved runs, building the new
+// block pointers and indirect tables in nin with the same layout as
+// ext2_write_file_blocks(). Tables go through the block cache; data is
+// read and written in requests of up to EXT2_MAX_IO_BYTES.
+static int ext2_defrag_copy(ext2_mount_ctx_t *m, const ext2_inode_t *in, ext2_bmap_t *map,
+                            ext2_inode_t *nin, ext2_defrag_runs_t *r, uint32_t nblk) {
+    uint32_t bs = m->block_size;
+    uint32_t ppb = bs / 4;
+    uint32_t max_run = EXT2_MAX_IO_BYTES / bs;
+    if (max_run == 0) max_run = 1;
+
+    uint8_t *buf = (uint8_t*)g_api->kmalloc((size_t)max_run * bs);
+    uint32_t *ind = (uint32_t*)g_api->kmalloc(bs);
+    uint32_t *dind = (uint32_t*)g_api->kmalloc(bs);
+    uint32_t *l2 = (uint32_t*)g_api->kmalloc(bs);
+    int rc = 0;
+    if (!buf || !ind || !dind || !l2) { rc = -1; goto out; }
+    m_memset(ind, 0, bs);
+    m_memset(dind, 0, bs);
+
+    uint32_t l2_blk = 0;
+    uint32_t lbn = 0;
+    while (lbn < nblk) {
+        uint32_t limit, tblk = 0;
+        if (lbn == 12) {
+            if (ext2_defrag_take(r, 1, &tblk) != 1) { rc = -2; break; }
+            nin->i_block[12] = tblk; // i_block is a packed member
+        }
+        if (lbn >= 12 + ppb) {
+            uint32_t k = (lbn - 12 - ppb) / ppb;
+            if ((lbn - 12 - ppb) % ppb == 0) {
+                if (k == 0) {
+                    if (ext2_defrag_take(r, 1, &tblk) != 1) { rc = -2; break; }
+                    nin->i_block[13] = tblk;
+                }
+                if (l2_blk && ext2_write_block(m, l2_blk, l2) != 0) { rc = -3; break; }
+                if (ext2_defrag_take(r, 1, &l2_blk) != 1) { rc = -2; break; }
+                m_memset(l2, 0, bs);
+                dind[k] = l2_blk;
+            }
+            limit = 12 + ppb + (k + 1) * ppb;
+        } else {
+            limit = lbn < 12 ? 12 : 12 + ppb;
+        }
+        if (limit > nblk) limit = nblk;
+
+        uint32_t want = limit - lbn;
+        if (want > max_run) want = max_run;
+        uint32_t pblk = 0;
+        uint32_t n = ext2_defrag_take(r, want, &pblk);
+        if (n == 0) { rc = -2; break; }
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t l = lbn + i;
+            if (l < 12) nin->i_block[l] = pblk + i;
+            else if (l < 12 + ppb) ind[l - 12] = pblk + i;
+            else l2[(l - 12 - ppb) % ppb] = pblk + i;
+        }
 
-    // Free directory data blocks (direct blocks only; best-effort)
-    for (int i = 0; i < 12; i++) {
-        if (din.i_block[i]) (void)ext2_free_block0(m, din.i_block[i]);
+        size_t got = 0;
+        if (ext2_read_inode_data(m, in, map, (uint64_t)lbn * bs, buf, (size_t)n * bs, &got) != 0) { rc = -4; break; }
+        if (ext2_write_data_blocks(m, pblk, n, buf, got) != 0) { rc = -5; break; }
+        lbn += n;
     }
 
-    ext2_inode_t z;
-    m_memset(&z, 0, sizeof(z));
-    (void)ext2_write_inode(m, ino, &z);
-    (void)ext2_free_inode0(m, ino);
-
-    // Update parent link count (best-effort)
-    if (pin.i_links_count > 2) pin.i_links_count--;
-    (void)ext2_write_inode(m, parent_ino, &pin);
+    if (rc == 0 && nin->i_block[12] && ext2_write_block(m, nin->i_block[12], ind) != 0) rc = -3;
+    if (rc == 0 && l2_blk && ext2_write_block(m, l2_blk, l2) != 0) rc = -3;
+    if (rc == 0 && nin->i_block[13] && ext2_write_block(m, nin->i_block[13], dind) != 0) rc = -3;
 
-    return 0;
+out:
+    if (buf) g_api->kfree(buf);
+    if (ind) g_api->kfree(ind);
+    if (dind) g_api->kfree(dind);
+    if (l2) g_api->kfree(l2);
+    return rc;
 }
 
-static int ext2_write_file(fs_mount_t *mount, const char *path, const void *buffer, size_t size) {
+// Move a fragmented regular file into as few free runs as possible, with
+// its tables laid out inline. The new copy and its tables reach the disk
+// before the inode points at them, and the old blocks are released only
+// once the inode update has been written, so a crash at any point leaves
+// either the old or the new file intact (at worst with blocks leaked until
+// the next fsck). Returns 1 if the file was moved, 0 if it was left alone.
+static int ext2_defrag_inode(fs_mount_t *mount, ext2_icache_ent_t *e) {
     ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
-    if (!m || !g_api || !g_api->block_write) return -1;
+    ext2_inode_t *in = &e->inode;
+    if ((in->i_mode & 0xF000) != 0x8000 || in->i_links_count == 0) return 0;
+    if (e->da_buf || (in->i_flags & EXT4_EXTENTS_FL) || in->i_block[14]) return 0;
 
-    // minimal: ModuOS mkfs ext2 only (single group, 4KiB blocks)
-    if (m->block_size != 4096 || m->groups != 1) return -2;
+    uint32_t bs = m->block_size;
+    uint32_t nblk = (uint32_t)((ext2_isize(in) + bs - 1) / bs);
+    uint32_t nmeta = ext2_meta_blocks_for(m, nblk);
+    if (nblk == 0 || nmeta == 0xFFFFFFFFu) return 0;
+    // Sparse files would have their holes filled in; leave them be.
+    if (in->i_blocks != (nblk + nmeta) * (bs / 512u)) return 0;
+
+    int32_t breaks = ext2_defrag_breaks(m, in, &e->map, nblk);
+    if (breaks <= 0) return 0;
+    // Only worth it if the new layout has fewer breaks than the old one.
+    uint32_t max_runs = (uint32_t)breaks < EXT2_DEFRAG_MAX_RUNS ? (uint32_t)breaks : EXT2_DEFRAG_MAX_RUNS;
+    ext2_defrag_runs_t runs;
+    if (ext2_defrag_reserve(m, ext2_inode_goal(m, e->ino), nblk + nmeta, max_runs, &runs) != 0) return 0;
+
+    ext2_inode_t nin = *in;
+    m_memset(nin.i_block, 0, sizeof(nin.i_block));
+    int rc = ext2_defrag_copy(m, in, &e->map, &nin, &runs, nblk);
+    if (rc == 0) rc = ext2_commit(mount, 0);
+    if (rc != 0) {
+        ext2_defrag_release(m, &runs);
+        return ext2_commit(mount, rc);
+    }
 
-    if (!path || path[0] != '/') return -3;
+    ext2_inode_t old = *in;
+    *in = nin;
+    ext2_bmap_reset(&e->map);
+    e->ra_next = e->ra_end = e->ra_win = 0;
+    ext2_icache_mark_dirty(m, e);
+    rc = ext2_commit(mount, 0);
+    if (rc != 0) return rc;
+
+    rc = ext2_truncate_blocks(m, &old, 0);
+    rc = ext2_commit(mount, rc);
+    return rc == 0 ? 1 : rc;
+}
 
-    // Resolve existing?
-    uint32_t ino = 0;
-    int exists = (ext2_resolve_path(m, path, &ino, 0) == 0);
+// Defragment the regular file at path, or every regular file on the volume
+// when path is NULL. Returns the number of files moved.
+static int ext2_defrag(fs_mount_t *mount, const char *path) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    if (!m || !g_api || !g_api->block_write) return -1;
+    if (!ext2_writable(m) || !m->icache.ents) return -2;
+
+    // Buffered files get their blocks first, so every file has a layout.
+    int rc = ext2_commit(mount, 0);
+    if (rc != 0) return rc;
+
+    if (path) {
+        uint32_t ino;
+        if (path[0] != '/' || ext2_resolve_path(m, path, &ino, 0) != 0) return -3;
+        ext2_icache_ent_t *ie = ext2_iget(m, ino);
+        if (!ie) return -9;
+        rc = (ie->inode.i_mode & 0xF000) == 0x8000 ? ext2_defrag_inode(mount, ie) : -4;
+        ext2_iput(m, ie);
+        return rc;
+    }
 
-    // Split parent + leaf
-    char parent_path[512];
-    const char *name = NULL;
-    if (ext2_split_parent(path, parent_path, sizeof(parent_path), &name) != 0) return -4;
-    if (!name || !*name) return -5;
+    uint32_t ipg = m->sb.s_inodes_per_group;
+    uint32_t reserved = 11;
+    if (m->sb.s_rev_level >= 1 && m->sb.s_first_ino > 12) reserved = m->sb.s_first_ino - 1;
+
+    int moved = 0;
+    for (uint32_t g = 0; g < m->groups; g++) {
+        for (uint32_t bit = 0;; bit++) {
+            uint8_t *bmp = ext2_inode_bitmap(m, g);
+            if (!bmp) return -5;
+            bit = ext2_bitmap_find(bmp, bit, ipg, 1);
+            if (bit >= ipg) break;
+            uint32_t ino = g * ipg + bit + 1;
+            if (ino <= reserved || ino > m->sb.s_inodes_count) continue;
+
+            ext2_icache_ent_t *ie = ext2_iget(m, ino);
+            if (!ie) return -9;
+            rc = ext2_defrag_inode(mount, ie);
+            ext2_iput(m, ie);
+            if (rc < 0) return rc;
+            moved += rc;
+        }
+    }
+    return moved;
+}
 
-    uint32_t parent_ino = 0;
-    if (ext2_resolve_path(m, parent_path, &parent_ino, 0) != 0) return -6;
+// --- handle-based file access ---
 
-    ext2_inode_t pin;
-    if (ext2_read_inode(m, parent_ino, &pin) != 0) return -7;
-    if ((pin.i_mode & 0xF000) != 0x4000) return -8;
+typedef struct {
+    ext2_mount_ctx_t *m;
+    ext2_icache_ent_t *ie; // pinned for the life of the handle
+    uint32_t ino;
+    int wrote;             // commit on close
+} ext2_file_t;
 
-    ext2_inode_t in;
-    if (exists) {
-        if (ext2_read_inode(m, ino, &in) != 0) return -9;
-        if ((in.i_mode & 0xF000) != 0x8000) return -10;
+// The inode a handle refers to is gone once unlink has cleared it.
+static int ext2_file_live(ext2_file_t *f) {
+    return (f->ie->inode.i_mode & 0xF000) == 0x8000 && f->ie->inode.i_links_count != 0;
+}
 
-        // Full overwrite semantics: free existing blocks (direct + indirect) and reset pointers.
-        for (int i = 0; i < 12; i++) {
-            if (in.i_block[i]) { (void)ext2_free_block0(m, in.i_block[i]); in.i_block[i] = 0; }
-        }
-        if (in.i_block[12]) { (void)ext2_free_indirect_chain(m, in.i_block[12], 1); in.i_block[12] = 0; }
-        if (in.i_block[13]) { (void)ext2_free_indirect_chain(m, in.i_block[13], 2); in.i_block[13] = 0; }
-        // no triple-indirect support
+static fs_file_t* ext2_open(fs_mount_t *mount, const char *path, uint32_t flags) {
+    ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
+    if (!m || !path || !m->icache.ents) return NULL;
+    // CREATE and TRUNC modify the file, so they only come with a handle
+    // that may write it.
+    if ((flags & (FS_OPEN_CREATE | FS_OPEN_TRUNC)) && !(flags & FS_OPEN_WRITE)) return NULL;
+    if ((flags & FS_OPEN_WRITE) && !ext2_writable(m)) return NULL;
 
-        in.i_size = 0;
-        in.i_blocks = 0;
-    } else {
-        if (ext2_alloc_inode0(m, &ino) != 0) return -11;
-        m_memset(&in, 0, sizeof(in));
-        in.i_mode = (uint16_t)(0x8000 | 0644);
-        in.i_links_count = 1;
-        in.i_size = 0;
+    uint32_t ino;
+    if (ext2_resolve_path(m, path, &ino, 0) != 0) {
+        if (!(flags & FS_OPEN_CREATE)) return NULL;
+        if (ext2_commit(mount, ext2_do_write_file(mount, path, "", 0)) != 0) return NULL;
+        if (ext2_resolve_path(m, path, &ino, 0) != 0) return NULL;
+    }
 
-        // Insert into parent directory
-        if (ext2_dir_add_entry(m, parent_ino, name, ino, 1) != 0) return -12;
+    ext2_icache_ent_t *ie = ext2_iget(m, ino);
+    if (!ie) return NULL;
+    if ((ie->inode.i_mode & 0xF000) != 0x8000) { ext2_iput(m, ie); return NULL; }
+
+    fs_file_t *file = (fs_file_t*)g_api->kmalloc(sizeof(fs_file_t));
+    ext2_file_t *f = (ext2_file_t*)g_api->kmalloc(sizeof(ext2_file_t));
+    if (!file || !f) {
+        if (file) g_api->kfree(file);
+        if (f) g_api->kfree(f);
+        ext2_iput(m, ie);
+        return NULL;
+    }
+    m_memset(file, 0, sizeof(*file));
+    m_memset(f, 0, sizeof(*f));
+    file->mount = mount;
+    m_strncpy(file->path, path, sizeof(file->path) - 1);
+    file->flags = flags;
+    file->fs_specific = f;
+    f->m = m;
+    f->ie = ie;
+    f->ino = ino;
+
+    if ((flags & FS_OPEN_TRUNC) && ext2_isize(&ie->inode) != 0) {
+        if (ext2_commit(mount, ext2_file_set_size(m, ie, 0)) != 0) {
+            ext2_iput(m, ie);
+            g_api->kfree(f);
+            g_api->kfree(file);
+            return NULL;
+        }
     }
+    return file;
+}
 
-    // Write data blocks (direct + indirect via ext2_set_block_ptr)
+// Called before a handle read of [off, off + size). A read that starts where
+// the previous one ended (or in its last block) grows the window; anything
+// else resets it. Once less than half a window is left ahead of the reader
+// the next stretch is prefetched, together with the blocks of this read
+// that are not cached yet. The kernel API has only synchronous block I/O,
+// so the prefetch runs inline, one request per physically contiguous run.
+static void ext2_readahead(ext2_mount_ctx_t *m, ext2_icache_ent_t *e, uint64_t off, size_t size) {
     uint32_t bs = m->block_size;
-    uint32_t blocks_needed = (uint32_t)((size + bs - 1) / bs);
+    uint64_t fsize = ext2_isize(&e->inode);
+    if (!m->bcache.ents || size == 0 || off >= fsize) return;
+    if (off + size > fsize) size = (size_t)(fsize - off);
+
+    uint32_t first = (uint32_t)(off / bs);
+    uint32_t last = (uint32_t)((off + size - 1) / bs) + 1;
+    uint32_t eof = (uint32_t)((fsize + bs - 1) / bs);
+    int seq = first == e->ra_next || (e->ra_next && first == e->ra_next - 1);
+    e->ra_next = last;
+    if (!seq) {
+        e->ra_win = 0;
+        e->ra_end = 0;
+        return;
+    }
 
-    const uint8_t *src = (const uint8_t*)buffer;
-    uint8_t *blkbuf = (uint8_t*)g_api->kmalloc(bs);
-    if (!blkbuf) return -13;
+    uint32_t max_win = EXT2_RA_MAX_BYTES / bs;
+    if (max_win > m->bcache.nents / 4) max_win = m->bcache.nents / 4;
+    uint32_t min_win = EXT2_RA_MIN_BYTES / bs;
+    if (min_win == 0) min_win = 1;
+    if (min_win > max_win) min_win = max_win;
+    // Reads this large already go to the device in big runs.
+    if (max_win == 0 || last - first >= max_win) return;
+
+    e->ra_win = e->ra_win ? e->ra_win * 2 : min_win;
+    if (e->ra_win > max_win) e->ra_win = max_win;
+    if (e->ra_end >= last + e->ra_win / 2) return;
+
+    uint32_t lbn = first > e->ra_end ? first : e->ra_end;
+    uint32_t stop = last + e->ra_win;
+    if (stop > eof) stop = eof;
+    while (lbn < stop) {
+        uint32_t pblk = 0;
+        uint32_t n = ext2_map_run(m, &e->inode, &e->map, lbn, stop - lbn, &pblk);
+        if (pblk) ext2_bcache_prefetch(m, pblk, n);
+        lbn += n;
+    }
+    e->ra_end = stop;
+}
 
-    for (uint32_t lbn = 0; lbn < blocks_needed; lbn++) {
-        uint32_t pblk = ext2_get_block_ptr(m, &in, lbn);
-        if (pblk == 0) {
-            if (ext2_alloc_block0(m, &pblk) != 0) { g_api->kfree(blkbuf); return -14; }
-            if (ext2_set_block_ptr(m, &in, lbn, pblk) != 0) { g_api->kfree(blkbuf); return -15; }
+static int ext2_read_at(fs_file_t *file, uint64_t offset, void *buffer, size_t size, size_t *bytes_read) {
+    if (bytes_read) *bytes_read = 0;
+    if (!file || !file->fs_specific || (!buffer && size)) return -1;
+    ext2_file_t *f = (ext2_file_t*)file->fs_specific;
+    if (!ext2_file_live(f)) return -2;
+
+    ext2_icache_ent_t *ie = f->ie;
+    int r = 0;
+    size_t got = 0;
+    if (ie->da_buf) {
+        // Not allocated yet: serve the buffered contents.
+        if (offset < ie->da_len) {
+            got = ie->da_len - (size_t)offset;
+            if (got > size) got = size;
+            m_memcpy(buffer, ie->da_buf + offset, got);
         }
-        m_memset(blkbuf, 0, bs);
-        size_t off = (size_t)lbn * bs;
-        size_t chunk = bs;
-        if (off + chunk > size) chunk = size - off;
-        if (chunk) m_memcpy(blkbuf, src + off, chunk);
-        if (ext2_write_block(m, pblk, blkbuf) != 0) { g_api->kfree(blkbuf); return -16; }
+    } else {
+        ext2_readahead(f->m, ie, offset, size);
+        r = ext2_read_inode_data(f->m, &ie->inode, &ie->map, offset, buffer, size, &got);
     }
+    if (r < 0) return r;
+    if (bytes_read) *bytes_read = got;
+    return 0;
+}
+
+// Like write_file, handle writes are write-back: metadata stays in memory
+// until close, sync or the next committing operation.
+static int ext2_write_at(fs_file_t *file, uint64_t offset, const void *buffer, size_t size, size_t *bytes_written) {
+    if (bytes_written) *bytes_written = 0;
+    if (!file || !file->fs_specific || (!buffer && size)) return -1;
+    if (!(file->flags & FS_OPEN_WRITE)) return -2;
+    ext2_file_t *f = (ext2_file_t*)file->fs_specific;
+    if (!ext2_file_live(f)) return -3;
+
+    f->wrote = 1;
+    int rc = ext2_write_back(file->mount, ext2_file_write_range(f->m, f->ie, offset, (const uint8_t*)buffer, size));
+    if (rc == 0 && bytes_written) *bytes_written = size;
+    return rc;
+}
 
-    g_api->kfree(blkbuf);
+static int ext2_truncate(fs_file_t *file, uint64_t size) {
+    if (!file || !file->fs_specific) return -1;
+    if (!(file->flags & FS_OPEN_WRITE)) return -2;
+    ext2_file_t *f = (ext2_file_t*)file->fs_specific;
+    if (!ext2_file_live(f)) return -3;
+    return ext2_commit(file->mount, ext2_file_set_size(f->m, f->ie, size));
+}
 
-    in.i_size = (uint32_t)size;
-    // EXT2 counts 512-byte sectors; minimal approximation.
-    in.i_blocks = (uint32_t)((blocks_needed * bs) / 512u);
+static int ext2_fallocate(fs_file_t *file, uint32_t mode, uint64_t offset, uint64_t len) {
+    if (!file || !file->fs_specific) return -1;
+    if (!(file->flags & FS_OPEN_WRITE)) return -2;
+    if (mode & ~(FS_FALLOC_KEEP_SIZE | FS_FALLOC_PUNCH_HOLE)) return -4;
+    ext2_file_t *f = (ext2_file_t*)file->fs_specific;
+    if (!ext2_file_live(f)) return -3;
+    int rc;
+    if (mode & FS_FALLOC_PUNCH_HOLE) rc = ext2_file_punch(f->m, f->ie, offset, len);
+    else rc = ext2_file_alloc_range(f->m, f->ie, offset, len, (mode & FS_FALLOC_KEEP_SIZE) != 0);
+    return ext2_commit(file->mount, rc);
+}
 
-    if (ext2_write_inode(m, ino, &in) != 0) return -17;
+#define EXT2_PAGE_REF_ZERO 0xFFFFFFFFu // fs_page_t.ref of the shared zero block
 
-    return 0;
+static void ext2_put_pages(fs_file_t *file, const fs_page_t *pages, uint32_t count) {
+    if (!file || !file->fs_specific || !pages) return;
+    ext2_bcache_t *c = &((ext2_file_t*)file->fs_specific)->m->bcache;
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t i = pages[k].ref;
+        if (i >= c->nents || c->ents[i].pins == 0) continue;
+        if (--c->ents[i].pins == 0) c->npinned--;
+    }
+}
+
+// Lend out the cache buffers holding the blocks of [offset, offset + len).
+// Each buffer is pinned so the cache cannot recycle it; a later write through
+// the cache shows up in it, while a block rewritten on the device or freed is
+// detached and keeps the contents the borrower saw.
+static int ext2_get_pages(fs_file_t *file, uint64_t offset, size_t len, fs_page_t *pages, uint32_t max_pages) {
+    if (!file || !file->fs_specific || (!pages && max_pages)) return -1;
+    ext2_file_t *f = (ext2_file_t*)file->fs_specific;
+    if (!ext2_file_live(f)) return -2;
+    ext2_mount_ctx_t *m = f->m;
+    ext2_bcache_t *c = &m->bcache;
+    if (!c->ents) return -3;
+
+    ext2_icache_ent_t *ie = f->ie;
+    if (ie->da_buf) {
+        // Buffered data has no cache blocks yet: allocate it now.
+        f->wrote = 1;
+        int rc = ext2_write_back(file->mount, ext2_da_flush_one(m, ie));
+        if (rc != 0) return rc;
+    }
+
+    uint64_t size = ext2_isize(&ie->inode);
+    if (len == 0 || max_pages == 0 || offset >= size) return 0;
+    if (len > size - offset) len = (size_t)(size - offset);
+
+    uint32_t bs = m->block_size;
+    uint32_t first = (uint32_t)(offset / bs);
+    uint32_t n = (uint32_t)((offset + len - 1) / bs) - first + 1;
+    if (n > max_pages) n = max_pages;
+    uint32_t budget = c->nents / EXT2_BCACHE_PIN_DIV;
+    if (c->npinned >= budget) return -4;
+    if (n > budget - c->npinned) n = budget - c->npinned;
+
+    // Pull in whatever is missing with one device request per run.
+    for (uint32_t k = 0; k < n;) {
+        uint32_t pblk = 0;
+        uint32_t run = ext2_map_run(m, &ie->inode, &ie->map, first + k, n - k, &pblk);
+        if (pblk) ext2_bcache_prefetch(m, pblk, run);
+        k += run;
+    }
+
+    for (uint32_t k = 0; k < n; k++) {
+        fs_page_t *p = &pages[k];
+        p->offset = (uint64_t)(first + k) * bs;
+        p->len = size - p->offset < bs ? (uint32_t)(size - p->offset) : bs;
+        uint32_t pblk = ext2_get_block_ptr(m, &ie->inode, &ie->map, first + k);
+        if (!pblk) {
+            if (!m->zero_raw) {
+                m->zero_raw = (uint8_t*)g_api->kmalloc((size_t)bs + EXT2_PAGE_SIZE - 1);
+                if (!m->zero_raw) { ext2_put_pages(file, pages, k); return -5; }
+                m->zero_blk = (uint8_t*)(((uintptr_t)m->zero_raw + EXT2_PAGE_SIZE - 1) & ~(uintptr_t)(EXT2_PAGE_SIZE - 1));
+                m_memset(m->zero_blk, 0, bs);
+            }
+            p->addr = m->zero_blk;
+            p->ref = EXT2_PAGE_REF_ZERO;
+            continue;
+        }
+        int32_t i = ext2_bcache_get(m, pblk, 1) ? ext2_bcache_find(c, pblk) : -1;
+        if (i < 0 || c->ents[i].pins == 0xFFFFu) { ext2_put_pages(file, pages, k); return -6; }
+        ext2_bcache_ent_t *e = &c->ents[i];
+        if (e->pins++ == 0) c->npinned++;
+        p->addr = e->data;
+        p->ref = (uint32_t)i;
+    }
+    return (int)n;
+}
+
+static int ext2_close(fs_file_t *file) {
+    if (!file) return -1;
+    ext2_file_t *f = (ext2_file_t*)file->fs_specific;
+    int rc = 0;
+    if (f) {
+        if (f->wrote) rc = ext2_commit(file->mount, 0);
+        ext2_iput(f->m, f->ie);
+        g_api->kfree(f);
+    }
+    g_api->kfree(file);
+    return rc;
 }
 
 typedef struct {
@@ -1266,8 +5756,73 @@ typedef struct {
     uint32_t lbn;
     uint32_t off;
     uint8_t *blk;
+    uint8_t loaded; // blk holds block lbn
+    uint32_t *inos; // scratch for ext2_dir_prefetch_inodes()
+    uint32_t inos_cap;
 } ext2_dir_iter_t;
 
+// Inode numbers per block are bounded by the smallest record (12 bytes).
+#define EXT2_DIRENT_MIN_REC 12u
+
+// Before handing out the entries of a freshly loaded directory block, read
+// the inode-table blocks behind them in bulk: the inode numbers that will
+// need a lookup are sorted so each table block is read once, and contiguous
+// table blocks are fetched with one request.
+static void ext2_dir_prefetch_inodes(ext2_dir_iter_t *it) {
+    ext2_mount_ctx_t *m = it->m;
+    if (!m->bcache.ents || !it->inos) return;
+
+    uint32_t bs = m->block_size;
+    int ftype = (m->sb.s_feature_incompat & EXT2_INCOMPAT_FILETYPE) != 0;
+    uint32_t n = 0;
+    uint32_t off = 0;
+    while (off + sizeof(ext2_dirent_t) <= bs && n < it->inos_cap) {
+        ext2_dirent_t *de = (ext2_dirent_t*)(it->blk + off);
+        if (de->rec_len == 0) break;
+        off += de->rec_len;
+        if (de->inode == 0 || de->name_len == 0) continue;
+        if (ftype && de->file_type == EXT2_FT_DIR) continue;
+        if (m->icache.ents && ext2_icache_find(&m->icache, de->inode) >= 0) continue;
+
+        // insertion sort; a directory block holds at most a few hundred
+        uint32_t v = de->inode;
+        uint32_t i = n++;
+        while (i > 0 && it->inos[i - 1] > v) {
+            it->inos[i] = it->inos[i - 1];
+            i--;
+        }
+        it->inos[i] = v;
+    }
+    if (n < 2) return; // a single lookup gains nothing over the normal path
+
+    uint32_t run = 0, len = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t ioff;
+        if (ext2_inode_offset(m, it->inos[i], &ioff) != 0) continue;
+        uint32_t tblk = (uint32_t)(ioff / bs);
+        if (len && tblk >= run && tblk < run + len) continue;
+        if (len && tblk == run + len) { len++; continue; }
+        if (len) ext2_bcache_prefetch(m, run, len);
+        run = tblk;
+        len = 1;
+    }
+    if (len) ext2_bcache_prefetch(m, run, len);
+}
+
+// Inode as seen by readdir: the cached copy when there is one (it may carry
+// unflushed changes), otherwise the on-disk slot, read without recycling
+// inode cache entries that the rest of the driver is using.
+static int ext2_readdir_inode(ext2_mount_ctx_t *m, uint32_t ino, ext2_inode_t *out) {
+    if (m->icache.ents) {
+        int32_t i = ext2_icache_find(&m->icache, ino);
+        if (i >= 0) {
+            *out = m->icache.ents[i].inode;
+            return 0;
+        }
+    }
+    return ext2_read_inode_disk(m, ino, out);
+}
+
 static fs_dir_t* ext2_opendir(fs_mount_t *mount, const char *path) {
     ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
     uint32_t ino;
@@ -1291,29 +5846,35 @@ static fs_dir_t* ext2_opendir(fs_mount_t *mount, const char *path) {
     it->off = 0;
     it->blk = (uint8_t*)g_api->kmalloc(m->block_size);
     if (!it->blk) { g_api->kfree(it); g_api->kfree(d); return NULL; }
+    it->inos_cap = m->block_size / EXT2_DIRENT_MIN_REC;
+    it->inos = (uint32_t*)g_api->kmalloc(sizeof(uint32_t) * it->inos_cap);
+    if (!it->inos) it->inos_cap = 0;
 
     d->fs_specific = it;
     return d;
 }
 
-static int ext2_readdir(fs_dir_t *dir, fs_dirent_t *entry) {
-    ext2_dir_iter_t *it = (ext2_dir_iter_t*)dir->fs_specific;
-    if (!it) return 0;
-
+// Position the iterator on the next live entry without consuming it; the
+// caller advances it->off past *out once the entry has been used. Returns 1
+// with *out pointing into it->blk, 0 at the end of the directory.
+static int ext2_dir_iter_peek(ext2_dir_iter_t *it, ext2_dirent_t **out) {
     uint32_t bs = it->m->block_size;
 
     while (1) {
         if (it->lbn * bs >= it->dir_inode.i_size) return 0;
 
-        if (it->off == 0) {
-            uint32_t pblk = ext2_get_block_ptr(it->m, &it->dir_inode, it->lbn);
+        if (!it->loaded) {
+            uint32_t pblk = ext2_get_block_ptr(it->m, &it->dir_inode, NULL, it->lbn);
             if (!pblk) return 0;
             if (ext2_read_block(it->m, pblk, it->blk) != 0) return 0;
+            it->loaded = 1;
+            ext2_dir_prefetch_inodes(it);
         }
 
         if (it->off + sizeof(ext2_dirent_t) > bs) {
             it->lbn++;
             it->off = 0;
+            it->loaded = 0;
             continue;
         }
 
@@ -1321,12 +5882,44 @@ static int ext2_readdir(fs_dir_t *dir, fs_dirent_t *entry) {
         if (de->rec_len == 0) {
             it->lbn++;
             it->off = 0;
+            it->loaded = 0;
             continue;
         }
 
-        it->off += de->rec_len;
+        if (de->inode == 0 || de->name_len == 0) {
+            it->off += de->rec_len;
+            continue;
+        }
 
-        if (de->inode == 0 || de->name_len == 0) continue;
+        *out = de;
+        return 1;
+    }
+}
+
+// Directory flag and size of an entry. Directories always report size 0 (as
+// on FAT); with the filetype feature the entry itself says whether it is one
+// and no inode is read.
+static int ext2_dir_entry_info(ext2_mount_ctx_t *m, const ext2_dirent_t *de, int *is_dir, uint64_t *size) {
+    if ((m->sb.s_feature_incompat & EXT2_INCOMPAT_FILETYPE) && de->file_type == EXT2_FT_DIR) {
+        *is_dir = 1;
+        *size = 0;
+        return 0;
+    }
+
+    ext2_inode_t cin;
+    if (ext2_readdir_inode(m, de->inode, &cin) != 0) return -1;
+    *is_dir = ((cin.i_mode & 0xF000) == 0x4000);
+    *size = *is_dir ? 0 : ext2_isize(&cin);
+    return 0;
+}
+
+static int ext2_readdir(fs_dir_t *dir, fs_dirent_t *entry) {
+    ext2_dir_iter_t *it = (ext2_dir_iter_t*)dir->fs_specific;
+    if (!it) return 0;
+
+    ext2_dirent_t *de;
+    while (ext2_dir_iter_peek(it, &de)) {
+        it->off += de->rec_len;
 
         // Copy name
         size_t nlen = de->name_len;
@@ -1334,13 +5927,48 @@ static int ext2_readdir(fs_dir_t *dir, fs_dirent_t *entry) {
         m_memcpy(entry->name, de->name, nlen);
         entry->name[nlen] = 0;
 
-        // Determine if directory
-        ext2_inode_t cin;
-        if (ext2_read_inode(it->m, de->inode, &cin) != 0) continue;
-        entry->is_directory = ((cin.i_mode & 0xF000) == 0x4000);
-        entry->size = cin.i_size;
+        uint64_t size;
+        if (ext2_dir_entry_info(it->m, de, &entry->is_directory, &size) != 0) continue;
+        entry->size = size;
         return 1;
     }
+    return 0;
+}
+
+// Native readdir_batch: emit records straight from the directory blocks,
+// leaving the first entry that does not fit for the next call.
+static int ext2_readdir_batch(fs_dir_t *dir, void *buf, size_t buf_size) {
+    ext2_dir_iter_t *it = (ext2_dir_iter_t*)dir->fs_specific;
+    if (!it) return 0;
+    if (!buf) return -1;
+
+    uint8_t *out = (uint8_t*)buf;
+    size_t used = 0;
+    ext2_dirent_t *de;
+    while (ext2_dir_iter_peek(it, &de)) {
+        uint32_t nlen = de->name_len;
+        uint32_t rl = FS_DIRENT_REC_LEN(nlen);
+        if (used + rl > buf_size) {
+            if (used == 0) return -2;
+            break;
+        }
+
+        int is_dir;
+        uint64_t size;
+        int rc = ext2_dir_entry_info(it->m, de, &is_dir, &size);
+        it->off += de->rec_len;
+        if (rc != 0) continue;
+
+        fs_dirent_rec_t *r = (fs_dirent_rec_t*)(out + used);
+        m_memset(r, 0, rl);
+        r->rec_len = (uint16_t)rl;
+        r->name_len = (uint16_t)nlen;
+        r->size = size;
+        r->is_directory = (uint8_t)is_dir;
+        m_memcpy(r->name, de->name, nlen);
+        used += rl;
+    }
+    return (int)used;
 }
 
 static void ext2_closedir(fs_dir_t *dir) {
@@ -1348,6 +5976,7 @@ static void ext2_closedir(fs_dir_t *dir) {
     ext2_dir_iter_t *it = (ext2_dir_iter_t*)dir->fs_specific;
     if (it) {
         if (it->blk) g_api->kfree(it->blk);
+        if (it->inos) g_api->kfree(it->inos);
         g_api->kfree(it);
     }
     g_api->kfree(dir);
@@ -1370,6 +5999,12 @@ static int ext2_mount(int vdrive_id, uint32_t partition_lba, fs_mount_t *mount)
         return -2;
     }
 
+    // Block numbers are 32-bit throughout.
+    if ((m->sb.s_feature_incompat & EXT4_INCOMPAT_64BIT) && m->sb.s_blocks_count_hi) {
+        g_api->kfree(m);
+        return -2;
+    }
+
     m->block_size = 1024u << m->sb.s_log_block_size;
     m->inode_size = m->sb.s_inode_size ? m->sb.s_inode_size : 128;
     m->groups = (m->sb.s_blocks_count + m->sb.s_blocks_per_group - 1) / m->sb.s_blocks_per_group;
@@ -1378,6 +6013,43 @@ static int ext2_mount(int vdrive_id, uint32_t partition_lba, fs_mount_t *mount)
     if (m->block_size == 1024) m->bgdt_block = 2;
     else m->bgdt_block = 1;
 
+    m->sector_size = bdev_sector_size(m);
+    if (!m->sector_size || (m->block_size % m->sector_size) != 0) {
+        g_api->kfree(m);
+        return -3;
+    }
+
+    if (ext2_load_bgdt(m) != 0) {
+        g_api->kfree(m);
+        return -4;
+    }
+
+    m->gbmp = (ext2_group_bmp_t*)g_api->kmalloc(sizeof(ext2_group_bmp_t) * m->groups);
+    if (!m->gbmp) {
+        g_api->kfree(m->bgdt);
+        g_api->kfree(m->bgdt_dirty);
+        g_api->kfree(m);
+        return -5;
+    }
+    m_memset(m->gbmp, 0, sizeof(ext2_group_bmp_t) * m->groups);
+
+    if (ext2_journal_load(m) != 0) {
+        ext2_journal_free(m);
+        g_api->kfree(m->gbmp);
+        if (m->bgdt) g_api->kfree(m->bgdt);
+        if (m->bgdt_dirty) g_api->kfree(m->bgdt_dirty);
+        g_api->kfree(m);
+        return -6;
+    }
+
+    // Without a cache the driver still works, just with a device round trip
+    // per metadata access.
+    (void)ext2_bcache_init(m);
+    (void)ext2_icache_init(m);
+    (void)ext2_dcache_init(m);
+    // Transactions are built in the block cache.
+    if (!m->bcache.ents) (void)ext2_journal_close(m);
+
     mount->ext_ctx = m;
     return 0;
 }
@@ -1406,104 +6078,238 @@ static int ext2_list_directory(fs_mount_t *mount, const char *path) {
 static void ext2_unmount(fs_mount_t *mount) {
     if (!mount || !g_api) return;
     ext2_mount_ctx_t *m = (ext2_mount_ctx_t*)mount->ext_ctx;
-    if (m) g_api->kfree(m);
+    if (m) {
+        (void)ext2_da_flush(m);
+        (void)ext2_journal_close(m);
+        ext2_icache_destroy(m);
+        ext2_dcache_destroy(m);
+        (void)ext2_flush_bitmaps(m);
+        ext2_free_bitmaps(m);
+        (void)ext2_flush_meta(m);
+        ext2_bcache_destroy(m);
+        if (m->zero_raw) g_api->kfree(m->zero_raw);
+        if (m->bgdt) g_api->kfree(m->bgdt);
+        if (m->bgdt_dirty) g_api->kfree(m->bgdt_dirty);
+        g_api->kfree(m);
+    }
     mount->ext_ctx = NULL;
 }
 
 // --- mkfs (format) ---
 
-static void set_bit(uint8_t *bmp, uint32_t bit) {
-    bmp[bit / 8] |= (uint8_t)(1u << (bit % 8));
-}
-static int test_bit(uint8_t *bmp, uint32_t bit) {
-    return (bmp[bit / 8] & (uint8_t)(1u << (bit % 8))) != 0;
+// Table held in *slot (an i_block[] entry or a slot of a parent table),
+// allocating a zeroed one near goal when the slot is empty. A new table is
+// counted in in->i_blocks and reported through *created; the caller writes
+// it (and the parent holding slot) out.
+static uint32_t *ext2_bmap_table_alloc(ext2_mount_ctx_t *m, ext2_inode_t *in, uint32_t *slot,
+                                       uint32_t *tag, uint32_t **tbl, uint32_t goal, int *created) {
+    if (*slot) return ext2_bmap_table(m, tag, tbl, *slot);
+
+    if (!*tbl) {
+        *tbl = (uint32_t*)g_api->kmalloc(m->block_size);
+        if (!*tbl) return NULL;
+    }
+    *tag = 0;
+    uint32_t blk = 0;
+    if (ext2_alloc_block(m, goal, &blk) != 0) return NULL;
+    // Fresh table: start from zeroes instead of reading the old contents.
+    m_memset(*tbl, 0, m->block_size);
+    *tag = blk;
+    *slot = blk;
+    in->i_blocks += m->block_size / 512u;
+    *created = 1;
+    return *tbl;
 }
 
-static int ext2_alloc_block0(ext2_mount_ctx_t *m, uint32_t *out_block) {
-    if (!g_api || !out_block) return -1;
-    if (m->groups != 1 || m->block_size != 4096) return -2;
+// Point logical block lbn at pblk, allocating missing indirect tables next
+// to the data. New tables are added to in->i_blocks; the data block is not.
+static int ext2_set_block_ptr(ext2_mount_ctx_t *m, ext2_inode_t *in, ext2_bmap_t *map, uint32_t lbn, uint32_t pblk) {
+    uint32_t ppb = m->block_size / 4;
+    if (in->i_flags & EXT4_EXTENTS_FL) return -1; // extent trees are read-only
+    if (lbn < 12) {
+        in->i_block[lbn] = pblk;
+        return 0;
+    }
 
-    ext2_bgdt_t bg;
-    if (ext2_read_bgdt(m, 0, &bg) != 0) return -3;
+    ext2_bmap_t tmp;
+    if (!map) {
+        m_memset(&tmp, 0, sizeof(tmp));
+        map = &tmp;
+    }
 
-    uint8_t *bmp = (uint8_t*)g_api->kmalloc(m->block_size);
-    if (!bmp) return -4;
-    if (ext2_read_block(m, bg.bg_block_bitmap, bmp) != 0) { g_api->kfree(bmp); return -5; }
-
-    // Scan blocks (relative to filesystem block numbers)
-    for (uint32_t b = 0; b < m->sb.s_blocks_count; b++) {
-        if (!test_bit(bmp, b)) {
-            set_bit(bmp, b);
-            if (ext2_write_block(m, bg.bg_block_bitmap, bmp) != 0) { g_api->kfree(bmp); return -6; }
-            g_api->kfree(bmp);
-            *out_block = b;
-            return 0;
+    int rc = 0;
+    int created = 0;
+    uint32_t *tbl;
+    uint32_t tblk;
+    lbn -= 12;
+    if (lbn < ppb) {
+        uint32_t slot = in->i_block[12]; // i_block is a packed member
+        tbl = ext2_bmap_table_alloc(m, in, &slot, &map->ind_blk, &map->ind, pblk, &created);
+        in->i_block[12] = slot;
+        if (!tbl) { rc = -1; goto out; }
+        tblk = slot;
+    } else if ((lbn -= ppb) / ppb < ppb) {
+        uint32_t idx1 = lbn / ppb;
+        uint32_t slot = in->i_block[13];
+        uint32_t *t1 = ext2_bmap_table_alloc(m, in, &slot, &map->dind_blk, &map->dind, pblk, &created);
+        in->i_block[13] = slot;
+        if (!t1) { rc = -1; goto out; }
+        int l2_new = 0;
+        tbl = ext2_bmap_table_alloc(m, in, &t1[idx1], &map->dind2_blk, &map->dind2, pblk, &l2_new);
+        if (created || l2_new) {
+            rc = ext2_write_block(m, in->i_block[13], t1);
+            if (rc != 0) { map->dind_blk = 0; goto out; }
         }
+        if (!tbl) { rc = -1; goto out; }
+        tblk = t1[idx1];
+        lbn %= ppb;
+    } else {
+        lbn -= ppb * ppb;
+        uint32_t idx1 = lbn / (ppb * ppb);
+        uint32_t idx2 = (lbn / ppb) % ppb;
+        if (idx1 >= ppb) { rc = -5; goto out; }
+        uint32_t slot = in->i_block[14];
+        uint32_t *t1 = ext2_bmap_table_alloc(m, in, &slot, &map->tind_blk, &map->tind, pblk, &created);
+        in->i_block[14] = slot;
+        if (!t1) { rc = -1; goto out; }
+        int t2_new = 0, t3_new = 0;
+        uint32_t *t2 = ext2_bmap_table_alloc(m, in, &t1[idx1], &map->tind2_blk, &map->tind2, pblk, &t2_new);
+        if (created || t2_new) {
+            rc = ext2_write_block(m, in->i_block[14], t1);
+            if (rc != 0) { map->tind_blk = 0; goto out; }
+        }
+        if (!t2) { rc = -1; goto out; }
+        tbl = ext2_bmap_table_alloc(m, in, &t2[idx2], &map->tind3_blk, &map->tind3, pblk, &t3_new);
+        if (t2_new || t3_new) {
+            rc = ext2_write_block(m, t1[idx1], t2);
+            if (rc != 0) { map->tind2_blk = 0; goto out; }
+        }
+        if (!tbl) { rc = -1; goto out; }
+        tblk = t2[idx2];
+        lbn %= ppb;
     }
 
-    g_api->kfree(bmp);
-    return -7;
+    tbl[lbn] = pblk;
+    rc = ext2_write_block(m, tblk, tbl);
+    if (rc != 0) {
+        map->ind_blk = 0;
+        map->dind2_blk = 0;
+        map->tind3_blk = 0;
+    }
+
+out:
+    if (map == &tmp) ext2_bmap_free(&tmp);
+    return rc;
 }
 
-static int ext2_alloc_inode0(ext2_mount_ctx_t *m, uint32_t *out_ino) {
-    if (!g_api || !out_ino) return -1;
-    if (m->groups != 1 || m->block_size != 4096) return -2;
+// With sparse_super, groups 0 and 1 and the powers of 3, 5 and 7 carry a
+// copy of the superblock and descriptor table.
+static int ext2_group_has_super(uint32_t g) {
+    if (g <= 1) return 1;
+    for (uint32_t p = 3; p <= 7; p += 2) {
+        uint64_t v = p;
+        while (v < g) v *= p;
+        if (v == g) return 1;
+    }
+    return 0;
+}
 
-    ext2_bgdt_t bg;
-    if (ext2_read_bgdt(m, 0, &bg) != 0) return -3;
+static int ext2_mkfs_write(blockdev_handle_t bdev, uint32_t partition_lba, uint32_t blk, uint32_t count, const void *buf) {
+    uint64_t lba = (uint64_t)partition_lba + (uint64_t)blk * 8u;
+    return g_api->block_write(bdev, lba, count * 8u, buf, (size_t)count * 4096u);
+}
 
-    uint8_t *bmp = (uint8_t*)g_api->kmalloc(m->block_size);
-    if (!bmp) return -4;
-    if (ext2_read_block(m, bg.bg_inode_bitmap, bmp) != 0) { g_api->kfree(bmp); return -5; }
-
-    for (uint32_t i = 0; i < m->sb.s_inodes_per_group; i++) {
-        uint32_t ino = i + 1;
-        // skip reserved inodes 1..11
-        if (ino <= 11) continue;
-        if (!test_bit(bmp, i)) {
-            set_bit(bmp, i);
-            if (ext2_write_block(m, bg.bg_inode_bitmap, bmp) != 0) { g_api->kfree(bmp); return -6; }
-            g_api->kfree(bmp);
-            *out_ino = ino;
-            return 0;
-        }
-    }
+// Journal size for a volume of total_blocks blocks, the way mke2fs picks
+// it; 0 for volumes too small to carry one.
+static uint32_t ext2_mkfs_journal_size(uint32_t total_blocks) {
+    if (total_blocks < 2048u) return 0;
+    if (total_blocks < 32768u) return 1024u;
+    if (total_blocks < 256u * 1024u) return 4096u;
+    if (total_blocks < 512u * 1024u) return 8192u;
+    return 16384u;
+}
 
-    g_api->kfree(bmp);
-    return -7;
+// Indirect tables needed to map nblk blocks with 4KiB blocks.
+static uint32_t ext2_mkfs_journal_meta(uint32_t nblk) {
+    const uint32_t ppb = 1024;
+    if (nblk <= 12) return 0;
+    if (nblk <= 12 + ppb) return 1;
+    return 2 + (nblk - 12 - ppb + ppb - 1) / ppb;
 }
 
-static int ext2_set_block_ptr(ext2_mount_ctx_t *m, ext2_inode_t *in, uint32_t lbn, uint32_t pblk) {
-    uint32_t ppb = m->block_size / 4;
-    if (lbn < 12) {
-        in->i_block[lbn] = pblk;
-        return 0;
+// Lay out the journal inode's nblk log blocks from first on, each indirect
+// table just before the blocks it maps, and write the tables and the
+// journal superblock. The log is zeroed unless the whole device reads back
+// as zeroes (BLOCKDEV_F_ZEROED). Fills *in.
+static int ext2_mkfs_journal(blockdev_handle_t bdev, uint32_t partition_lba, const ext2_superblock_t *sb,
+                             uint32_t first, uint32_t nblk, int zeroed, ext2_inode_t *in) {
+    const uint32_t bs = 4096, ppb = bs / 4u;
+    uint32_t total = nblk + ext2_mkfs_journal_meta(nblk);
+    uint32_t chunk = EXT2_MAX_IO_BYTES / bs;
+    if (chunk > total) chunk = total;
+
+    int rc = 0;
+    uint8_t *buf = (uint8_t*)g_api->kmalloc((size_t)chunk * bs);
+    uint32_t *t = (uint32_t*)g_api->kmalloc((size_t)3 * bs);
+    if (!buf || !t) { rc = -1; goto out; }
+    m_memset(buf, 0, (size_t)chunk * bs);
+    m_memset(t, 0, (size_t)3 * bs);
+
+    if (!zeroed) {
+        for (uint32_t done = 0; done < total; done += chunk) {
+            uint32_t n = total - done < chunk ? total - done : chunk;
+            if (ext2_mkfs_write(bdev, partition_lba, first + done, n, buf) != 0) { rc = -2; goto out; }
+        }
     }
 
-    lbn -= 12;
-    if (lbn < ppb) {
-        if (in->i_block[12] == 0) {
-            uint32_t ind = 0;
-            if (ext2_alloc_block0(m, &ind) != 0) return -1;
-            in->i_block[12] = ind;
-            uint8_t *z = (uint8_t*)g_api->kmalloc(m->block_size);
-            if (!z) return -2;
-            m_memset(z, 0, m->block_size);
-            (void)ext2_write_block(m, ind, z);
-            g_api->kfree(z);
-        }
-        uint32_t *tbl = (uint32_t*)g_api->kmalloc(m->block_size);
-        if (!tbl) return -3;
-        if (ext2_read_block(m, in->i_block[12], tbl) != 0) { g_api->kfree(tbl); return -4; }
-        tbl[lbn] = pblk;
-        int rc = ext2_write_block(m, in->i_block[12], tbl);
-        g_api->kfree(tbl);
-        return rc;
+    uint32_t *ind = t, *dind = t + ppb, *l2 = t + 2u * ppb;
+    uint32_t pos = first, l2blk = 0;
+    m_memset(in, 0, sizeof(*in));
+    for (uint32_t l = 0; l < nblk; l++) {
+        if (l < 12) { in->i_block[l] = pos++; continue; }
+        if (l == 12) in->i_block[12] = pos++;
+        if (l < 12 + ppb) { ind[l - 12] = pos++; continue; }
+        if (l == 12 + ppb) in->i_block[13] = pos++;
+        uint32_t k = l - 12 - ppb;
+        if (k % ppb == 0) {
+            if (l2blk && ext2_mkfs_write(bdev, partition_lba, l2blk, 1, l2) != 0) { rc = -3; goto out; }
+            m_memset(l2, 0, bs);
+            l2blk = pos++;
+            dind[k / ppb] = l2blk;
+        }
+        l2[k % ppb] = pos++;
     }
-
-    return -5; // no double-indirect in write path yet
+    if (l2blk && ext2_mkfs_write(bdev, partition_lba, l2blk, 1, l2) != 0) { rc = -3; goto out; }
+    if (in->i_block[13] && ext2_mkfs_write(bdev, partition_lba, in->i_block[13], 1, dind) != 0) { rc = -3; goto out; }
+    if (in->i_block[12] && ext2_mkfs_write(bdev, partition_lba, in->i_block[12], 1, ind) != 0) { rc = -3; goto out; }
+
+    m_memset(buf, 0, bs);
+    jbd_header(buf, JBD_SUPERBLOCK_V2, 0);
+    jbd_put32(buf + JBD_SB_BLOCKSIZE, bs);
+    jbd_put32(buf + JBD_SB_MAXLEN, nblk);
+    jbd_put32(buf + JBD_SB_FIRST, 1);
+    jbd_put32(buf + JBD_SB_SEQUENCE, 1);
+    m_memcpy(buf + JBD_SB_UUID, sb->s_uuid, 16);
+    jbd_put32(buf + JBD_SB_NR_USERS, 1);
+    if (ext2_mkfs_write(bdev, partition_lba, in->i_block[0], 1, buf) != 0) { rc = -4; goto out; }
+
+    in->i_mode = (uint16_t)(0x8000 | 0600);
+    in->i_size = nblk * bs;
+    in->i_links_count = 1;
+    in->i_blocks = total * (bs / 512u);
+
+out:
+    if (buf) g_api->kfree(buf);
+    if (t) g_api->kfree(t);
+    return rc;
 }
 
+// Lay out 4KiB-block groups of 32768 blocks with sparse superblock backups
+// and one inode per EXT2_MKFS_INODE_RATIO bytes, plus an ext3 journal
+// (EXT2_MKFS_JOURNAL). Each group's bitmaps and
+// inode table go out in requests of up to EXT2_MAX_IO_BYTES. Inode tables
+// are left alone on devices that report BLOCKDEV_F_ZEROED, i.e. read back
+// as all zeroes: plain ext2 has no way to mark a stale table uninitialised.
 static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_sectors, const char *volume_label) {
     if (!g_api || !g_api->block_get_handle_for_vdrive || !g_api->block_write) return -1;
 
@@ -1512,9 +6318,11 @@ static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_s
     blockdev_handle_t bdev = BLOCKDEV_INVALID_HANDLE;
     if (g_api->block_get_handle_for_vdrive(vdrive_id, &bdev) != 0) return -3;
 
+    int zeroed = 0;
     blockdev_info_t info;
     if (g_api->block_get_info && g_api->block_get_info(bdev, &info) == 0) {
         if (info.sector_size != 512) return -4;
+        zeroed = (info.flags & BLOCKDEV_F_ZEROED) != 0;
     }
 
     // 4KiB blocks
@@ -1523,54 +6331,64 @@ static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_s
     uint32_t total_blocks = partition_sectors / sectors_per_block;
     if (total_blocks < 32) return -5;
 
-    const uint32_t inodes_per_group = 256;
     const uint32_t inode_size = 128;
-    const uint32_t inode_table_blocks = (inodes_per_group * inode_size + block_size - 1) / block_size;
+    const uint32_t inodes_per_block = block_size / inode_size;
+    const uint32_t blocks_per_group = block_size * 8u;
+
+    uint32_t groups = (total_blocks + blocks_per_group - 1) / blocks_per_group;
+    uint64_t want_inodes = (uint64_t)total_blocks * block_size / EXT2_MKFS_INODE_RATIO;
+    uint32_t inodes_per_group = (uint32_t)((want_inodes + groups - 1) / groups);
+    inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    if (inodes_per_group < inodes_per_block) inodes_per_group = inodes_per_block;
+    if (inodes_per_group > blocks_per_group) inodes_per_group = blocks_per_group;
+    const uint32_t inode_table_blocks = inodes_per_group / inodes_per_block;
+    uint32_t gdt_blocks = (uint32_t)((groups * sizeof(ext2_bgdt_t) + block_size - 1) / block_size);
+
+    // A last group too small for its metadata and some data is left out.
+    uint32_t last_start = (groups - 1) * blocks_per_group;
+    uint32_t last_meta = (ext2_group_has_super(groups - 1) ? 1 + gdt_blocks : 0) + 2 + inode_table_blocks;
+    if (groups > 1 && total_blocks - last_start < last_meta + 64) {
+        total_blocks = last_start;
+        groups--;
+        gdt_blocks = (uint32_t)((groups * sizeof(ext2_bgdt_t) + block_size - 1) / block_size);
+    }
 
-    const uint32_t super_blockno = 0;
-    const uint32_t bgdt_blockno = 1;
-    const uint32_t block_bmp_blockno = 2;
-    const uint32_t inode_bmp_blockno = 3;
-    const uint32_t inode_table_blockno = 4;
-    const uint32_t first_data_blockno = inode_table_blockno + inode_table_blocks;
-    if (first_data_blockno + 2 >= total_blocks) return -6;
+    // Group 0: superblock, descriptors, bitmaps, inode table, then the
+    // root and lost+found directory blocks and the journal.
+    const uint32_t inode_table_blockno = 1 + gdt_blocks + 2;
+    const uint32_t root_dir_blockno = inode_table_blockno + inode_table_blocks;
+    const uint32_t lostfound_blockno = root_dir_blockno + 1;
+    const uint32_t journal_blockno = lostfound_blockno + 1;
+    uint32_t group0_blocks = total_blocks < blocks_per_group ? total_blocks : blocks_per_group;
+    if (lostfound_blockno + 2 >= group0_blocks) return -6;
+
+    uint32_t journal_blocks = EXT2_MKFS_JOURNAL ? ext2_mkfs_journal_size(total_blocks) : 0;
+    while (journal_blocks && journal_blockno + journal_blocks + ext2_mkfs_journal_meta(journal_blocks) + 64u > group0_blocks) {
+        journal_blocks /= 2;
+    }
+    if (journal_blocks < 1024u) journal_blocks = 0;
 
-    const uint32_t root_dir_blockno = first_data_blockno;
-    const uint32_t lostfound_blockno = first_data_blockno + 1;
+    uint32_t chunk = EXT2_MAX_IO_BYTES / block_size;
+    if (chunk > 2 + inode_table_blocks) chunk = 2 + inode_table_blocks;
+    if (chunk < 2) chunk = 2;
 
-    // Buffers
+    int rc = 0;
     uint8_t *blk = (uint8_t*)g_api->kmalloc(block_size);
-    uint8_t *block_bmp = (uint8_t*)g_api->kmalloc(block_size);
-    uint8_t *inode_bmp = (uint8_t*)g_api->kmalloc(block_size);
-    if (!blk || !block_bmp || !inode_bmp) {
-        if (blk) g_api->kfree(blk);
-        if (block_bmp) g_api->kfree(block_bmp);
-        if (inode_bmp) g_api->kfree(inode_bmp);
-        return -7;
-    }
-
-    // Zero blocks up to lost+found
-    m_memset(blk, 0, block_size);
-    for (uint32_t b = 0; b < first_data_blockno + 2; b++) {
-        uint64_t lba = (uint64_t)partition_lba + (uint64_t)b * sectors_per_block;
-        if (g_api->block_write(bdev, lba, sectors_per_block, blk, block_size) != 0) {
-            g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-            return -8;
-        }
-    }
+    uint8_t *head = (uint8_t*)g_api->kmalloc((size_t)(1 + gdt_blocks) * block_size);
+    uint8_t *buf = (uint8_t*)g_api->kmalloc((size_t)chunk * block_size);
+    if (!blk || !head || !buf) { rc = -7; goto out; }
 
     // Superblock
     ext2_superblock_t sb;
     m_memset(&sb, 0, sizeof(sb));
-    sb.s_inodes_count = inodes_per_group;
+    sb.s_inodes_count = inodes_per_group * groups;
     sb.s_blocks_count = total_blocks;
     sb.s_r_blocks_count = 0;
-    sb.s_free_inodes_count = (inodes_per_group > 11) ? (inodes_per_group - 11) : 0;
     sb.s_first_data_block = 0;
     sb.s_log_block_size = 2;
     sb.s_log_frag_size = 2;
-    sb.s_blocks_per_group = total_blocks;
-    sb.s_frags_per_group = total_blocks;
+    sb.s_blocks_per_group = blocks_per_group;
+    sb.s_frags_per_group = blocks_per_group;
     sb.s_inodes_per_group = inodes_per_group;
     sb.s_magic = EXT2_MAGIC;
     sb.s_state = 1;
@@ -1581,6 +6399,8 @@ static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_s
     sb.s_mnt_count = 0;
     sb.s_first_ino = 11;
     sb.s_inode_size = inode_size;
+    sb.s_feature_incompat = EXT2_INCOMPAT_FILETYPE; // every dirent below carries a file_type
+    sb.s_feature_ro_compat = EXT2_RO_COMPAT_SPARSE_SUPER;
     sb.s_max_mnt_count = -1;
     sb.s_def_resuid = 0;
     sb.s_def_resgid = 0;
@@ -1593,62 +6413,52 @@ static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_s
         m_strncpy(sb.s_volume_name, volume_label, sizeof(sb.s_volume_name));
     }
 
-    // Bitmaps
-    m_memset(block_bmp, 0, block_size);
-    m_memset(inode_bmp, 0, block_size);
-
-    // Used blocks: 0..lostfound
-    for (uint32_t b = 0; b <= lostfound_blockno; b++) {
-        set_bit(block_bmp, b);
-    }
-    // Padding bits
-    for (uint32_t bit = total_blocks; bit < block_size * 8u; bit++) set_bit(block_bmp, bit);
-
-    // Used inodes: 1..11
-    for (uint32_t ino = 1; ino <= 11; ino++) set_bit(inode_bmp, ino - 1);
-    for (uint32_t bit = inodes_per_group; bit < block_size * 8u; bit++) set_bit(inode_bmp, bit);
-
-    uint32_t used_in_group = lostfound_blockno + 1;
-    uint32_t free_blocks = (total_blocks > used_in_group) ? (total_blocks - used_in_group) : 0;
-    sb.s_free_blocks_count = free_blocks;
-
-    // BGDT
-    ext2_bgdt_t bg;
-    m_memset(&bg, 0, sizeof(bg));
-    bg.bg_block_bitmap = block_bmp_blockno;
-    bg.bg_inode_bitmap = inode_bmp_blockno;
-    bg.bg_inode_table = inode_table_blockno;
-    bg.bg_free_blocks_count = (uint16_t)free_blocks;
-    bg.bg_free_inodes_count = (uint16_t)sb.s_free_inodes_count;
-    bg.bg_used_dirs_count = 2;
-
-    // Write SB into block 0 at offset 1024
-    m_memset(blk, 0, block_size);
-    m_memcpy(blk + EXT2_SUPERBLOCK_OFF, &sb, sizeof(sb));
-    if (g_api->block_write(bdev, (uint64_t)partition_lba + (uint64_t)super_blockno * sectors_per_block, sectors_per_block, blk, block_size) != 0) {
-        g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-        return -9;
-    }
-
-    // BGDT
-    m_memset(blk, 0, block_size);
-    m_memcpy(blk, &bg, sizeof(bg));
-    if (g_api->block_write(bdev, (uint64_t)partition_lba + (uint64_t)bgdt_blockno * sectors_per_block, sectors_per_block, blk, block_size) != 0) {
-        g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-        return -10;
-    }
+    // Per group: bitmaps and inode table, descriptor built alongside. Only
+    // the two bitmap blocks of buf change between groups.
+    m_memset(head, 0, (size_t)(1 + gdt_blocks) * block_size);
+    m_memset(buf, 0, (size_t)chunk * block_size);
+    ext2_bgdt_t *gdt = (ext2_bgdt_t*)(head + block_size);
+    uint32_t free_blocks = 0, free_inodes = 0;
+    for (uint32_t g = 0; g < groups; g++) {
+        uint32_t start = g * blocks_per_group;
+        uint32_t nblocks = total_blocks - start < blocks_per_group ? total_blocks - start : blocks_per_group;
+        uint32_t bb = start + (ext2_group_has_super(g) ? 1 + gdt_blocks : 0);
+        uint32_t used = bb - start + 2 + inode_table_blocks;
+        uint32_t used_inodes = 0;
+        if (g == 0) {
+            used += 2; // root and lost+found directory blocks
+            if (journal_blocks) used += journal_blocks + ext2_mkfs_journal_meta(journal_blocks);
+            used_inodes = 11;
+        }
 
-    // block bitmap
-    if (g_api->block_write(bdev, (uint64_t)partition_lba + (uint64_t)block_bmp_blockno * sectors_per_block, sectors_per_block, block_bmp, block_size) != 0) {
-        g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-        return -11;
-    }
+        m_memset(buf, 0, (size_t)2 * block_size);
+        ext2_bitmap_set_range(buf, 0, used);
+        ext2_bitmap_set_range(buf, nblocks, blocks_per_group - nblocks);
+        ext2_bitmap_set_range(buf + block_size, 0, used_inodes);
+        ext2_bitmap_set_range(buf + block_size, inodes_per_group, blocks_per_group - inodes_per_group);
+
+        uint32_t todo = zeroed ? 2 : 2 + inode_table_blocks;
+        uint32_t n = todo < chunk ? todo : chunk;
+        if (ext2_mkfs_write(bdev, partition_lba, bb, n, buf) != 0) { rc = -8; goto out; }
+        if (n < todo) {
+            m_memset(buf, 0, (size_t)2 * block_size);
+            for (uint32_t done = n; done < todo; done += n) {
+                n = todo - done < chunk ? todo - done : chunk;
+                if (ext2_mkfs_write(bdev, partition_lba, bb + done, n, buf) != 0) { rc = -8; goto out; }
+            }
+        }
 
-    // inode bitmap
-    if (g_api->block_write(bdev, (uint64_t)partition_lba + (uint64_t)inode_bmp_blockno * sectors_per_block, sectors_per_block, inode_bmp, block_size) != 0) {
-        g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-        return -12;
+        gdt[g].bg_block_bitmap = bb;
+        gdt[g].bg_inode_bitmap = bb + 1;
+        gdt[g].bg_inode_table = bb + 2;
+        gdt[g].bg_free_blocks_count = (uint16_t)(nblocks - used);
+        gdt[g].bg_free_inodes_count = (uint16_t)(inodes_per_group - used_inodes);
+        gdt[g].bg_used_dirs_count = g == 0 ? 2 : 0;
+        free_blocks += nblocks - used;
+        free_inodes += inodes_per_group - used_inodes;
     }
+    sb.s_free_blocks_count = free_blocks;
+    sb.s_free_inodes_count = free_inodes;
 
     // Root inode (#2) and lost+found inode (#11)
     ext2_inode_t root;
@@ -1667,13 +6477,23 @@ static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_s
     lf.i_blocks = sectors_per_block;
     lf.i_block[0] = lostfound_blockno;
 
+    // Journal inode (#8), recorded in the superblock as mke2fs does
+    ext2_inode_t jin;
+    m_memset(&jin, 0, sizeof(jin));
+    if (journal_blocks) {
+        if (ext2_mkfs_journal(bdev, partition_lba, &sb, journal_blockno, journal_blocks, zeroed, &jin) != 0) { rc = -16; goto out; }
+        sb.s_feature_compat |= EXT3_COMPAT_HAS_JOURNAL;
+        sb.s_journal_inum = EXT3_JOURNAL_INO;
+        sb.s_jnl_backup_type = EXT3_JNL_BACKUP_BLOCKS;
+        m_memcpy(sb.s_jnl_blocks, jin.i_block, sizeof(jin.i_block));
+        sb.s_jnl_blocks[16] = jin.i_size;
+    }
+
     m_memset(blk, 0, block_size);
     m_memcpy(blk + inode_size * 1, &root, sizeof(root));
+    if (journal_blocks) m_memcpy(blk + inode_size * (EXT3_JOURNAL_INO - 1), &jin, sizeof(jin));
     m_memcpy(blk + inode_size * 10, &lf, sizeof(lf));
-    if (g_api->block_write(bdev, (uint64_t)partition_lba + (uint64_t)inode_table_blockno * sectors_per_block, sectors_per_block, blk, block_size) != 0) {
-        g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-        return -13;
-    }
+    if (ext2_mkfs_write(bdev, partition_lba, inode_table_blockno, 1, blk) != 0) { rc = -13; goto out; }
 
     // Root directory block
     m_memset(blk, 0, block_size);
@@ -1699,10 +6519,7 @@ static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_s
     de3->rec_len = (uint16_t)(block_size - (de1->rec_len + de2->rec_len));
     m_memcpy((uint8_t*)de3 + 8, "lost+found", 10);
 
-    if (g_api->block_write(bdev, (uint64_t)partition_lba + (uint64_t)root_dir_blockno * sectors_per_block, sectors_per_block, blk, block_size) != 0) {
-        g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-        return -14;
-    }
+    if (ext2_mkfs_write(bdev, partition_lba, root_dir_blockno, 1, blk) != 0) { rc = -14; goto out; }
 
     // lost+found directory block
     m_memset(blk, 0, block_size);
@@ -1721,15 +6538,27 @@ static int ext2_mkfs(int vdrive_id, uint32_t partition_lba, uint32_t partition_s
     ((char*)blk)[lf1->rec_len + 8] = '.';
     ((char*)blk)[lf1->rec_len + 9] = '.';
 
-    if (g_api->block_write(bdev, (uint64_t)partition_lba + (uint64_t)lostfound_blockno * sectors_per_block, sectors_per_block, blk, block_size) != 0) {
-        g_api->kfree(blk); g_api->kfree(block_bmp); g_api->kfree(inode_bmp);
-        return -15;
-    }
+    if (ext2_mkfs_write(bdev, partition_lba, lostfound_blockno, 1, blk) != 0) { rc = -15; goto out; }
 
-    g_api->kfree(blk);
-    g_api->kfree(block_bmp);
-    g_api->kfree(inode_bmp);
-    return 0;
+    // Backup superblocks (at the start of their block) and descriptor
+    // tables, then the primary copy last.
+    for (uint32_t g = groups - 1; g > 0; g--) {
+        if (!ext2_group_has_super(g)) continue;
+        sb.s_block_group_nr = (uint16_t)g;
+        m_memset(head, 0, block_size);
+        m_memcpy(head, &sb, sizeof(sb));
+        if (ext2_mkfs_write(bdev, partition_lba, g * blocks_per_group, 1 + gdt_blocks, head) != 0) { rc = -9; goto out; }
+    }
+    sb.s_block_group_nr = 0;
+    m_memset(head, 0, block_size);
+    m_memcpy(head + EXT2_SUPERBLOCK_OFF, &sb, sizeof(sb));
+    if (ext2_mkfs_write(bdev, partition_lba, 0, 1 + gdt_blocks, head) != 0) { rc = -10; goto out; }
+
+out:
+    if (blk) g_api->kfree(blk);
+    if (head) g_api->kfree(head);
+    if (buf) g_api->kfree(buf);
+    return rc;
 }
 
 static const fs_ext_driver_ops_t g_ext2_ops = {
@@ -1749,6 +6578,18 @@ static const fs_ext_driver_ops_t g_ext2_ops = {
     .opendir = ext2_opendir,
     .readdir = ext2_readdir,
     .closedir = ext2_closedir,
+    .sync = ext2_sync,
+    .readdir_batch = ext2_readdir_batch,
+    .open = ext2_open,
+    .read_at = ext2_read_at,
+    .write_at = ext2_write_at,
+    .truncate = ext2_truncate,
+    .close = ext2_close,
+    .write_file_at = ext2_write_file_at,
+    .defrag = ext2_defrag,
+    .fallocate = ext2_fallocate,
+    .get_pages = ext2_get_pages,
+    .put_pages = ext2_put_pages,
 };
 
 static void u32_to_dec(char *out, size_t out_sz, uint32_t v) {
@@ -1780,7 +6621,7 @@ static void i32_to_dec(char *out, size_t out_sz, int32_t v) {
 
 int sqrm_module_init(const sqrm_kernel_api_t *api) {
     g_api = api;
-    if (!api || api->abi_version != 1) return -1;
+    if (!api || api->abi_version != SQRM_ABI_VERSION) return -1;
     if (!api->fs_register_driver) return -2;
     if (!api->block_get_handle_for_vdrive || !api->block_read || !api->block_get_info) return -3;
 
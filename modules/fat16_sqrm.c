@@ -53,7 +53,7 @@ static uint32_t div_ceil_u32(uint32_t a, uint32_t b) {
 }
 
 static const sqrm_module_desc_t sqrm_module_desc = {
-    .abi_version = 1,
+    .abi_version = SQRM_ABI_VERSION,
     .type = SQRM_TYPE_FS,
     .name = "fat16",
 };
@@ -382,6 +382,132 @@ static int fat16_read_file(fs_mount_t *mount, const char *path, void *out, size_
     return 0;
 }
 
+// Open file: the cluster chain is recorded as it is walked (with the last FAT
+// sector cached), so random access follows each link at most once.
+typedef struct {
+    fat16_mount_ctx_t *m;
+    uint32_t size;
+    uint16_t *chain;
+    uint32_t chain_len; // clusters known so far
+    uint32_t chain_cap; // clusters needed to cover size
+    uint32_t fat_sec;   // FAT sector held in fat_buf
+    int fat_valid;
+    uint8_t fat_buf[512];
+} fat16_file_t;
+
+// Cluster number of cluster index ci of the file, or 0 past the chain end.
+static uint16_t fat16_file_cluster(fat16_file_t *f, uint32_t ci) {
+    if (ci >= f->chain_cap) return 0;
+    while (f->chain_len <= ci) {
+        uint16_t cl = f->chain[f->chain_len - 1];
+        uint32_t off = (uint32_t)cl * 2u;
+        uint32_t sec = f->m->fat_start_lba + off / 512u;
+        if (!f->fat_valid || f->fat_sec != sec) {
+            f->fat_valid = 0;
+            if (read512(f->m, sec, f->fat_buf) != 0) return 0;
+            f->fat_sec = sec;
+            f->fat_valid = 1;
+        }
+        uint16_t nxt = (uint16_t)(f->fat_buf[off % 512u] | ((uint16_t)f->fat_buf[off % 512u + 1] << 8));
+        if (nxt >= FAT16_EOC_MIN || nxt < 2) return 0;
+        f->chain[f->chain_len++] = nxt;
+    }
+    return f->chain[ci];
+}
+
+// Read-only driver: write flags are refused.
+static fs_file_t* fat16_open(fs_mount_t *mount, const char *path, uint32_t flags) {
+    if (!mount || !mount->ext_ctx || !path) return NULL;
+    if (flags & (FS_OPEN_WRITE | FS_OPEN_CREATE | FS_OPEN_TRUNC)) return NULL;
+    fat16_mount_ctx_t *m = (fat16_mount_ctx_t*)mount->ext_ctx;
+
+    fat_dirent_t e;
+    int is_dir = 0;
+    if (!fat16_walk_path(m, path, &e, &is_dir) || is_dir) return NULL;
+
+    fs_file_t *file = (fs_file_t*)g_api->kmalloc(sizeof(fs_file_t));
+    fat16_file_t *f = (fat16_file_t*)g_api->kmalloc(sizeof(fat16_file_t));
+    if (!file || !f) {
+        if (file) g_api->kfree(file);
+        if (f) g_api->kfree(f);
+        return NULL;
+    }
+    m_memset(file, 0, sizeof(*file));
+    m_memset(f, 0, sizeof(*f));
+    f->m = m;
+    f->size = e.filesize;
+    if (e.filesize && e.first_cluster_low >= 2) {
+        f->chain_cap = div_ceil_u32(e.filesize, m->bytes_per_cluster);
+        f->chain = (uint16_t*)g_api->kmalloc(sizeof(uint16_t) * f->chain_cap);
+        if (!f->chain) {
+            g_api->kfree(f);
+            g_api->kfree(file);
+            return NULL;
+        }
+        f->chain[0] = e.first_cluster_low;
+        f->chain_len = 1;
+    }
+
+    file->mount = mount;
+    m_strncpy(file->path, path, sizeof(file->path));
+    file->flags = flags;
+    file->fs_specific = f;
+    return file;
+}
+
+static int fat16_read_at(fs_file_t *file, uint64_t offset, void *buffer, size_t size, size_t *bytes_read) {
+    if (bytes_read) *bytes_read = 0;
+    if (!file || !file->fs_specific || (!buffer && size)) return -1;
+    fat16_file_t *f = (fat16_file_t*)file->fs_specific;
+    fat16_mount_ctx_t *m = f->m;
+
+    if (offset >= f->size) return 0;
+    if (offset + size > f->size) size = (size_t)(f->size - offset);
+
+    uint8_t *out = (uint8_t*)buffer;
+    uint32_t pos = (uint32_t)offset;
+    uint32_t end = pos + (uint32_t)size;
+    uint8_t sec[512];
+    while (pos < end) {
+        uint16_t cl = fat16_file_cluster(f, pos / m->bytes_per_cluster);
+        if (cl < 2) return -2;
+        uint32_t in_cl = pos % m->bytes_per_cluster;
+        uint32_t lba = fat16_cluster_to_lba(m, cl) + in_cl / 512u;
+        uint32_t in_sec = pos % 512u;
+
+        if (in_sec != 0 || end - pos < 512u) {
+            uint32_t chunk = 512u - in_sec;
+            if (chunk > end - pos) chunk = end - pos;
+            if (read512(m, lba, sec) != 0) return -3;
+            m_memcpy(out, sec + in_sec, chunk);
+            out += chunk;
+            pos += chunk;
+            continue;
+        }
+
+        // Whole sectors up to the end of the cluster in one request.
+        uint32_t n = (m->bytes_per_cluster - in_cl) / 512u;
+        if (n > (end - pos) / 512u) n = (end - pos) / 512u;
+        if (g_api->block_read(m->bdev, m->part_lba + lba, n, out, (size_t)n * 512u) != 0) return -3;
+        out += n * 512u;
+        pos += n * 512u;
+    }
+
+    if (bytes_read) *bytes_read = size;
+    return 0;
+}
+
+static int fat16_close(fs_file_t *file) {
+    if (!file || !g_api) return -1;
+    fat16_file_t *f = (fat16_file_t*)file->fs_specific;
+    if (f) {
+        if (f->chain) g_api->kfree(f->chain);
+        g_api->kfree(f);
+    }
+    g_api->kfree(file);
+    return 0;
+}
+
 static int fat16_stat(fs_mount_t *mount, const char *path, fs_file_info_t *info) {
     if (!mount || !mount->ext_ctx || !path || !info) return -1;
     fat16_mount_ctx_t *m = (fat16_mount_ctx_t*)mount->ext_ctx;
@@ -418,8 +544,52 @@ typedef struct {
     fat16_mount_ctx_t *m;
     uint16_t dir_cluster; // 0=root
     uint32_t idx;
+
+    // Sequential scan state: cluster holding entry idx and the last sector read.
+    uint16_t cl;
+    uint32_t cl_index;
+    uint32_t sec_lba;
+    int sec_valid;
+    uint8_t sec[512];
 } fat16_dir_iter_t;
 
+// Read entry it->idx. Unlike fat16_read_dir_cluster(), which walks the chain
+// from the start and rereads the sector for every entry, this follows the
+// chain one link at a time and reuses the cached sector.
+static int fat16_dir_iter_read(fat16_dir_iter_t *it, fat_dirent_t *out) {
+    fat16_mount_ctx_t *m = it->m;
+    uint32_t byte_off = it->idx * 32u;
+    uint32_t lba;
+
+    if (it->dir_cluster == 0) {
+        uint32_t sec = byte_off / 512u;
+        if (sec >= m->root_sectors) return 0;
+        lba = m->root_start_lba + sec;
+    } else {
+        uint32_t ci = byte_off / m->bytes_per_cluster;
+        if (it->cl < 2 || ci < it->cl_index) {
+            it->cl = it->dir_cluster;
+            it->cl_index = 0;
+        }
+        while (it->cl_index < ci) {
+            uint16_t nxt = fat16_get_fat_entry(m, it->cl);
+            if (nxt >= FAT16_EOC_MIN || nxt < 2) return 0;
+            it->cl = nxt;
+            it->cl_index++;
+        }
+        lba = fat16_cluster_to_lba(m, it->cl) + (byte_off % m->bytes_per_cluster) / 512u;
+    }
+
+    if (!it->sec_valid || it->sec_lba != lba) {
+        it->sec_valid = 0;
+        if (read512(m, lba, it->sec) != 0) return -1;
+        it->sec_lba = lba;
+        it->sec_valid = 1;
+    }
+    m_memcpy(out, it->sec + (byte_off % 512u), sizeof(*out));
+    return 1;
+}
+
 static fs_dir_t* fat16_opendir(fs_mount_t *mount, const char *path) {
     if (!mount || !mount->ext_ctx) return NULL;
     fat16_mount_ctx_t *m = (fat16_mount_ctx_t*)mount->ext_ctx;
@@ -435,6 +605,7 @@ static fs_dir_t* fat16_opendir(fs_mount_t *mount, const char *path) {
 
     fat16_dir_iter_t *it = (fat16_dir_iter_t*)g_api->kmalloc(sizeof(*it));
     if (!it) return NULL;
+    m_memset(it, 0, sizeof(*it));
     it->m = m;
     it->dir_cluster = dir_cluster;
     it->idx = 0;
@@ -447,8 +618,7 @@ static int fat16_readdir(fs_dir_t *dir, fs_dirent_t *entry) {
 
     while (1) {
         fat_dirent_t e;
-        int rr = (it->dir_cluster == 0) ? fat16_read_dir_root(it->m, it->idx, &e)
-                                        : fat16_read_dir_cluster(it->m, it->dir_cluster, it->idx, &e);
+        int rr = fat16_dir_iter_read(it, &e);
         it->idx++;
 
         if (rr == 0) return 0;
@@ -467,6 +637,47 @@ static int fat16_readdir(fs_dir_t *dir, fs_dirent_t *entry) {
     }
 }
 
+// Native readdir_batch: one pass over the directory sectors, packing
+// fs_dirent_rec_t records until the next one does not fit.
+static int fat16_readdir_batch(fs_dir_t *dir, void *buf, size_t buf_size) {
+    if (!dir || !buf) return -1;
+    fat16_dir_iter_t *it = (fat16_dir_iter_t*)dir;
+
+    uint8_t *out = (uint8_t*)buf;
+    size_t used = 0;
+    while (1) {
+        fat_dirent_t e;
+        int rr = fat16_dir_iter_read(it, &e);
+        if (rr < 0) return used ? (int)used : -2;
+        if (rr == 0 || e.name[0] == 0x00) break;
+
+        if (e.name[0] == 0xE5 || e.attr == ATTR_LONG_NAME || (e.attr & ATTR_VOLUME_ID)) {
+            it->idx++;
+            continue;
+        }
+
+        char name[13];
+        fat16_entry_to_name(&e, name, sizeof(name));
+        uint32_t nlen = (uint32_t)m_strlen(name);
+        uint32_t rl = FS_DIRENT_REC_LEN(nlen);
+        if (used + rl > buf_size) {
+            if (used == 0) return -3;
+            break;
+        }
+
+        fs_dirent_rec_t *r = (fs_dirent_rec_t*)(out + used);
+        m_memset(r, 0, rl);
+        r->rec_len = (uint16_t)rl;
+        r->name_len = (uint16_t)nlen;
+        r->size = e.filesize;
+        r->is_directory = (e.attr & ATTR_DIRECTORY) ? 1 : 0;
+        m_memcpy(r->name, name, nlen);
+        used += rl;
+        it->idx++;
+    }
+    return (int)used;
+}
+
 static void fat16_closedir(fs_dir_t *dir) {
     if (!dir || !g_api) return;
     g_api->kfree(dir);
@@ -643,11 +854,15 @@ static const fs_ext_driver_ops_t g_fat16_ops = {
     .opendir = fat16_opendir,
     .readdir = fat16_readdir,
     .closedir = fat16_closedir,
+    .readdir_batch = fat16_readdir_batch,
+    .open = fat16_open,
+    .read_at = fat16_read_at,
+    .close = fat16_close,
 };
 
 int sqrm_module_init(const sqrm_kernel_api_t *api) {
     g_api = api;
-    if (!api || api->abi_version != 1) return -1;
+    if (!api || api->abi_version != SQRM_ABI_VERSION) return -1;
     if (!api->fs_register_driver) return -2;
     if (!api->block_get_handle_for_vdrive || !api->block_read || !api->block_write) return -3;
     return api->fs_register_driver("fat16", &g_fat16_ops);
@@ -17,7 +17,7 @@ typedef enum {
 /* File information structure */
 typedef struct {
     char name[260];           /* File/directory name */
-    uint32_t size;            /* File size in bytes */
+    uint64_t size;            /* File size in bytes; 0 for directories */
     int is_directory;         /* 1 if directory, 0 if file */
     uint32_t cluster;         /* Starting cluster (FAT32) or extent (ISO9660) */
 } fs_file_info_t;
@@ -86,10 +86,36 @@ int fs_format(int vdrive_id, uint32_t partition_lba, uint32_t partition_sectors,
 // Forward declarations for external driver ops
 struct fs_dir;
 struct fs_dirent;
+struct fs_file;
 typedef struct fs_dir fs_dir_t;
 typedef struct fs_dirent fs_dirent_t;
-
-// External FS driver ops (for third-party FS modules)
+typedef struct fs_file fs_file_t;
+
+// open() flags for the handle-based file ops
+#define FS_OPEN_READ   0x1u
+#define FS_OPEN_WRITE  0x2u
+#define FS_OPEN_CREATE 0x4u  /* create an empty file if missing (needs FS_OPEN_WRITE) */
+#define FS_OPEN_TRUNC  0x8u  /* truncate to 0 on open (needs FS_OPEN_WRITE) */
+
+// fallocate() modes; 0 allocates the range and grows the file to cover it
+#define FS_FALLOC_KEEP_SIZE  0x1u  /* allocate without changing the file size */
+#define FS_FALLOC_PUNCH_HOLE 0x2u  /* free the range instead; implies KEEP_SIZE */
+
+// write_file_at() offset meaning "at the current end of file"
+#define FS_WRITE_APPEND ((uint64_t)-1)
+
+// One block of file data lent out by get_pages(). The memory belongs to the
+// driver's cache and stays valid and in place until put_pages() returns it.
+typedef struct fs_page {
+    const void *addr; // read-only file data starting at offset
+    uint64_t offset;  // file offset of addr[0]; a multiple of the block size
+    uint32_t len;     // valid bytes at addr; short only at end of file
+    uint32_t ref;     // driver cookie, passed back to put_pages()
+} fs_page_t;
+
+// External FS driver ops (for third-party FS modules). Its layout, and that
+// of the structs above, is part of the SQRM ABI: changing either needs a
+// SQRM_ABI_VERSION bump in sqrm_sdk.h.
 typedef struct fs_ext_driver_ops {
     // Return 1 if this FS recognizes the drive/partition, 0 otherwise.
     int (*probe)(int vdrive_id, uint32_t partition_lba);
@@ -128,6 +154,58 @@ typedef struct fs_ext_driver_ops {
     fs_dir_t* (*opendir)(fs_mount_t *mount, const char *path);
     int (*readdir)(fs_dir_t *dir, fs_dirent_t *entry);
     void (*closedir)(fs_dir_t *dir);
+
+    // Optional: push everything the driver buffers (file data awaiting
+    // allocation, dirty metadata) to the device. NULL => nothing is buffered.
+    int (*sync)(fs_mount_t *mount);
+
+    // Optional batched readdir: fill buf with as many fs_dirent_rec_t records
+    // as fit and return the number of bytes used, 0 at end of directory, or
+    // negative on error (including a buffer too small for the next record).
+    // Entries that do not fit stay unread for the next call. NULL => the
+    // kernel loops readdir() instead (see fs_ext_readdir_batch()).
+    int (*readdir_batch)(fs_dir_t *dir, void *buf, size_t buf_size);
+
+    // Optional handle-based file access. A handle keeps whatever the driver
+    // needs for cheap random access (inode, block map, cluster chain), so
+    // read_at/write_at cost O(request size) instead of a path lookup plus a
+    // read from offset 0. NULL => only read_file/write_file are available.
+    fs_file_t* (*open)(fs_mount_t *mount, const char *path, uint32_t flags);
+    int (*read_at)(fs_file_t *file, uint64_t offset, void *buffer, size_t size, size_t *bytes_read);
+    int (*write_at)(fs_file_t *file, uint64_t offset, const void *buffer, size_t size, size_t *bytes_written);
+    int (*truncate)(fs_file_t *file, uint64_t size);
+    int (*close)(fs_file_t *file);
+
+    // Optional positional write by path: size bytes at offset, growing the
+    // file (and creating it) as needed, leaving the rest of the file alone.
+    // offset == FS_WRITE_APPEND appends at the current end of file. NULL =>
+    // the kernel falls back to read-modify-write through write_file.
+    int (*write_file_at)(fs_mount_t *mount, const char *path, const void *buffer, size_t size, uint64_t offset);
+
+    // Optional online defragmentation: rewrite fragmented files into
+    // contiguous free space. path names one regular file; NULL means every
+    // file on the volume. Returns the number of files moved or negative on
+    // error. NULL => the driver does not defragment.
+    int (*defrag)(fs_mount_t *mount, const char *path);
+
+    // Optional space control on an open handle (needs FS_OPEN_WRITE).
+    // mode 0 or FS_FALLOC_KEEP_SIZE gives [offset, offset + len) blocks of
+    // its own so later writes there cannot run out of space; the range reads
+    // as zeroes where it was a hole. FS_FALLOC_PUNCH_HOLE frees the blocks
+    // of the range and leaves a hole that reads as zeroes. NULL => the
+    // driver allocates only on write and never punches.
+    int (*fallocate)(fs_file_t *file, uint32_t mode, uint64_t offset, uint64_t len);
+
+    // Optional zero-copy reads: fill pages[] in file order with the driver's
+    // own cached blocks covering [offset, offset + len), at most max_pages of
+    // them, so the kernel can map or splice file data without copying it.
+    // Buffers are aligned to the block size or the 4 KiB page size, whichever
+    // is smaller; holes point at a shared zero block. Returns the number of
+    // pages filled (0 at end of file; fewer than asked when the driver's cache
+    // cannot lend more) or negative on error. Every page must go back through
+    // put_pages() before the file is closed. NULL => use read_at.
+    int (*get_pages)(fs_file_t *file, uint64_t offset, size_t len, fs_page_t *pages, uint32_t max_pages);
+    void (*put_pages)(fs_file_t *file, const fs_page_t *pages, uint32_t count);
 } fs_ext_driver_ops_t;
 
 // Register external filesystem driver (string-based). Built-ins always win; external drivers are tried only after.
@@ -214,7 +292,7 @@ int fs_read_file(fs_mount_t* mount, const char* path, void* buffer,
 int fs_write_file(fs_mount_t* mount, const char* path, const void* buffer, size_t size);
 
 // Offset-aware write (used by FD layer for sequential writes). Returns 0 on success.
-int fs_write_file_at(fs_mount_t* mount, const char* path, const void* buffer, size_t size, size_t offset);
+int fs_write_file_at(fs_mount_t* mount, const char* path, const void* buffer, size_t size, uint64_t offset);
 
 
 /**
@@ -239,11 +317,27 @@ int fs_file_exists(fs_mount_t* mount, const char* path);
 /* Directory entry structure for iteration */
 typedef struct fs_dirent {
     char name[260];           /* Entry name */
-    uint32_t size;            /* File size in bytes */
+    uint64_t size;            /* File size in bytes; 0 for directories */
     int is_directory;         /* 1 if directory, 0 if file */
     uint32_t reserved;        /* Reserved for future use */
 } fs_dirent_t;
 
+/* Compact variable-length record produced by readdir_batch. Records are
+ * packed back to back; walk them with rec_len. The buffer must be 8-byte
+ * aligned so every record's size field is. */
+typedef struct fs_dirent_rec {
+    uint16_t rec_len;         /* Bytes to the next record (multiple of 8) */
+    uint16_t name_len;        /* Name length, excluding the NUL */
+    uint8_t is_directory;     /* 1 if directory, 0 if file */
+    uint8_t reserved[3];
+    uint64_t size;            /* File size in bytes; 0 for directories */
+    char name[];              /* NUL-terminated name */
+} fs_dirent_rec_t;
+
+#define FS_DIRENT_REC_HDR ((uint32_t)offsetof(fs_dirent_rec_t, name))
+#define FS_DIRENT_REC_LEN(name_len) ((FS_DIRENT_REC_HDR + (uint32_t)(name_len) + 1u + 7u) & ~7u)
+#define FS_DIRENT_REC_MAX FS_DIRENT_REC_LEN(sizeof(((fs_dirent_t*)0)->name) - 1u)
+
 /* Directory handle for iteration */
 typedef struct fs_dir {
     fs_mount_t* mount;        /* Mount point */
@@ -254,4 +348,48 @@ typedef struct fs_dir {
     // External FS directory iteration
     const fs_ext_driver_ops_t *ext_ops;
 } fs_dir_t;
+
+/* Open file handle for the handle-based ext ops */
+typedef struct fs_file {
+    fs_mount_t* mount;        /* Mount point */
+    char path[256];           /* File path */
+    uint32_t flags;           /* FS_OPEN_* flags */
+    void* fs_specific;        /* Filesystem-specific data */
+
+    const fs_ext_driver_ops_t *ext_ops;
+} fs_file_t;
+
+/**
+ * Batched directory read for an external driver's directory handle.
+ * Uses the driver's readdir_batch when it has one; otherwise loops readdir(),
+ * stopping while a worst-case record still fits so no entry is lost.
+ * @return: bytes of fs_dirent_rec_t records in buf, 0 at end, negative on error
+ */
+static inline int fs_ext_readdir_batch(const fs_ext_driver_ops_t *ops, fs_dir_t *dir,
+                                       void *buf, size_t buf_size) {
+    if (!ops || !dir || !buf) return -1;
+    if (ops->readdir_batch) return ops->readdir_batch(dir, buf, buf_size);
+    if (!ops->readdir) return -1;
+    if (buf_size < FS_DIRENT_REC_MAX) return -2;
+
+    size_t used = 0;
+    while (buf_size - used >= FS_DIRENT_REC_MAX) {
+        fs_dirent_t e;
+        int rc = ops->readdir(dir, &e);
+        if (rc < 0) return used ? (int)used : rc;
+        if (rc == 0) break;
+
+        uint32_t nlen = 0;
+        while (nlen + 1 < sizeof(e.name) && e.name[nlen]) nlen++;
+        fs_dirent_rec_t *r = (fs_dirent_rec_t*)((uint8_t*)buf + used);
+        r->rec_len = (uint16_t)FS_DIRENT_REC_LEN(nlen);
+        r->name_len = (uint16_t)nlen;
+        r->size = e.size;
+        r->is_directory = e.is_directory ? 1 : 0;
+        for (uint32_t i = 0; i < nlen; i++) r->name[i] = e.name[i];
+        r->name[nlen] = 0;
+        used += r->rec_len;
+    }
+    return (int)used;
+}
 #endif /* FS_H */
\ No newline at end of file
@@ -5,7 +5,7 @@
 #define COM1_PORT 0x3F8
 
 static const sqrm_module_desc_t sqrm_module_desc = {
-    .abi_version = 1,
+    .abi_version = SQRM_ABI_VERSION,
     .type = SQRM_TYPE_USB,
     .name = "hello",
 };
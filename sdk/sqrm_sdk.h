@@ -22,8 +22,11 @@ extern "C" {
 
 /* ---- SQRM core ---- */
 
+/* Bump on any layout change to a shared struct or ops table; the kernel and
+   modules refuse to pair across versions.
+   2: 64-bit file sizes and offsets; fs ops through get_pages/put_pages. */
 #ifndef SQRM_ABI_VERSION
-#define SQRM_ABI_VERSION 1u
+#define SQRM_ABI_VERSION 2u
 #endif
 
 #define SQRM_DESC_SYMBOL "sqrm_module_desc"
@@ -58,6 +61,10 @@ typedef uint32_t blockdev_handle_t;
 typedef enum {
     BLOCKDEV_F_READONLY  = 1u << 0,
     BLOCKDEV_F_REMOVABLE = 1u << 1,
+    /* The whole device currently reads back as zeroes (fresh or fully
+       discarded). Set only while that holds; clear it once anything has
+       been written. mkfs then skips zeroing inode tables and the journal. */
+    BLOCKDEV_F_ZEROED    = 1u << 2,
 } blockdev_flags_t;
 
 typedef struct {
@@ -84,7 +91,7 @@ typedef enum {
 
 typedef struct {
     char name[260];
-    uint32_t size;
+    uint64_t size;
     int is_directory;
     uint32_t cluster;
 } fs_file_info_t;
@@ -102,15 +109,52 @@ typedef struct {
 } fs_mount_t;
 
 typedef struct fs_dir fs_dir_t;
+typedef struct fs_file fs_file_t;
+
+/* open() flags for the handle-based file ops */
+#define FS_OPEN_READ   0x1u
+#define FS_OPEN_WRITE  0x2u
+#define FS_OPEN_CREATE 0x4u  /* needs FS_OPEN_WRITE */
+#define FS_OPEN_TRUNC  0x8u  /* needs FS_OPEN_WRITE */
+
+/* fallocate() modes; 0 allocates the range and grows the file to cover it */
+#define FS_FALLOC_KEEP_SIZE  0x1u
+#define FS_FALLOC_PUNCH_HOLE 0x2u  /* implies FS_FALLOC_KEEP_SIZE */
+
+/* write_file_at() offset meaning "at the current end of file" */
+#define FS_WRITE_APPEND ((uint64_t)-1)
+
+/* One block of file data lent out by get_pages(); valid until put_pages() */
+typedef struct fs_page {
+    const void *addr;   /* read-only file data starting at offset */
+    uint64_t offset;    /* block-aligned file offset of addr[0] */
+    uint32_t len;       /* valid bytes; short only at end of file */
+    uint32_t ref;       /* driver cookie for put_pages() */
+} fs_page_t;
 
 typedef struct fs_dirent {
     char name[260];
-    uint32_t size;
+    uint64_t size;         /* 0 for directories */
     int is_directory;
     uint32_t reserved;
 } fs_dirent_t;
 
-/* External FS driver ops (v1: read-only) */
+/* Compact record produced by readdir_batch; walk a buffer by rec_len.
+   The buffer must be 8-byte aligned. */
+typedef struct fs_dirent_rec {
+    uint16_t rec_len;      /* bytes to the next record (multiple of 8) */
+    uint16_t name_len;     /* excluding the NUL */
+    uint8_t is_directory;
+    uint8_t reserved[3];
+    uint64_t size;         /* 0 for directories */
+    char name[];           /* NUL-terminated */
+} fs_dirent_rec_t;
+
+#define FS_DIRENT_REC_HDR ((uint32_t)offsetof(fs_dirent_rec_t, name))
+#define FS_DIRENT_REC_LEN(name_len) ((FS_DIRENT_REC_HDR + (uint32_t)(name_len) + 1u + 7u) & ~7u)
+#define FS_DIRENT_REC_MAX FS_DIRENT_REC_LEN(sizeof(((fs_dirent_t*)0)->name) - 1u)
+
+/* External FS driver ops (layout must match the kernel's fs.h) */
 typedef struct fs_ext_driver_ops {
     int (*probe)(int vdrive_id, uint32_t partition_lba);
     int (*mount)(int vdrive_id, uint32_t partition_lba, fs_mount_t *mount);
@@ -125,9 +169,48 @@ typedef struct fs_ext_driver_ops {
     int (*directory_exists)(fs_mount_t *mount, const char *path);
     int (*list_directory)(fs_mount_t *mount, const char *path);
 
+    /* Optional mutation (NULL => unsupported) */
+    int (*mkdir)(fs_mount_t *mount, const char *path);
+    int (*rmdir)(fs_mount_t *mount, const char *path);
+    int (*unlink)(fs_mount_t *mount, const char *path);
+
     fs_dir_t* (*opendir)(fs_mount_t *mount, const char *path);
     int (*readdir)(fs_dir_t *dir, fs_dirent_t *entry);
     void (*closedir)(fs_dir_t *dir);
+
+    /* Optional: flush buffered data and metadata to the device */
+    int (*sync)(fs_mount_t *mount);
+
+    /* Optional: fill buf with fs_dirent_rec_t records; returns bytes used,
+       0 at end, <0 on error. Entries that do not fit stay for the next call.
+       NULL => the kernel falls back to readdir(). */
+    int (*readdir_batch)(fs_dir_t *dir, void *buf, size_t buf_size);
+
+    /* Optional handle-based file access (NULL => read_file/write_file only).
+       read_at/write_at report short counts at end of file via *bytes_*. */
+    fs_file_t* (*open)(fs_mount_t *mount, const char *path, uint32_t flags);
+    int (*read_at)(fs_file_t *file, uint64_t offset, void *buffer, size_t size, size_t *bytes_read);
+    int (*write_at)(fs_file_t *file, uint64_t offset, const void *buffer, size_t size, size_t *bytes_written);
+    int (*truncate)(fs_file_t *file, uint64_t size);
+    int (*close)(fs_file_t *file);
+
+    /* Optional: write size bytes at offset without replacing the file;
+       offset == FS_WRITE_APPEND appends at the current end of file. */
+    int (*write_file_at)(fs_mount_t *mount, const char *path, const void *buffer, size_t size, uint64_t offset);
+
+    /* Optional: move fragmented files into contiguous free space; path is
+       one regular file, NULL the whole volume. Returns files moved. */
+    int (*defrag)(fs_mount_t *mount, const char *path);
+
+    /* Optional: allocate [offset, offset + len) of an open file, or free it
+       with FS_FALLOC_PUNCH_HOLE. Holes read back as zeroes. */
+    int (*fallocate)(fs_file_t *file, uint32_t mode, uint64_t offset, uint64_t len);
+
+    /* Optional zero-copy reads: lend out cached blocks covering
+       [offset, offset + len) instead of copying them. Returns pages filled,
+       0 at end of file. Return every page with put_pages() before close. */
+    int (*get_pages)(fs_file_t *file, uint64_t offset, size_t len, fs_page_t *pages, uint32_t max_pages);
+    void (*put_pages)(fs_file_t *file, const fs_page_t *pages, uint32_t count);
 } fs_ext_driver_ops_t;
 
 /* ---- Kernel API table passed to modules ---- */